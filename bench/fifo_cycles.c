@@ -0,0 +1,96 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* DWT cycle counts of the usb_stmv2 FIFO copy kernels on STM32L476.
+ * Build with `make bench`, flash it and read bench_result with the debugger when bench_done is set.
+ * fifo_write pushes to the EP1 TX FIFO, flushed before every run. fifo_read pops the empty RX FIFO,
+ * so the data is undefined but the bus accesses are the same as for a received packet.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "../src/usb_32v2.c"
+
+#define BENCH_EP        1
+#define BENCH_RUNS      8
+
+/* cycles spent by the statement, read overhead included */
+#define BENCH_CYCLES(stmt) ({                   \
+        uint32_t _s = DWT->CYCCNT;              \
+        stmt;                                   \
+        DWT->CYCCNT - _s;                       \
+    })
+
+struct bench_rec {
+    uint16_t    len;        /* copy length in bytes */
+    uint8_t     align;      /* buffer offset from the 32-bit boundary */
+    uint32_t    write;      /* fifo_write cycles, minimum of the runs */
+    uint32_t    read;       /* fifo_read cycles, minimum of the runs */
+};
+
+static const uint16_t bench_len[] = {8, 16, 32, 63, 64};
+
+volatile struct bench_rec bench_result[sizeof(bench_len) / sizeof(bench_len[0])][4];
+volatile uint32_t bench_overhead;
+volatile uint32_t bench_done;
+
+static uint32_t bench_buf[(64 + 4) / 4];
+
+static uint32_t bench_write(uint8_t *buf, uint16_t len) {
+    uint32_t _t, _min = UINT32_MAX;
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        Flush_TX(BENCH_EP);
+        _t = BENCH_CYCLES(fifo_write(EPFIFO(BENCH_EP), buf, len));
+        if (_t < _min) _min = _t;
+    }
+    return _min - bench_overhead;
+}
+
+static uint32_t bench_read(uint8_t *buf, uint16_t len) {
+    uint32_t _t, _min = UINT32_MAX;
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        _t = BENCH_CYCLES(fifo_read(EPFIFO(0), buf, len));
+        if (_t < _min) _min = _t;
+    }
+    return _min - bench_overhead;
+}
+
+int main(void) {
+    uint32_t _t = UINT32_MAX;
+    /* cycle counter */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        uint32_t _c = BENCH_CYCLES(__asm__ volatile ("" ::: "memory"));
+        if (_c < _t) _t = _c;
+    }
+    bench_overhead = _t;
+    /* core and FIFO layout. device stays disconnected */
+    enable(true);
+    ep_config(0, USB_EPTYPE_CONTROL, 0x40);
+    ep_config(BENCH_EP | 0x80, USB_EPTYPE_BULK, 0x40);
+    for (unsigned l = 0; l < sizeof(bench_len) / sizeof(bench_len[0]); l++) {
+        for (int a = 0; a < 4; a++) {
+            uint8_t *buf = (uint8_t*)bench_buf + a;
+            bench_result[l][a].len = bench_len[l];
+            bench_result[l][a].align = a;
+            bench_result[l][a].write = bench_write(buf, bench_len[l]);
+            bench_result[l][a].read = bench_read(buf, bench_len[l]);
+        }
+    }
+    bench_done = 1;
+    while (1);
+}
@@ -196,8 +196,8 @@ static usbd_respond cdc_getdesc (usbd_ctlreq *req, void **address, uint16_t *len
 };
 
 
-static usbd_respond cdc_control(usbd_device *dev, usbd_ctlreq *req, usbd_rqc_callback *callback) {
-    if (((USB_REQ_RECIPIENT | USB_REQ_TYPE) & req->bmRequestType) != (USB_REQ_INTERFACE | USB_REQ_CLASS)) return usbd_fail;
+static usbd_respond cdc_control(usbd_device *dev, void *ctx, usbd_ctlreq *req, usbd_rqc_callback *callback) {
+    if ((USB_REQ_TYPE & req->bmRequestType) != USB_REQ_CLASS) return usbd_fail;
     switch (req->bRequest) {
     case USB_CDC_SET_CONTROL_LINE_STATE:
         return usbd_ack;
@@ -245,7 +245,7 @@ static void cdc_loopback(usbd_device *dev, uint8_t event, uint8_t ep) {
     }
 }
 
-static usbd_respond cdc_setconf (usbd_device *dev, uint8_t cfg) {
+static usbd_respond cdc_setconf (usbd_device *dev, void *ctx, uint8_t cfg) {
     switch (cfg) {
     case 0:
         /* deconfiguring device */
@@ -274,10 +274,15 @@ static usbd_respond cdc_setconf (usbd_device *dev, uint8_t cfg) {
     }
 }
 
+static const struct usbd_class cdc_class = {
+    .control    = cdc_control,
+    .config     = cdc_setconf,
+};
+
 static void cdc_init_usbd(void) {
     usbd_init(&udev, &usbd_hw, CDC_EP0_SIZE, ubuf, sizeof(ubuf));
-    usbd_reg_config(&udev, cdc_setconf);
-    usbd_reg_control(&udev, cdc_control);
+    /* communication and data interfaces */
+    usbd_reg_class(&udev, &cdc_class, 0, 0, 2);
     usbd_reg_descr(&udev, cdc_getdesc);
 }
 
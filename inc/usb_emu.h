@@ -0,0 +1,406 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USB_EMU_H_
+#define _USB_EMU_H_
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+
+/**\addtogroup USBD_EMU USB peripheral emulation
+ * \brief Software models of the STM32 USB peripherals for the host-side (x86) builds
+ * \details Used instead of the CMSIS device headers when USBD_EMU is defined together with the
+ * MCU defines. Hardware drivers are compiled unmodified, except the register accesses with side
+ * effects (toggle-on-write, clear-on-write, pop-on-read) that are passed through \ref _WSE and
+ * \ref _RSE to the emulator. The bus side is driven by the virtual host API from \ref USBD_SIM.
+ * @{ */
+
+#if !defined(__ASSEMBLER__)
+#include <stdint.h>
+
+/**\brief Writes emulated register with side effects
+ * \param reg pointer to the emulated register
+ * \param val value to write
+ */
+void usb_emu_write(volatile void *reg, uint32_t val);
+
+/**\brief Reads emulated register with side effects
+ * \param reg pointer to the emulated register
+ * \return register value
+ */
+uint32_t usb_emu_read(volatile void *reg);
+
+#define _WSE(reg, val)      usb_emu_write(&(reg), (val))
+#define _RSE(reg)           usb_emu_read(&(reg))
+
+extern const uint32_t usb_emu_uid[6];   /**<\brief Emulated device unique ID.*/
+#define UID_BASE            ((uintptr_t)usb_emu_uid)
+
+typedef struct {
+    volatile uint32_t APB1RSTR;
+    volatile uint32_t APB1ENR;
+    volatile uint32_t APB2ENR;
+    volatile uint32_t AHB2RSTR;
+    volatile uint32_t AHB2ENR;
+} RCC_TypeDef;
+
+extern RCC_TypeDef usb_emu_rcc;
+#define RCC                 (&usb_emu_rcc)
+
+#if defined(STM32L052xx) || defined(STM32L053xx) || \
+    defined(STM32L062xx) || defined(STM32L063xx) || \
+    defined(STM32L072xx) || defined(STM32L073xx) || \
+    defined(STM32L082xx) || defined(STM32L083xx) || \
+    defined(STM32L432xx) || defined(STM32L433xx) || \
+    defined(STM32L442xx) || defined(STM32L443xx) || \
+    defined(STM32L452xx) || defined(STM32L462xx) || \
+    defined(STM32F042x6) || defined(STM32F048xx) || \
+    defined(STM32F070x6) || defined(STM32F070xB) || \
+    defined(STM32F072xB) || defined(STM32F078xx) || \
+    defined(STM32L1)
+/**\name USB FS device peripheral model
+ * @{ */
+typedef struct {
+    volatile uint16_t EPR[16];      /**<\brief EP0R..EP7R with 16-bit gaps.*/
+    uint16_t          RESERVED0[16];
+    volatile uint16_t CNTR;
+    uint16_t          RESERVED1;
+    volatile uint16_t ISTR;
+    uint16_t          RESERVED2;
+    volatile uint16_t FNR;
+    uint16_t          RESERVED3;
+    volatile uint16_t DADDR;
+    uint16_t          RESERVED4;
+    volatile uint16_t BTABLE;
+    uint16_t          RESERVED5;
+    volatile uint16_t LPMCSR;
+    uint16_t          RESERVED6;
+    volatile uint16_t BCDR;
+    uint16_t          RESERVED7;
+} USB_TypeDef;
+
+extern USB_TypeDef  usb_emu_regs;
+extern uint8_t      usb_emu_pma[0x400];
+
+#define USB                 (&usb_emu_regs)
+#define USB_BASE            ((uintptr_t)&usb_emu_regs)
+#define USB_PMAADDR         ((uintptr_t)usb_emu_pma)
+
+#if defined(STM32L1)
+    #define USB_PMASIZE     0x200
+    typedef struct {
+        volatile uint32_t MEMRMP;
+        volatile uint32_t PMC;
+    } SYSCFG_TypeDef;
+    extern SYSCFG_TypeDef usb_emu_syscfg;
+    #define SYSCFG              (&usb_emu_syscfg)
+    #define SYSCFG_PMC_USB_PU   0x00000001
+    #define RCC_APB2ENR_SYSCFGEN 0x00000001
+#else
+    #define USB_PMASIZE     0x400
+#endif
+
+#define RCC_APB1ENR_USBEN       0x00800000
+#define RCC_APB1RSTR_USBRST     0x00800000
+
+#define USB_EP_CTR_RX           0x8000
+#define USB_EP_DTOG_RX          0x4000
+#define USB_EPRX_STAT           0x3000
+#define USB_EP_SETUP            0x0800
+#define USB_EP_T_FIELD          0x0600
+#define USB_EP_KIND             0x0100
+#define USB_EP_CTR_TX           0x0080
+#define USB_EP_DTOG_TX          0x0040
+#define USB_EPTX_STAT           0x0030
+#define USB_EPADDR_FIELD        0x000F
+#define USB_EPREG_MASK          (USB_EP_CTR_RX | USB_EP_SETUP | USB_EP_T_FIELD | USB_EP_KIND | \
+                                 USB_EP_CTR_TX | USB_EPADDR_FIELD)
+#define USB_EP_BULK             0x0000
+#define USB_EP_CONTROL          0x0200
+#define USB_EP_ISOCHRONOUS      0x0400
+#define USB_EP_INTERRUPT        0x0600
+#define USB_EP_TX_DIS           0x0000
+#define USB_EP_TX_STALL         0x0010
+#define USB_EP_TX_NAK           0x0020
+#define USB_EP_TX_VALID         0x0030
+#define USB_EP_RX_DIS           0x0000
+#define USB_EP_RX_STALL         0x1000
+#define USB_EP_RX_NAK           0x2000
+#define USB_EP_RX_VALID         0x3000
+
+#define USB_CNTR_CTRM           0x8000
+#define USB_CNTR_PMAOVRM        0x4000
+#define USB_CNTR_ERRM           0x2000
+#define USB_CNTR_WKUPM          0x1000
+#define USB_CNTR_SUSPM          0x0800
+#define USB_CNTR_RESETM         0x0400
+#define USB_CNTR_SOFM           0x0200
+#define USB_CNTR_ESOFM          0x0100
+#define USB_CNTR_RESUME         0x0010
+#define USB_CNTR_FSUSP          0x0008
+#define USB_CNTR_LPMODE         0x0004
+#define USB_CNTR_PDWN           0x0002
+#define USB_CNTR_FRES           0x0001
+
+#define USB_ISTR_CTR            0x8000
+#define USB_ISTR_PMAOVR         0x4000
+#define USB_ISTR_ERR            0x2000
+#define USB_ISTR_WKUP           0x1000
+#define USB_ISTR_SUSP           0x0800
+#define USB_ISTR_RESET          0x0400
+#define USB_ISTR_SOF            0x0200
+#define USB_ISTR_ESOF           0x0100
+#define USB_ISTR_DIR            0x0010
+#define USB_ISTR_EP_ID          0x000F
+
+#define USB_FNR_FN              0x07FF
+#define USB_DADDR_EF            0x0080
+
+#define USB_BCDR_BCDEN          0x0001
+#define USB_BCDR_DCDEN          0x0002
+#define USB_BCDR_PDEN           0x0004
+#define USB_BCDR_SDEN           0x0008
+#define USB_BCDR_DCDET          0x0010
+#define USB_BCDR_PDET           0x0020
+#define USB_BCDR_SDET           0x0040
+#define USB_BCDR_PS2DET         0x0080
+#define USB_BCDR_DPPU           0x8000
+/** @} */
+#endif
+
+#if defined(STM32L476xx)
+/**\name USB OTG FS core peripheral model
+ * @{ */
+#define _VAL2FLD(field, value)  (((uint32_t)(value) << field ## _Pos) & field ## _Msk)
+#define _FLD2VAL(field, value)  (((uint32_t)(value) & field ## _Msk) >> field ## _Pos)
+
+typedef struct {
+    volatile uint32_t GOTGCTL;
+    volatile uint32_t GOTGINT;
+    volatile uint32_t GAHBCFG;
+    volatile uint32_t GUSBCFG;
+    volatile uint32_t GRSTCTL;
+    volatile uint32_t GINTSTS;
+    volatile uint32_t GINTMSK;
+    volatile uint32_t GRXSTSR;
+    volatile uint32_t GRXSTSP;
+    volatile uint32_t GRXFSIZ;
+    union {
+    volatile uint32_t GNPTXFSIZ;
+    volatile uint32_t DIEPTXF0_HNPTXFSIZ;
+    };
+    volatile uint32_t HNPTXSTS;
+    uint32_t          Reserved30[2];
+    volatile uint32_t GCCFG;
+    volatile uint32_t CID;
+    uint32_t          Reserved40[48];
+    volatile uint32_t HPTXFSIZ;
+    volatile uint32_t DIEPTXF[0x0F];
+} USB_OTG_GlobalTypeDef;
+
+typedef struct {
+    volatile uint32_t DCFG;
+    volatile uint32_t DCTL;
+    volatile uint32_t DSTS;
+    uint32_t          Reserved0C;
+    volatile uint32_t DIEPMSK;
+    volatile uint32_t DOEPMSK;
+    volatile uint32_t DAINT;
+    volatile uint32_t DAINTMSK;
+    uint32_t          Reserved20[5];
+    volatile uint32_t DIEPEMPMSK;
+} USB_OTG_DeviceTypeDef;
+
+typedef struct {
+    volatile uint32_t DIEPCTL;
+    uint32_t          Reserved04;
+    volatile uint32_t DIEPINT;
+    uint32_t          Reserved0C;
+    volatile uint32_t DIEPTSIZ;
+    volatile uint32_t DIEPDMA;
+    volatile uint32_t DTXFSTS;
+    uint32_t          Reserved18;
+} USB_OTG_INEndpointTypeDef;
+
+typedef struct {
+    volatile uint32_t DOEPCTL;
+    uint32_t          Reserved04;
+    volatile uint32_t DOEPINT;
+    uint32_t          Reserved0C;
+    volatile uint32_t DOEPTSIZ;
+    volatile uint32_t DOEPDMA;
+    uint32_t          Reserved18[2];
+} USB_OTG_OUTEndpointTypeDef;
+
+typedef struct {
+    volatile uint32_t CR1;
+    volatile uint32_t CR2;
+} PWR_TypeDef;
+
+extern PWR_TypeDef  usb_emu_pwr;
+extern uint32_t     usb_emu_otg[0x2000];    /**<\brief Register space and the FIFO windows.*/
+
+#define PWR                         (&usb_emu_pwr)
+#define PWR_CR2_USV                 0x00000400
+#define RCC_AHB2ENR_OTGFSEN         0x00001000
+#define RCC_AHB2RSTR_OTGFSRST       0x00001000
+
+#define USB_OTG_FS_PERIPH_BASE      ((uintptr_t)usb_emu_otg)
+#define USB_OTG_GLOBAL_BASE         0x0000
+#define USB_OTG_DEVICE_BASE         0x0800
+#define USB_OTG_IN_ENDPOINT_BASE    0x0900
+#define USB_OTG_OUT_ENDPOINT_BASE   0x0B00
+#define USB_OTG_EP_REG_SIZE         0x0020
+#define USB_OTG_PCGCCTL_BASE        0x0E00
+#define USB_OTG_FIFO_BASE           0x1000
+#define USB_OTG_FIFO_SIZE           0x1000
+
+#define USB_OTG_GOTGCTL_BVALOEN     0x00000040
+#define USB_OTG_GOTGCTL_BVALOVAL    0x00000080
+#define USB_OTG_GAHBCFG_GINT        0x00000001
+#define USB_OTG_GAHBCFG_TXFELVL     0x00000080
+#define USB_OTG_GUSBCFG_PHYSEL      0x00000040
+#define USB_OTG_GUSBCFG_TRDT_Pos    10
+#define USB_OTG_GUSBCFG_TRDT_Msk    0x00003C00
+#define USB_OTG_GUSBCFG_TRDT        USB_OTG_GUSBCFG_TRDT_Msk
+#define USB_OTG_GUSBCFG_FDMOD       0x40000000
+
+#define USB_OTG_GRSTCTL_CSRST       0x00000001
+#define USB_OTG_GRSTCTL_RXFFLSH     0x00000010
+#define USB_OTG_GRSTCTL_TXFFLSH     0x00000020
+#define USB_OTG_GRSTCTL_TXFNUM_Pos  6
+#define USB_OTG_GRSTCTL_TXFNUM_Msk  0x000007C0
+#define USB_OTG_GRSTCTL_TXFNUM      USB_OTG_GRSTCTL_TXFNUM_Msk
+#define USB_OTG_GRSTCTL_AHBIDL      0x80000000
+
+#define USB_OTG_GINTSTS_SOF         0x00000008
+#define USB_OTG_GINTSTS_RXFLVL      0x00000010
+#define USB_OTG_GINTSTS_USBSUSP     0x00000800
+#define USB_OTG_GINTSTS_USBRST      0x00001000
+#define USB_OTG_GINTSTS_ENUMDNE     0x00002000
+#define USB_OTG_GINTSTS_IEPINT      0x00040000
+#define USB_OTG_GINTSTS_OEPINT      0x00080000
+#define USB_OTG_GINTSTS_WKUINT      0x80000000
+#define USB_OTG_GINTMSK_SOFM        0x00000008
+#define USB_OTG_GINTMSK_RXFLVLM     0x00000010
+#define USB_OTG_GINTMSK_USBSUSPM    0x00000800
+#define USB_OTG_GINTMSK_USBRST      0x00001000
+#define USB_OTG_GINTMSK_ENUMDNEM    0x00002000
+#define USB_OTG_GINTMSK_IEPINT      0x00040000
+#define USB_OTG_GINTMSK_OEPINT      0x00080000
+#define USB_OTG_GINTMSK_WUIM        0x80000000
+
+#define USB_OTG_GRXSTSP_EPNUM       0x0000000F
+#define USB_OTG_GRXSTSP_BCNT_Pos    4
+#define USB_OTG_GRXSTSP_BCNT_Msk    0x00007FF0
+#define USB_OTG_GRXSTSP_BCNT        USB_OTG_GRXSTSP_BCNT_Msk
+#define USB_OTG_GRXSTSP_DPID_Pos    15
+#define USB_OTG_GRXSTSP_DPID_Msk    0x00018000
+#define USB_OTG_GRXSTSP_DPID        USB_OTG_GRXSTSP_DPID_Msk
+#define USB_OTG_GRXSTSP_PKTSTS_Pos  17
+#define USB_OTG_GRXSTSP_PKTSTS_Msk  0x001E0000
+#define USB_OTG_GRXSTSP_PKTSTS      USB_OTG_GRXSTSP_PKTSTS_Msk
+
+#define USB_OTG_GCCFG_DCDET         0x00000001
+#define USB_OTG_GCCFG_PDET          0x00000002
+#define USB_OTG_GCCFG_SDET          0x00000004
+#define USB_OTG_GCCFG_PS2DET        0x00000008
+#define USB_OTG_GCCFG_PWRDWN        0x00010000
+#define USB_OTG_GCCFG_BCDEN         0x00020000
+#define USB_OTG_GCCFG_DCDEN         0x00040000
+#define USB_OTG_GCCFG_PDEN          0x00080000
+#define USB_OTG_GCCFG_SDEN          0x00100000
+#define USB_OTG_GCCFG_VBDEN         0x00200000
+
+#define USB_OTG_DCFG_DSPD_Pos       0
+#define USB_OTG_DCFG_DSPD_Msk       0x00000003
+#define USB_OTG_DCFG_DSPD           USB_OTG_DCFG_DSPD_Msk
+#define USB_OTG_DCFG_DAD_Pos        4
+#define USB_OTG_DCFG_DAD_Msk        0x000007F0
+#define USB_OTG_DCFG_DAD            USB_OTG_DCFG_DAD_Msk
+#define USB_OTG_DCFG_PERSCHIVL_Pos  24
+#define USB_OTG_DCFG_PERSCHIVL_Msk  0x03000000
+#define USB_OTG_DCFG_PERSCHIVL      USB_OTG_DCFG_PERSCHIVL_Msk
+#define USB_OTG_DCTL_SDIS           0x00000002
+#define USB_OTG_DSTS_ENUMSPD_Pos    1
+#define USB_OTG_DSTS_ENUMSPD_Msk    0x00000006
+#define USB_OTG_DSTS_ENUMSPD        USB_OTG_DSTS_ENUMSPD_Msk
+#define USB_OTG_DSTS_FNSOF_Pos      8
+#define USB_OTG_DSTS_FNSOF_Msk      0x003FFF00
+#define USB_OTG_DSTS_FNSOF          USB_OTG_DSTS_FNSOF_Msk
+
+#define USB_OTG_DIEPMSK_XFRCM       0x00000001
+#define USB_OTG_DIEPMSK_EPDM        0x00000002
+#define USB_OTG_DOEPMSK_XFRCM       0x00000001
+#define USB_OTG_DOEPMSK_EPDM        0x00000002
+#define USB_OTG_DOEPMSK_STUPM       0x00000008
+
+#define USB_OTG_DIEPCTL_MPSIZ       0x000007FF
+#define USB_OTG_DIEPCTL_USBAEP      0x00008000
+#define USB_OTG_DIEPCTL_NAKSTS      0x00020000
+#define USB_OTG_DIEPCTL_EPTYP       0x000C0000
+#define USB_OTG_DIEPCTL_STALL       0x00200000
+#define USB_OTG_DIEPCTL_TXFNUM      0x03C00000
+#define USB_OTG_DIEPCTL_CNAK        0x04000000
+#define USB_OTG_DIEPCTL_SNAK        0x08000000
+#define USB_OTG_DIEPCTL_SD0PID_SEVNFRM  0x10000000
+#define USB_OTG_DIEPCTL_SODDFRM     0x20000000
+#define USB_OTG_DIEPCTL_EPDIS       0x40000000
+#define USB_OTG_DIEPCTL_EPENA       0x80000000
+#define USB_OTG_DOEPCTL_MPSIZ       0x000007FF
+#define USB_OTG_DOEPCTL_USBAEP      0x00008000
+#define USB_OTG_DOEPCTL_NAKSTS      0x00020000
+#define USB_OTG_DOEPCTL_EPTYP       0x000C0000
+#define USB_OTG_DOEPCTL_STALL       0x00200000
+#define USB_OTG_DOEPCTL_CNAK        0x04000000
+#define USB_OTG_DOEPCTL_SNAK        0x08000000
+#define USB_OTG_DOEPCTL_SD0PID_SEVNFRM  0x10000000
+#define USB_OTG_DOEPCTL_SODDFRM     0x20000000
+#define USB_OTG_DOEPCTL_EPDIS       0x40000000
+#define USB_OTG_DOEPCTL_EPENA       0x80000000
+
+#define USB_OTG_DIEPINT_XFRC        0x00000001
+#define USB_OTG_DIEPINT_EPDISD      0x00000002
+#define USB_OTG_DIEPINT_TXFE        0x00000080
+#define USB_OTG_DOEPINT_XFRC        0x00000001
+#define USB_OTG_DOEPINT_EPDISD      0x00000002
+#define USB_OTG_DOEPINT_STUP        0x00000008
+
+#define USB_OTG_DIEPTSIZ_XFRSIZ_Pos 0
+#define USB_OTG_DIEPTSIZ_XFRSIZ_Msk 0x0007FFFF
+#define USB_OTG_DIEPTSIZ_XFRSIZ     USB_OTG_DIEPTSIZ_XFRSIZ_Msk
+#define USB_OTG_DIEPTSIZ_PKTCNT_Pos 19
+#define USB_OTG_DIEPTSIZ_PKTCNT_Msk 0x1FF80000
+#define USB_OTG_DIEPTSIZ_PKTCNT     USB_OTG_DIEPTSIZ_PKTCNT_Msk
+#define USB_OTG_DOEPTSIZ_XFRSIZ_Pos 0
+#define USB_OTG_DOEPTSIZ_XFRSIZ_Msk 0x0007FFFF
+#define USB_OTG_DOEPTSIZ_XFRSIZ     USB_OTG_DOEPTSIZ_XFRSIZ_Msk
+#define USB_OTG_DOEPTSIZ_PKTCNT_Pos 19
+#define USB_OTG_DOEPTSIZ_PKTCNT_Msk 0x1FF80000
+#define USB_OTG_DOEPTSIZ_PKTCNT     USB_OTG_DOEPTSIZ_PKTCNT_Msk
+#define USB_OTG_DOEPTSIZ_STUPCNT_Pos 29
+#define USB_OTG_DOEPTSIZ_STUPCNT_Msk 0x60000000
+#define USB_OTG_DOEPTSIZ_STUPCNT    USB_OTG_DOEPTSIZ_STUPCNT_Msk
+#define USB_OTG_DTXFSTS_INEPTFSAV   0x0000FFFF
+/** @} */
+#endif
+
+#endif //(__ASSEMBLER__)
+/** @} */
+
+#if defined(__cplusplus)
+    }
+#endif
+#endif //_USB_EMU_H_
@@ -0,0 +1,152 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _USB_MSOS_H_
+#define _USB_MSOS_H_
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+
+/**\addtogroup USB_MODULE_MSOS Microsoft OS 2.0 descriptors
+ * \brief This module contains Microsoft OS 2.0 descriptors definitions.
+ * \details This module based on
+ * + [Microsoft OS 2.0 Descriptors Specification](https://docs.microsoft.com/en-us/windows-hardware/drivers/usbcon/microsoft-defined-usb-descriptors)
+ * \note Windows binds WinUSB to the device or the function with "WINUSB" compatible ID without
+ * the driver installation.
+ * @{ */
+
+/**\brief MS OS 2.0 platform capability UUID {D8DD60DF-4589-4CC7-9CD2-659D9E648A9F}.*/
+#define USB_MSOS20_UUID             {0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C,\
+                                     0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F}
+
+/**\name Windows versions
+ * @{ */
+#define USB_MSOS20_WINVER_8_1       0x06030000  /**<\brief Windows 8.1 and later.*/
+/** @} */
+
+/**\name MS OS 2.0 requests (wIndex of the vendor request with bMS_VendorCode)
+ * @{ */
+#define USB_MSOS20_DESCRIPTOR_INDEX 0x07    /**<\brief Returns MS OS 2.0 descriptor set.*/
+#define USB_MSOS20_SET_ALT_ENUM     0x08    /**<\brief Sets alternate enumeration.*/
+/** @} */
+
+/**\name MS OS 2.0 descriptor types
+ * @{ */
+#define USB_MSOS20_SET_HEADER       0x00    /**<\brief Descriptor set header.*/
+#define USB_MSOS20_SUBSET_CONFIG    0x01    /**<\brief Configuration subset header.*/
+#define USB_MSOS20_SUBSET_FUNCTION  0x02    /**<\brief Function subset header.*/
+#define USB_MSOS20_COMPATIBLE_ID    0x03    /**<\brief Compatible ID descriptor.*/
+#define USB_MSOS20_REG_PROPERTY     0x04    /**<\brief Registry property descriptor.*/
+#define USB_MSOS20_MIN_RESUME_TIME  0x05    /**<\brief Minimum USB resume time descriptor.*/
+#define USB_MSOS20_MODEL_ID         0x06    /**<\brief Model ID descriptor.*/
+#define USB_MSOS20_CCGP_DEVICE      0x07    /**<\brief CCGP device descriptor.*/
+#define USB_MSOS20_VENDOR_REVISION  0x08    /**<\brief Vendor revision descriptor.*/
+/** @} */
+
+/**\name Registry property data types
+ * @{ */
+#define USB_MSOS20_REG_SZ           0x01    /**<\brief NULL-terminated Unicode string.*/
+#define USB_MSOS20_REG_EXPAND_SZ    0x02    /**<\brief NULL-terminated Unicode string with
+                                             * environment variables.*/
+#define USB_MSOS20_REG_BINARY       0x03    /**<\brief Binary data.*/
+#define USB_MSOS20_REG_DWORD_LE     0x04    /**<\brief Little-endian 32-bit integer.*/
+#define USB_MSOS20_REG_DWORD_BE     0x05    /**<\brief Big-endian 32-bit integer.*/
+#define USB_MSOS20_REG_LINK         0x06    /**<\brief NULL-terminated Unicode string with a
+                                             * symbolic link.*/
+#define USB_MSOS20_REG_MULTI_SZ     0x07    /**<\brief Multiple NULL-terminated Unicode strings.*/
+/** @} */
+
+/** Macro to create \ref usb_msos20_compat_descriptor for WinUSB */
+#define USB_MSOS20_WINUSB_DESC      {.wLength = sizeof(struct usb_msos20_compat_descriptor),\
+                                     .wDescriptorType = USB_MSOS20_COMPATIBLE_ID,\
+                                     .CompatibleID = "WINUSB"}
+
+/** Macro to create \ref usb_msos20_guids_descriptor from the "{...}" GUID string */
+#define USB_MSOS20_GUIDS_DESC(s)    {.wLength = sizeof(struct usb_msos20_guids_descriptor),\
+                                     .wDescriptorType = USB_MSOS20_REG_PROPERTY,\
+                                     .wPropertyDataType = USB_MSOS20_REG_MULTI_SZ,\
+                                     .wPropertyNameLength = 42,\
+                                     .PropertyName = u"DeviceInterfaceGUIDs",\
+                                     .wPropertyDataLength = 80,\
+                                     .PropertyData = CAT(u,s)}
+
+/**\brief MS OS 2.0 platform capability descriptor */
+struct usb_msos20_descriptor {
+    uint8_t     bLength;            /**<\brief Size of the descriptor, in bytes.*/
+    uint8_t     bDescriptorType;    /**<\brief Device capability descriptor type.*/
+    uint8_t     bDevCapabilityType; /**<\brief Platform capability type.*/
+    uint8_t     bReserved;          /**<\brief Must be zero.*/
+    uint8_t     PlatformCapabilityUUID[16]; /**<\brief \ref USB_MSOS20_UUID */
+    uint32_t    dwWindowsVersion;   /**<\brief Minimum Windows version of the descriptor set.*/
+    uint16_t    wMSOSDescriptorSetTotalLength;  /**<\brief Size of the descriptor set.*/
+    uint8_t     bMS_VendorCode;     /**<\brief bRequest to retrieve the descriptor set.*/
+    uint8_t     bAltEnumCode;       /**<\brief Alternate enumeration code, 0 if not supported.*/
+} __attribute__((packed));
+
+/**\brief MS OS 2.0 descriptor set header */
+struct usb_msos20_set_descriptor {
+    uint16_t    wLength;            /**<\brief Size of the header, in bytes.*/
+    uint16_t    wDescriptorType;    /**<\brief Descriptor set header type.*/
+    uint32_t    dwWindowsVersion;   /**<\brief Minimum Windows version.*/
+    uint16_t    wTotalLength;       /**<\brief Size of the entire descriptor set.*/
+} __attribute__((packed));
+
+/**\brief MS OS 2.0 configuration subset header */
+struct usb_msos20_config_descriptor {
+    uint16_t    wLength;            /**<\brief Size of the header, in bytes.*/
+    uint16_t    wDescriptorType;    /**<\brief Configuration subset header type.*/
+    uint8_t     bConfigurationValue;/**<\brief Configuration index (not the value).*/
+    uint8_t     bReserved;          /**<\brief Must be zero.*/
+    uint16_t    wTotalLength;       /**<\brief Size of the entire configuration subset.*/
+} __attribute__((packed));
+
+/**\brief MS OS 2.0 function subset header
+ * \details Required for the composite devices to bind WinUSB to the single function.*/
+struct usb_msos20_function_descriptor {
+    uint16_t    wLength;            /**<\brief Size of the header, in bytes.*/
+    uint16_t    wDescriptorType;    /**<\brief Function subset header type.*/
+    uint8_t     bFirstInterface;    /**<\brief First interface of the function.*/
+    uint8_t     bReserved;          /**<\brief Must be zero.*/
+    uint16_t    wSubsetLength;      /**<\brief Size of the entire function subset.*/
+} __attribute__((packed));
+
+/**\brief MS OS 2.0 compatible ID descriptor */
+struct usb_msos20_compat_descriptor {
+    uint16_t    wLength;            /**<\brief Size of the descriptor, in bytes.*/
+    uint16_t    wDescriptorType;    /**<\brief Compatible ID descriptor type.*/
+    char        CompatibleID[8];    /**<\brief Compatible ID string padded with zeros.*/
+    char        SubCompatibleID[8]; /**<\brief Sub-compatible ID string padded with zeros.*/
+} __attribute__((packed));
+
+/**\brief MS OS 2.0 registry property descriptor with the DeviceInterfaceGUIDs property
+ * \details Host applications open the WinUSB device by the interface GUID.*/
+struct usb_msos20_guids_descriptor {
+    uint16_t    wLength;            /**<\brief Size of the descriptor, in bytes.*/
+    uint16_t    wDescriptorType;    /**<\brief Registry property descriptor type.*/
+    uint16_t    wPropertyDataType;  /**<\brief REG_MULTI_SZ.*/
+    uint16_t    wPropertyNameLength;/**<\brief Size of the property name, in bytes.*/
+    uint16_t    PropertyName[21];   /**<\brief "DeviceInterfaceGUIDs".*/
+    uint16_t    wPropertyDataLength;/**<\brief Size of the property data, in bytes.*/
+    uint16_t    PropertyData[40];   /**<\brief GUID string with double NULL termination.*/
+} __attribute__((packed));
+
+/** @} */
+
+#if defined(__cplusplus)
+    }
+#endif
+#endif /* _USB_MSOS_H_ */
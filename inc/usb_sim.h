@@ -0,0 +1,145 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _USB_SIM_H_
+#define _USB_SIM_H_
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+
+/**\addtogroup USBD_SIM USB host-side simulation
+ * \brief Virtual USB host for the host-side (x86) builds
+ * \details Drives emulated USB hardware with the scripted bus transactions. The same API is
+ * provided by the \ref usb_sim "usb_sim" driver (compiled with USBD_SIM defined), so one script can
+ * be used for the enumeration and class request profiling without real hardware.
+ * \note Not thread-safe. Bus transactions should be issued from the same thread that calls
+ * \ref usbd_poll.
+ * @{ */
+
+/**\name Handshakes returned by the virtual host transactions
+ * @{ */
+#define usb_sim_nak         (-1)    /**<\brief Endpoint is not ready. NAK handshake.*/
+#define usb_sim_stall       (-2)    /**<\brief Endpoint is stalled or disabled. STALL handshake.*/
+/** @} */
+
+/**\anchor USB_SIM_CALLS
+ * \name Counted driver calls
+ * @{ */
+#define usb_sim_call_enable         0
+#define usb_sim_call_reset          1
+#define usb_sim_call_connect        2
+#define usb_sim_call_setaddr        3
+#define usb_sim_call_ep_config      4
+#define usb_sim_call_ep_deconfig    5
+#define usb_sim_call_ep_read        6
+#define usb_sim_call_ep_write       7
+#define usb_sim_call_ep_setstall    8
+#define usb_sim_call_ep_isstalled   9
+#define usb_sim_call_poll           10
+#define usb_sim_call_frame_no       11
+#define usb_sim_call_serialno       12
+#define usb_sim_call_ep_readv       13
+#define usb_sim_call_ep_writev      14
+#define usb_sim_call_ep_write_begin 15
+#define usb_sim_call_ep_write_commit 16
+#define usb_sim_call_ep_forward     17
+#define usb_sim_call_ep_txfree      18
+#define usb_sim_call_ep_setring     19
+#define usb_sim_call_count          20
+/** @} */
+
+#if !defined(__ASSEMBLER__)
+/**\brief Simulated hardware statistics.*/
+struct usb_sim_stats {
+    uint32_t    calls[usb_sim_call_count];  /**<\brief Driver call counters. \ref USB_SIM_CALLS
+                                             * Simulated driver only.*/
+    uint32_t    events;         /**<\brief Events passed to the core by the poll routine. Simulated
+                                 * driver only.*/
+    uint32_t    rx_bytes;       /**<\brief Bytes copied from the endpoint buffers by ep_read.
+                                 * Counted on the bus side for the emulated hardware.*/
+    uint32_t    tx_bytes;       /**<\brief Bytes copied to the endpoint buffers by ep_write.
+                                 * Counted on the bus side for the emulated hardware.*/
+    uint32_t    reg_writes;     /**<\brief Register writes with side effects. Emulated hardware only.*/
+    uint32_t    fifo_words;     /**<\brief FIFO word accesses, including RX status pops. Emulated
+                                 * OTG core only.*/
+    uint32_t    fifo_errors;    /**<\brief FIFO overruns, underruns and overlapped FIFO layouts.
+                                 * Emulated OTG core only.*/
+    uint32_t    naks;           /**<\brief Transactions answered by NAK.*/
+    uint32_t    stalls;         /**<\brief Transactions answered by STALL.*/
+    uint8_t     address;        /**<\brief Current device address.*/
+    bool        enabled;        /**<\brief Simulated hardware is enabled.*/
+    bool        connected;      /**<\brief Pull-up is connected.*/
+};
+
+/**\brief Issues bus reset.*/
+void usb_sim_reset(void);
+
+/**\brief Issues start of frame and advances frame number.*/
+void usb_sim_sof(void);
+
+/**\brief Suspends or resumes bus
+ * \param suspend suspends bus if TRUE, issues a wakeup otherwise.
+ */
+void usb_sim_suspend(bool suspend);
+
+/**\brief Issues SETUP transaction
+ * \param ep endpoint index
+ * \param req pointer to the 8 bytes of the control request
+ * \return 8 if setup packet was accepted, \ref usb_sim_stall if endpoint is not a control endpoint.
+ */
+int32_t usb_sim_setup(uint8_t ep, const void *req);
+
+/**\brief Issues OUT transaction
+ * \param ep endpoint index
+ * \param buf pointer to the packet data
+ * \param len packet length
+ * \return packet length on ACK, \ref usb_sim_nak or \ref usb_sim_stall otherwise.
+ */
+int32_t usb_sim_out(uint8_t ep, const void *buf, uint16_t len);
+
+/**\brief Issues IN transaction
+ * \param ep endpoint index
+ * \param buf pointer to the receive buffer
+ * \param blen receive buffer size
+ * \return received packet length on ACK, \ref usb_sim_nak or \ref usb_sim_stall otherwise.
+ */
+int32_t usb_sim_in(uint8_t ep, void *buf, uint16_t blen);
+
+/**\brief Checks simulated hardware for unprocessed events.*/
+bool usb_sim_pending(void);
+
+/**\brief Performs complete control transfer on EP0
+ * \details Issues SETUP, DATA and STATUS stages and polls device between transactions.
+ * \param dev pointer to USB device
+ * \param req pointer to the control request
+ * \param data pointer to the DATA stage payload. Received data will be placed here for the
+ * device-to-host requests.
+ * \return DATA stage length or \ref usb_sim_stall if the request was stalled.
+ */
+int32_t usb_sim_control(usbd_device *dev, const usbd_ctlreq *req, void *data);
+
+/**\brief Gets simulated hardware statistics
+ * \param[out] stats pointer to the statistics structure
+ * \param clear resets counters after reading if TRUE
+ */
+void usb_sim_get_stats(struct usb_sim_stats *stats, bool clear);
+
+#endif //(__ASSEMBLER__)
+/** @} */
+
+#if defined(__cplusplus)
+    }
+#endif
+#endif //_USB_SIM_H_
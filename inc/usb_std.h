@@ -123,10 +123,21 @@ extern "C" {
 #define USB_DTYPE_OTG               0x09    /**<\brief OTG descriptor.*/
 #define USB_DTYPE_DEBUG             0x0A    /**<\brief Debug descriptor.*/
 #define USB_DTYPE_INTERFASEASSOC    0x0B    /**<\brief Interface association descriptor.*/
+#define USB_DTYPE_BOS               0x0F    /**<\brief Binary device object store descriptor.*/
+#define USB_DTYPE_DEVICE_CAP        0x10    /**<\brief Device capability descriptor.*/
 #define USB_DTYPE_CS_INTERFACE      0x24    /**<\brief Class specific interface descriptor.*/
 #define USB_DTYPE_CS_ENDPOINT       0x25    /**<\brief Class specific endpoint descriptor.*/
 /** @} */
 
+/**\name USB device capability types
+ * @{ */
+#define USB_DCAP_WIRELESS           0x01    /**<\brief Wireless USB capability.*/
+#define USB_DCAP_USB20_EXT          0x02    /**<\brief USB 2.0 extension capability.*/
+#define USB_DCAP_SUPERSPEED         0x03    /**<\brief SuperSpeed USB capability.*/
+#define USB_DCAP_CONTAINER_ID       0x04    /**<\brief Container ID capability.*/
+#define USB_DCAP_PLATFORM           0x05    /**<\brief Platform capability.*/
+/** @} */
+
 /**\name USB Standard requests
  * @{ */
 #define USB_STD_GET_STATUS          0x00    /**<\brief Returns status for the specified recipient.*/
@@ -437,6 +448,35 @@ struct usb_string_descriptor {
                                      * \ref USB_STD_LANGID codes. */
 } __attribute__((packed));
 
+/**\brief USB binary device object store (BOS) descriptor
+ * \details BOS descriptor is followed by the device capability descriptors. Host requests it if
+ * bcdUSB of the device descriptor is 0x0201 or above.*/
+struct usb_bos_descriptor {
+    uint8_t  bLength;               /**<\brief Size of the descriptor, in bytes.*/
+    uint8_t  bDescriptorType;       /**<\brief BOS descriptor type.*/
+    uint16_t wTotalLength;          /**<\brief Length of this descriptor and all of its device
+                                     * capability descriptors.*/
+    uint8_t  bNumDeviceCaps;        /**<\brief Number of the device capability descriptors.*/
+} __attribute__((packed));
+
+/**\brief USB 2.0 extension device capability descriptor*/
+struct usb_usb20ext_descriptor {
+    uint8_t  bLength;               /**<\brief Size of the descriptor, in bytes.*/
+    uint8_t  bDescriptorType;       /**<\brief Device capability descriptor type.*/
+    uint8_t  bDevCapabilityType;    /**<\brief USB 2.0 extension capability type.*/
+    uint32_t bmAttributes;          /**<\brief Bit 1 is set if device supports LPM.*/
+} __attribute__((packed));
+
+/**\brief USB platform device capability descriptor header
+ * \details Platform specific data follows the UUID.*/
+struct usb_platform_descriptor {
+    uint8_t  bLength;               /**<\brief Size of the descriptor, in bytes.*/
+    uint8_t  bDescriptorType;       /**<\brief Device capability descriptor type.*/
+    uint8_t  bDevCapabilityType;    /**<\brief Platform capability type.*/
+    uint8_t  bReserved;             /**<\brief Must be zero.*/
+    uint8_t  PlatformCapabilityUUID[16];    /**<\brief UUID of the platform.*/
+} __attribute__((packed));
+
 /**\brief USB debug descriptor
  * \details This descriptor is used to describe certain characteristics of the device that the host
  * debug port driver needs to know to communicate with the device. Specifically, the debug descriptor
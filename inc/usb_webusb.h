@@ -0,0 +1,80 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _USB_WEBUSB_H_
+#define _USB_WEBUSB_H_
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+
+/**\addtogroup USB_MODULE_WEBUSB WebUSB
+ * \brief This module contains WebUSB platform capability definitions.
+ * \details This module based on
+ * + [WebUSB API, Draft Community Group Report](https://wicg.github.io/webusb/)
+ * @{ */
+
+/**\brief WebUSB platform capability UUID {3408B638-09A9-47A0-8BFD-A0768815B665}.*/
+#define USB_WEBUSB_UUID         {0x38, 0xB6, 0x08, 0x34, 0xA9, 0x09, 0xA0, 0x47,\
+                                 0x8B, 0xFD, 0xA0, 0x76, 0x88, 0x15, 0xB6, 0x65}
+
+/**\name WebUSB requests (wIndex of the vendor request with bVendorCode)
+ * @{ */
+#define USB_WEBUSB_GET_URL      0x02    /**<\brief Returns URL descriptor. wValue is URL index.*/
+/** @} */
+
+/**\name WebUSB descriptor types */
+#define USB_DTYPE_WEBUSB_URL    0x03    /**<\brief URL descriptor type.*/
+
+/**\name WebUSB URL schemes
+ * @{ */
+#define USB_WEBUSB_SCHEME_HTTP  0x00    /**<\brief "http://" prefix.*/
+#define USB_WEBUSB_SCHEME_HTTPS 0x01    /**<\brief "https://" prefix.*/
+#define USB_WEBUSB_SCHEME_NONE  0xFF    /**<\brief URL contains the whole URL.*/
+/** @} */
+
+/** Macro to create \ref usb_webusb_url_descriptor from string */
+#define USB_WEBUSB_URL_DESC(scheme, s)  {.bLength = 2 + sizeof(s),\
+                                         .bDescriptorType = USB_DTYPE_WEBUSB_URL,\
+                                         .bScheme = scheme,\
+                                         .URL = {s}}
+
+/**\brief WebUSB platform capability descriptor */
+struct usb_webusb_descriptor {
+    uint8_t     bLength;            /**<\brief Size of the descriptor, in bytes.*/
+    uint8_t     bDescriptorType;    /**<\brief Device capability descriptor type.*/
+    uint8_t     bDevCapabilityType; /**<\brief Platform capability type.*/
+    uint8_t     bReserved;          /**<\brief Must be zero.*/
+    uint8_t     PlatformCapabilityUUID[16]; /**<\brief \ref USB_WEBUSB_UUID */
+    uint16_t    bcdVersion;         /**<\brief WebUSB version 1.0.*/
+    uint8_t     bVendorCode;        /**<\brief bRequest of the WebUSB vendor requests.*/
+    uint8_t     iLandingPage;       /**<\brief Index of the landing page URL, 0 if none.*/
+} __attribute__((packed));
+
+/**\brief WebUSB URL descriptor */
+struct usb_webusb_url_descriptor {
+    uint8_t     bLength;            /**<\brief Size of the descriptor, in bytes.*/
+    uint8_t     bDescriptorType;    /**<\brief URL descriptor type.*/
+    uint8_t     bScheme;            /**<\brief URL scheme prefix.*/
+    char        URL[];              /**<\brief UTF-8 encoded URL, not NULL-terminated.*/
+} __attribute__((packed));
+
+/** @} */
+
+#if defined(__cplusplus)
+    }
+#endif
+#endif /* _USB_WEBUSB_H_ */
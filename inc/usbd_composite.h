@@ -0,0 +1,123 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef _USBD_COMPOSITE_H_
+#define _USBD_COMPOSITE_H_
+
+#if defined(__cplusplus)
+    extern "C" {
+#endif
+
+/**\addtogroup USBD_COMPOSITE USB composite device
+ * \brief Builds a composite device from the independent functions
+ * \details Each function describes its interfaces as if it were the only one in the device.
+ * Interface numbers in the function descriptors start from 0 and endpoint numbers start from 1. IN
+ * and OUT endpoints of the function can share the number. \ref usbd_comp_init assigns the device
+ * interface numbers
+ * and endpoint addresses, builds the configuration descriptor with Interface Association
+ * Descriptors for the multi-interface functions, plans the packet memory for the whole endpoint
+ * set and registers the function class handlers. Endpoints of all functions are configured and
+ * deconfigured in one pass by SET_CONFIGURATION before the function handlers are called.
+ * \note Device descriptor of the composite device with IADs should use \ref USB_CLASS_IAD,
+ * \ref USB_SUBCLASS_IAD and \ref USB_PROTO_IAD.
+ * @{ */
+
+/**\name Interface association device class codes
+ * @{ */
+#define USB_CLASS_IAD           USB_CLASS_MISC  /**<\brief Device uses IADs.*/
+#define USB_SUBCLASS_IAD        0x02            /**<\brief Common class subclass.*/
+#define USB_PROTO_IAD           0x01            /**<\brief Interface association protocol.*/
+/** @} */
+
+/**\brief Number of items in the function endpoint list.*/
+#define USBD_COMP_EPS(ep)       (sizeof(ep) / sizeof((ep)[0]))
+
+/**\brief Checks endpoint budget of the composite device at compile time
+ * \param epnum sum of the highest endpoint numbers of the functions.
+ * \details Function endpoints take the device endpoint numbers after the highest number of the
+ * previous function.
+ * \code USBD_COMP_ASSERT(CDC_EPNUM + HID_EPNUM); \endcode
+ */
+#define USBD_COMP_ASSERT(epnum) \
+    _Static_assert((epnum) < USBD_HW_MAX_EP, "composite device exceeds the endpoint budget")
+
+/**\brief Size of the device endpoint set. EP0 and both directions of the other endpoints.*/
+#define USBD_COMP_MAX_EPCFG     (2 * USBD_HW_MAX_EP - 1)
+
+/**\brief Function of the composite device.*/
+struct usbd_function {
+    const struct usbd_class *cls;   /**<\brief Class handler of the function. Registered with the
+                                     * pointer to this structure as a context. Can be NULL.*/
+    void                *ctx;       /**<\brief Function private data.*/
+    const void          *desc;      /**<\brief Interface, class-specific and endpoint descriptors.*/
+    uint16_t            desc_len;   /**<\brief Size of the descriptors in bytes.*/
+    const usbd_epcfg    *ep;        /**<\brief Function endpoints with the function-local addresses.*/
+    uint8_t             ep_count;   /**<\brief Number of the function endpoints.*/
+    uint8_t             iface;      /**<\brief First interface number. Assigned by \ref usbd_comp_init.*/
+    uint8_t             iface_count;/**<\brief Number of the interfaces. Assigned by \ref usbd_comp_init.*/
+    uint8_t             epbase;     /**<\brief Endpoint number offset. Assigned by \ref usbd_comp_init.*/
+};
+
+/**\brief Composite device.*/
+typedef struct {
+    struct usbd_function    *func;      /**<\brief Function list.*/
+    uint8_t                 count;      /**<\brief Number of the functions.*/
+    uint8_t                 ep_count;   /**<\brief Number of the device endpoints including EP0.*/
+    usbd_epcfg              ep[USBD_COMP_MAX_EPCFG]; /**<\brief Device endpoint set, EP0 first.*/
+    const void              *desc;      /**<\brief Configuration descriptor.*/
+    uint16_t                desc_len;   /**<\brief Size of the configuration descriptor.*/
+    usbd_layout_report      layout;     /**<\brief Packet memory layout report.*/
+} usbd_composite;
+
+/**\brief Device endpoint address of the function endpoint
+ * \param func pointer to the function
+ * \param ep function-local endpoint address
+ */
+#define USBD_FUNC_EP(func, ep)  ((uint8_t)((ep) + (func)->epbase))
+
+/**\brief Device interface number of the function interface
+ * \param func pointer to the function
+ * \param iface function-local interface number
+ */
+#define USBD_FUNC_IFACE(func, iface)    ((uint8_t)((iface) + (func)->iface))
+
+/**\brief Initializes composite device
+ * \details Builds the configuration descriptor into the buffer. Interface numbers are shifted in
+ * the interface descriptors and in the Union and Call Management functional descriptors of the CDC
+ * interfaces.
+ * Endpoint addresses are shifted in the endpoint descriptors. Multi-interface functions are
+ * preceded by IAD filled from their first interface descriptor.
+ * Plans the packet memory layout for the whole endpoint set if the driver supports
+ * \ref USBD_HW_LAYOUT. Registers the composite handler and the function handlers, so it must be
+ * called after \ref usbd_init and before any other class handler is registered.
+ * \param dev pointer to usb device
+ * \param comp pointer to the composite device
+ * \param func pointer to the function list
+ * \param count number of the functions
+ * \param cfg configuration descriptor header. wTotalLength and bNumInterfaces are filled.
+ * \param buf buffer for the configuration descriptor (must stay valid)
+ * \param bsize size of the buffer
+ * \return true if the composite device was built. Check comp->layout if packet memory doesn't fit.
+ */
+bool usbd_comp_init(usbd_device *dev, usbd_composite *comp, struct usbd_function *func,
+                    uint8_t count, const struct usb_config_descriptor *cfg, void *buf, uint16_t bsize);
+
+/** @} */
+
+#if defined(__cplusplus)
+    }
+#endif
+#endif //_USBD_COMPOSITE_H_
@@ -54,6 +54,14 @@
  * @{ */
 #define USBD_HW_ADDRFST     (1 << 0)    /**<\brief Set address before STATUS_OUT.*/
 #define USBD_HW_BC          (1 << 1)    /**<\brief Battery charging detection supported.*/
+#define USBD_HW_MULTIPKT    (1 << 2)    /**<\brief IN endpoints accept several packets per write
+                                         * with a single TX completion event.*/
+#define USBD_HW_STREAM      (1 << 3)    /**<\brief IN endpoints stream data from the application
+                                         * buffer. \ref usbd_hw_ep_stream is supported.*/
+#define USBD_HW_LAYOUT      (1 << 4)    /**<\brief Packet memory layout is planned for the whole
+                                         * endpoint set. \ref usbd_hw_ep_layout is supported.*/
+#define USBD_HW_EPREUSE     (1 << 5)    /**<\brief Reconfigured endpoint takes its packet memory
+                                         * back. Required by \ref usbd_reg_altset.*/
 /** @} */
 /** @} */
 
@@ -62,6 +70,31 @@
  * @{ */
 #define USB_EPTYPE_DBLBUF   0x04    /**<\brief Doublebuffered endpoint (bulk endpoint only).*/
 
+#if !defined(USBD_MAX_IFACES)
+#define USBD_MAX_IFACES     8       /**<\brief Number of interfaces whose alternate settings are
+                                     * tracked by the core.*/
+#endif
+#if !defined(USBD_MAX_HANDLERS)
+#define USBD_MAX_HANDLERS   4       /**<\brief Number of the class handlers.*/
+#endif
+
+/**\name Packet memory of the FS devices
+ * \details \ref usbd_hw_ep_layout of the FS devices without OTG packs the endpoint buffers one
+ * after another below the buffer descriptor table, so the packet memory used by the fixed
+ * configuration can be checked at compile time:
+ * \code USBD_PMA_TBLSZ + USBD_PMA_EPSZ(0x00, USB_EPTYPE_CONTROL, 64) + ... <= USB_PMASIZE \endcode
+ * @{ */
+#define USBD_PMA_TBLSZ      64          /**<\brief Buffer descriptor table size.*/
+#define USBD_PMA_TXSZ(sz)   (((sz) + 1) & ~1)   /**<\brief TX buffer size.*/
+#define USBD_PMA_RXSZ(sz)   (((sz) > 62) ? (((sz) + 0x1F) & ~0x1F) : USBD_PMA_TXSZ(sz))
+                                        /**<\brief RX buffer size. 32-byte blocks above 62 bytes.*/
+#define USBD_PMA_EPSZ(ep, eptype, sz)                                                           \
+    (((eptype) == USB_EPTYPE_CONTROL) ? (USBD_PMA_TXSZ(sz) + USBD_PMA_RXSZ(sz)) :              \
+     ((((eptype) == USB_EPTYPE_ISOCHRONUS) || ((eptype) == (USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF))) \
+        ? 2 : 1) * (((ep) & 0x80) ? USBD_PMA_TXSZ(sz) : USBD_PMA_RXSZ(sz)))
+                                        /**<\brief Packet memory taken by the endpoint.*/
+/** @} */
+
 /**\name bmRequestType bitmapped field
  * @{ */
 #define USB_REQ_DIRECTION   (1 << 7)    /**<\brief Request direction mask.*/
@@ -144,6 +177,7 @@ typedef struct {
     uint8_t     device_cfg;     /**<\brief Current device configuration number.*/
     uint8_t     device_state;   /**<\brief Current \ref usbd_machine_state.*/
     uint8_t     control_state;  /**<\brief Current \ref usbd_ctl_state.*/
+    uint8_t     iface_alt[USBD_MAX_IFACES]; /**<\brief Current alternate settings of the interfaces.*/
 } usbd_status;
 
 /**\brief Generic USB device event callback for events and endpoints processing
@@ -167,7 +201,9 @@ typedef void (*usbd_rqc_callback)(usbd_device *dev, usbd_ctlreq *req);
  *            If request was not processed STALL PID will be issued.
  *          - GET_CONFIGURATION
  *          - SET_CONFIGURATION (passes to \ref usbd_cfg_callback)
- *          - GET_DESCRIPTOR (passes to \ref usbd_dsc_callback)
+ *          - GET_INTERFACE, SET_INTERFACE (passes to \ref usbd_alt_callback)
+ *          - GET_DESCRIPTOR (passes to \ref usbd_dsc_callback, BOS from \ref usbd_bos)
+ *          - MS OS 2.0 descriptor set and WebUSB GET_URL vendor requests (\ref usbd_bos)
  *          - GET_STATUS
  *          - SET_FEATURE, CLEAR_FEATURE (endpoints only)
  *          - SET_ADDRESS
@@ -197,11 +233,115 @@ typedef usbd_respond (*usbd_dsc_callback)(usbd_ctlreq *req, void **address, uint
  */
 typedef usbd_respond (*usbd_cfg_callback)(usbd_device *dev, uint8_t cfg);
 
+/**\brief USB set interface callback function
+ * \details Called when SET_INTERFACE request issued in the configured state. Only the endpoints of
+ * the interface should be reconfigured. \ref usbd_hw_ep_config of the drivers with
+ * \ref USBD_HW_EPREUSE gives the endpoint back the packet memory it took since the bus reset, so
+ * the zero bandwidth idle setting and the streaming setting can be switched back and forth.
+ * \param[in] dev pointer to USB device
+ * \param[in] iface interface number
+ * \param[in] alt alternate setting number
+ * \note Interfaces without the callback have the default setting 0 only.
+ * \return usbd_ack if alternate setting is selected
+ */
+typedef usbd_respond (*usbd_alt_callback)(usbd_device *dev, uint8_t iface, uint8_t alt);
+
+/**\brief Class handler control callback function.
+ * \details Gets class and vendor requests to the interfaces and endpoints of the handler. Standard
+ * requests to them that are not processed by the core (i.e. GET_DESCRIPTOR of the HID report
+ * descriptor) are passed here too. Requests are routed by the table lookup, so the callback doesn't
+ * need to check the recipient.
+ * \param[in] dev points to USB device
+ * \param[in] ctx handler context
+ * \param[in] req points to usb control request
+ * \param[out] *callback USB control transfer completion callback, default is NULL (no callback)
+ * \return usbd_respond status.
+ */
+typedef usbd_respond (*usbd_cls_control)(usbd_device *dev, void *ctx, usbd_ctlreq *req,
+                                         usbd_rqc_callback *callback);
+
+/**\brief Class handler set configuration callback function
+ * \details Called for each handler when SET_CONFIGURATION request issued.
+ * \param[in] dev pointer to USB device
+ * \param[in] ctx handler context
+ * \param[in] cfg configuration number. Endpoints of the handler should be de-configured if it's 0.
+ * \return usbd_ack if success
+ */
+typedef usbd_respond (*usbd_cls_config)(usbd_device *dev, void *ctx, uint8_t cfg);
+
+/**\brief Class handler set interface callback function
+ * \copydetails usbd_alt_callback
+ * \param[in] ctx handler context
+ * \note Not called for the drivers without \ref USBD_HW_EPREUSE, see \ref usbd_reg_altset.
+ */
+typedef usbd_respond (*usbd_cls_altset)(usbd_device *dev, void *ctx, uint8_t iface, uint8_t alt);
+
+/**\brief Class handler callbacks. Can be shared by several handlers with their own contexts.
+ * Unused callbacks are NULL.*/
+struct usbd_class {
+    usbd_cls_control    control;    /**<\copybrief usbd_cls_control */
+    usbd_cls_config     config;     /**<\copybrief usbd_cls_config */
+    usbd_cls_altset     altset;     /**<\copybrief usbd_cls_altset */
+};
+
+/**\brief Registered class handler.*/
+typedef struct {
+    const struct usbd_class *cls;   /**<\brief Class callbacks. NULL if handler is free.*/
+    void                    *ctx;   /**<\brief Handler context.*/
+} usbd_handler;
+
 /** @} */
 
 /**\addtogroup USBD_HW
  * @{ */
 
+/**\brief Data fragment for the vectored endpoint read and write.*/
+typedef struct {
+    void        *buf;           /**<\brief Pointer to the fragment data.*/
+    uint16_t    len;            /**<\brief Fragment length in bytes.*/
+} usbd_iovec;
+
+/**\brief Leased endpoint packet buffer for the in-place IN packet assembly.
+ * \details Points straight to the packet memory on the FS devices, so it should be accessed by
+ * halfwords with \ref usbd_epbuf_put only.
+ */
+typedef struct {
+    void        *buf;           /**<\brief Pointer to the first halfword of the buffer.*/
+    uint16_t    size;           /**<\brief Buffer size in bytes.*/
+    uint8_t     shift;          /**<\brief Address shift of the halfword offset. 0 for the 16-bit
+                                 * packet memory stride, 1 for the 32-bit stride.*/
+} usbd_epbuf;
+
+/**\brief Receive ring of the OUT endpoint
+ * \details Filled by the driver poll routine, so the endpoint buffers are released as soon as the
+ * packet is received. Driver writes head and full flag only, the application writes tail only.
+ * Both indexes are free-running counters.
+ */
+typedef struct {
+    uint8_t             *buf;   /**<\brief Pointer to the ring data.*/
+    uint16_t            mask;   /**<\brief Ring size - 1. Size should be a power of two, 32768 max.*/
+    volatile uint16_t   head;   /**<\brief Next byte to write. Driver only.*/
+    volatile uint16_t   tail;   /**<\brief Next byte to read. Application only.*/
+    volatile uint8_t    full;   /**<\brief Backpressure flag. Set by the driver when the received
+                                 * packet doesn't fit the ring. Packet is held by the endpoint until
+                                 * it's drained.*/
+} usbd_rxring;
+
+/**\brief Endpoint configuration for the packet memory layout planning.*/
+typedef struct {
+    uint8_t     ep;             /**<\brief Endpoint address.*/
+    uint8_t     eptype;         /**<\brief Endpoint type. Use USB_EPTYPE_* macros.*/
+    uint16_t    epsize;         /**<\brief Endpoint size in bytes.*/
+} usbd_epcfg;
+
+/**\brief Packet memory layout report.*/
+typedef struct {
+    uint16_t    size;           /**<\brief Packet memory size in bytes.*/
+    uint16_t    used;           /**<\brief Packet memory required by the layout in bytes.*/
+    uint8_t     ep;             /**<\brief Endpoint address whose buffer doesn't fit or is invalid.
+                                 * 0x00 for the shared RX buffer, 0xFF if layout fits.*/
+} usbd_layout_report;
+
 /**\brief Enables or disables USB hardware
  * \param enable Enables USB when TRUE disables otherwise.
  */
@@ -245,6 +385,10 @@ typedef void (*usbd_hw_ep_deconfig)(uint8_t ep);
 typedef int32_t (*usbd_hw_ep_read)(uint8_t ep, void *buf, uint16_t blen);
 
 /**\brief Writes data to IN or control endpoint
+ * \details Drivers with \ref USBD_HW_MULTIPKT capability accept data longer than the endpoint
+ * size on BULK and INTERRUPT endpoints. It's transmitted as several packets with a single
+ * \ref usbd_evt_eptx event. Data that doesn't fit the TX buffer is cut to the max packet size
+ * boundary.
  * \param ep endpoint index, hould belong to IN or CONTROL endpoint
  * \param buf pointer to data buffer
  * \param blen size of data will be written
@@ -252,6 +396,110 @@ typedef int32_t (*usbd_hw_ep_read)(uint8_t ep, void *buf, uint16_t blen);
  */
 typedef int32_t (*usbd_hw_ep_write)(uint8_t ep, void *buf, uint16_t blen);
 
+/**\brief Reads data from OUT or control endpoint to the several buffers
+ * \details Received packet is scattered over the fragments in order. Each fragment is filled
+ * completely before the next one, regardless of its length parity.
+ * \param ep endpoint index, should belong to OUT or CONTROL endpoint.
+ * \param iov pointer to the array of the read buffers
+ * \param iovcnt number of the read buffers
+ * \return size of the actually received data, -1 on error.
+ */
+typedef int32_t (*usbd_hw_ep_readv)(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt);
+
+/**\brief Writes data from the several buffers to IN or control endpoint as a single packet
+ * \details Drivers with \ref USBD_HW_MULTIPKT capability split the data longer than the endpoint
+ * size to several packets. Data is never cut, -1 is returned if it doesn't fit the TX buffer.
+ * \param ep endpoint index, hould belong to IN or CONTROL endpoint
+ * \param iov pointer to the array of the data fragments
+ * \param iovcnt number of the data fragments
+ * \return number of written bytes
+ */
+typedef int32_t (*usbd_hw_ep_writev)(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt);
+
+/**\brief Leases next free packet buffer of IN or control endpoint
+ * \details Data placed to the leased buffer is not transmitted until \ref usbd_hw_ep_write_commit
+ * is called. Drivers without the packet memory may return a staging buffer copied on commit.
+ * Lease size is the configured endpoint size.
+ * \param ep endpoint index, should belong to IN or CONTROL endpoint
+ * \param[out] epbuf pointer to the buffer lease
+ * \return size of the leased buffer in bytes, -1 if endpoint is not configured or not ready.
+ * \note Isochronous endpoint buffer should be committed in the same frame.
+ * \note OTG driver has one staging buffer. It's refused to other endpoints until the packet is
+ * committed.
+ */
+typedef int32_t (*usbd_hw_ep_write_begin)(uint8_t ep, usbd_epbuf *epbuf);
+
+/**\brief Transmits previously leased packet buffer
+ * \param ep endpoint index, should belong to IN or CONTROL endpoint
+ * \param len packet length in bytes
+ * \return number of written bytes, -1 if endpoint has no leased buffer or packet is larger than
+ * the lease.
+ */
+typedef int32_t (*usbd_hw_ep_write_commit)(uint8_t ep, uint16_t len);
+
+/**\brief Forwards received packet from OUT endpoint to IN endpoint without copying
+ * \details FS devices swap the packet memory buffers of the endpoints. OTG devices move data from
+ * RX FIFO to TX FIFO directly. Packet stays in OUT endpoint if IN endpoint is not ready.
+ * \param ep_out OUT endpoint index containing received packet
+ * \param ep_in IN endpoint index
+ * \return forwarded packet length, -1 if no packet or IN endpoint is not ready.
+ * \note Buffer of the IN endpoint should be not less than the OUT endpoint buffer.
+ */
+typedef int32_t (*usbd_hw_ep_forward)(uint8_t ep_out, uint8_t ep_in);
+
+/**\brief Gets number of packets that can be written to IN endpoint without waiting
+ * \details Doublebuffered bulk IN endpoints of the FS devices accept two packets. The second one is
+ * passed to the hardware when the first one is transmitted.
+ * \param ep endpoint index, should belong to IN or CONTROL endpoint
+ * \return number of free packet buffers, 0 if endpoint is busy or inactive.
+ */
+typedef int32_t (*usbd_hw_ep_txfree)(uint8_t ep);
+
+/**\brief Sets receive ring of the OUT endpoint
+ * \details Received packets are drained to the ring by the poll routine without waiting for
+ * \ref usbd_ep_read, so doublebuffered endpoint keeps both buffers in use and the host doesn't see
+ * NAK while the ring has free space. \ref usbd_evt_eprx is passed to the endpoint callback as usual,
+ * but the data should be taken from the ring. Call it again with the same ring to drain the held
+ * packet after \ref usbd_rxring::full is set.
+ * \param ep endpoint index, should belong to BULK or INTERRUPT OUT endpoint
+ * \param ring pointer to the ring, NULL to remove the ring
+ * \return TRUE if ring is set
+ * \note Ring is removed by the endpoint deconfiguration and bus reset.
+ * \note Should be called from the same context as \ref usbd_hw_poll.
+ */
+typedef bool (*usbd_hw_ep_setring)(uint8_t ep, usbd_rxring *ring);
+
+/**\brief Streams data from the application buffer to IN endpoint
+ * \details The whole buffer is passed to the hardware as a single multi-packet transfer. The driver
+ * keeps a pointer to the buffer and tops up the TX FIFO on TX FIFO half empty interrupts inside
+ * the poll routine, so the next packet is pushed while the previous one is sent. \ref usbd_evt_eptx is raised once,
+ * when the last packet is transmitted.
+ * \param ep endpoint index, should belong to IN endpoint. Isochronous endpoint takes a single
+ * packet, like \ref usbd_hw_ep_write.
+ * \param buf pointer to the data. Should be valid until \ref usbd_evt_eptx.
+ * \param blen data length in bytes
+ * \return number of accepted bytes, -1 if endpoint is busy. Long streams are cut to the max
+ * packet count of the hardware.
+ * \note Supported by the drivers with \ref USBD_HW_STREAM capability only.
+ */
+typedef int32_t (*usbd_hw_ep_stream)(uint8_t ep, const void *buf, uint16_t blen);
+
+/**\brief Plans packet memory layout for the whole endpoint set
+ * \details Sizes and places all endpoint buffers in one pass. OTG devices size the shared RX FIFO
+ * for the largest OUT packet and the actual number of OUT endpoints. Each IN FIFO holds two
+ * packets, so it's refilled on half empty FIFO while a packet is sent. FS devices pack the buffers at
+ * fixed addresses with the RX buffers rounded to the count block granularity, see \ref USBD_PMA_EPSZ.
+ * Configured buffers are not changed. OTG devices use the new layout in \ref usbd_hw_ep_config after
+ * the next bus reset. FS devices use it for the endpoints configured after the call, so the layout
+ * can be planned in the SET_CONFIGURATION handler. EP0 keeps its buffers if its size is not changed.
+ * \param cfg pointer to the array of the endpoint configurations. EP0 is 64 bytes if omitted.
+ * \param count number of the endpoint configurations
+ * \param[out] rep pointer to the layout report. Can be NULL.
+ * \return TRUE if layout fits the packet memory. Previous layout is kept otherwise.
+ * \note Supported by the drivers with \ref USBD_HW_LAYOUT capability only.
+ */
+typedef bool (*usbd_hw_ep_layout)(const usbd_epcfg *cfg, uint8_t count, usbd_layout_report *rep);
+
 /** Stalls and unstalls endpoint
  * \param ep endpoint address
  * \param stall endpoint will be stalled if TRUE and unstalled otherwise.
@@ -292,6 +540,15 @@ struct usbd_driver {
     usbd_hw_ep_deconfig     ep_deconfig;        /**<\copybrief usbd_hw_ep_deconfig */
     usbd_hw_ep_read         ep_read;            /**<\copybrief usbd_hw_ep_read */
     usbd_hw_ep_write        ep_write;           /**<\copybrief usbd_hw_ep_write */
+    usbd_hw_ep_readv        ep_readv;           /**<\copybrief usbd_hw_ep_readv */
+    usbd_hw_ep_writev       ep_writev;          /**<\copybrief usbd_hw_ep_writev */
+    usbd_hw_ep_write_begin  ep_write_begin;     /**<\copybrief usbd_hw_ep_write_begin */
+    usbd_hw_ep_write_commit ep_write_commit;    /**<\copybrief usbd_hw_ep_write_commit */
+    usbd_hw_ep_forward      ep_forward;         /**<\copybrief usbd_hw_ep_forward */
+    usbd_hw_ep_txfree       ep_txfree;          /**<\copybrief usbd_hw_ep_txfree */
+    usbd_hw_ep_setring      ep_setring;         /**<\copybrief usbd_hw_ep_setring */
+    usbd_hw_ep_stream       ep_stream;          /**<\copybrief usbd_hw_ep_stream */
+    usbd_hw_ep_layout       ep_layout;          /**<\copybrief usbd_hw_ep_layout */
     usbd_hw_ep_setstall     ep_setstall;        /**<\copybrief usbd_hw_ep_setstall */
     usbd_hw_ep_isstalled    ep_isstalled;       /**<\copybrief usbd_hw_ep_isstalled */
     usbd_hw_poll            poll;               /**<\copybrief usbd_hw_poll */
@@ -304,6 +561,83 @@ struct usbd_driver {
 /**\addtogroup USBD_CORE
  * @{ */
 
+typedef struct _usbd_xfer usbd_xfer;
+
+/**\brief Transfer completion callback
+ * \param[in] dev pointer to USB device
+ * \param ep endpoint address
+ * \param[in] xfer pointer to the completed transfer. xfer->count contains transferred size.
+ */
+typedef void (*usbd_xfer_callback)(usbd_device *dev, uint8_t ep, usbd_xfer *xfer);
+
+/**\anchor USBD_XFER_FLAGS
+ * \name Transfer flags
+ * @{ */
+#define USBD_XFER_ZLP       (1 << 0)    /**<\brief Terminate IN transfer with a zero length packet if
+                                         * its length is a multiple of the max packet size.*/
+/** @} */
+
+/**\brief Endpoint transfer descriptor
+ * \details IN transfer is split to the max packet size chunks and completes when all data and
+ * optional ZLP are transmitted. OUT transfer completes when buffer is full or a short packet
+ * is received.
+ */
+struct _usbd_xfer {
+    void                *buf;       /**<\brief Pointer to the transfer data.*/
+    uint16_t            len;        /**<\brief Transfer length in bytes. Buffer size for OUT.*/
+    uint16_t            count;      /**<\brief Transferred bytes.*/
+    uint16_t            mps;        /**<\brief Endpoint max packet size.*/
+    uint8_t             flags;      /**<\brief \ref USBD_XFER_FLAGS "Transfer flags".*/
+    usbd_xfer_callback  complete;   /**<\brief Transfer completion callback. Can be NULL.*/
+    uint8_t             queued;     /**<\brief IN packets passed to the endpoint and not confirmed
+                                     * yet. Used by the core.*/
+    uint8_t             zlp_sent;   /**<\brief ZLP is passed to the endpoint. Used by the core.*/
+};
+
+/**\brief Event queue record.
+ * \note OUT packet length is not recorded, because drivers can't report it without reading the
+ * packet. Packets wait in the endpoint buffers until the consumer reads them in order, so
+ * \ref usbd_ep_read called for \ref usbd_evt_eprx returns the packet length. One event can stand
+ * for both packets of the doublebuffered endpoint, so read the endpoint until \ref usbd_ep_read
+ * fails. Ring endpoints are drained by the producer, their data is taken by \ref usbd_rxring_read.
+ */
+typedef struct {
+    uint8_t     evt;            /**<\brief \ref USB_EVENTS "USB event".*/
+    uint8_t     ep;             /**<\brief Endpoint address.*/
+} usbd_evt_rec;
+
+/**\brief Single-producer single-consumer event queue
+ * \details Passes events from the USB interrupt (producer) to the main loop or a task (consumer)
+ * without locks. The producer writes head only, the consumer writes tail only. Both indexes are
+ * free-running 8-bit counters, so byte stores keep them consistent on Cortex-M0+ too.
+ */
+typedef struct {
+    usbd_evt_rec        *buf;           /**<\brief Pointer to the queue records.*/
+    uint8_t             mask;           /**<\brief Queue size - 1.*/
+    volatile uint8_t    head;           /**<\brief Next record to write. Producer only.*/
+    volatile uint8_t    tail;           /**<\brief Next record to read. Consumer only.*/
+    volatile uint32_t   overflows;      /**<\brief Events lost due to the queue overflow.*/
+} usbd_evt_queue;
+
+/**\brief Platform descriptors served by the core
+ * \details Core returns BOS descriptor on GET_DESCRIPTOR and answers the MS OS 2.0 descriptor set
+ * and WebUSB GET_URL vendor requests, so WinUSB is bound and WebUSB landing page is shown without
+ * the driver installation. Vendor codes must match the platform capability descriptors of BOS.
+ * \note bcdUSB of the device descriptor must be 0x0201 or above.
+ */
+typedef struct {
+    const struct usb_bos_descriptor *bos;           /**<\brief BOS descriptor followed by the device
+                                                     * capabilities.*/
+    const struct usb_msos20_set_descriptor *msos20; /**<\brief MS OS 2.0 descriptor set. Can be NULL.*/
+    const struct usb_webusb_url_descriptor *const *url; /**<\brief WebUSB URL descriptors. URL
+                                                     * index starts from 1.*/
+    uint8_t     url_count;                          /**<\brief Number of the URL descriptors.*/
+    uint8_t     msos20_code;                        /**<\brief bMS_VendorCode of the MS OS 2.0
+                                                     * platform capability.*/
+    uint8_t     webusb_code;                        /**<\brief bVendorCode of the WebUSB platform
+                                                     * capability.*/
+} usbd_bos;
+
 /**\brief Represents a USB device data.*/
 struct _usbd_device {
     const struct usbd_driver    *driver;                /**<\copybrief usbd_driver */
@@ -311,9 +645,21 @@ struct _usbd_device {
     usbd_rqc_callback           complete_callback;      /**<\copybrief usbd_rqc_callback */
     usbd_cfg_callback           config_callback;        /**<\copybrief usbd_cfg_callback */
     usbd_dsc_callback           descriptor_callback;    /**<\copybrief usbd_dsc_callback */
+    usbd_alt_callback           alt_callback;           /**<\copybrief usbd_alt_callback */
+    const usbd_bos              *bos;                   /**<\copybrief usbd_bos */
     usbd_evt_callback           events[usbd_evt_count]; /**<\brief array of the event callbacks.*/
     usbd_evt_callback           endpoint[8];            /**<\brief array of the endpoint callbacks.*/
     usbd_status                 status;                 /**<\copybrief usbd_status */
+    usbd_evt_queue              *queue;                 /**<\brief Event queue for the split mode.*/
+    uint32_t                    evt_count;              /**<\brief Events passed by the current
+                                                         * driver poll. Used by the core.*/
+    usbd_xfer                   *xfer[16];              /**<\brief Active transfers. OUT in 0..7,
+                                                         * IN in 8..15.*/
+    usbd_handler                handler[USBD_MAX_HANDLERS]; /**<\brief Class handlers.*/
+    uint8_t                     iface_handler[USBD_MAX_IFACES]; /**<\brief Handler index + 1 of the
+                                                         * interfaces, 0 if none.*/
+    uint8_t                     ep_handler[16];         /**<\brief Handler index + 1 of the endpoints.
+                                                         * OUT in 0..7, IN in 8..15.*/
 };
 
 /**\brief Initializes device structure
@@ -338,6 +684,67 @@ inline static void usbd_init(usbd_device *dev, const struct usbd_driver *drv,
  */
 void usbd_poll(usbd_device *dev);
 
+/**\brief Polls USB for events until hardware is idle
+ * \details Services endpoint and bus events one by one until no more events are pending or the
+ * budget runs out. Saves the interrupt entries and \ref usbd_poll calls under the sustained
+ * traffic.
+ * \param dev Pointer to device structure
+ * \param budget Maximum number of the events to be processed by this call
+ * \return Number of the processed events. Less than budget if hardware is idle.
+ * \note can be called as from main routine as from USB interrupt
+ */
+uint32_t usbd_poll_budget(usbd_device *dev, uint32_t budget);
+
+/**\brief Sets up event queue for the split mode
+ * \details In the split mode the USB interrupt only captures events into the queue by
+ * \ref usbd_poll_capture and all event processing, including control requests and class callbacks,
+ * is done by \ref usbd_process_queue from the main loop or a task.
+ * \param dev Pointer to device structure
+ * \param queue Pointer to the queue
+ * \param buf Pointer to the queue records
+ * \param size Number of the queue records. Should be a power of two, 8 min, 128 max.
+ */
+inline static void usbd_queue_init(usbd_device *dev, usbd_evt_queue *queue, usbd_evt_rec *buf,
+                                   uint8_t size) {
+    queue->buf = buf;
+    queue->mask = size - 1;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->overflows = 0;
+    dev->queue = queue;
+}
+
+/**\brief Captures USB events into the event queue
+ * \details Producer side of the split mode. Polls hardware until it is idle, the budget runs out or
+ * the queue has no room for one driver poll, which passes up to \ref USBD_HW_MAX_EP events. In the
+ * last case events stay pending in the hardware. The application should mask the USB interrupt
+ * until \ref usbd_process_queue frees the queue. Events that don't fit the queue anyway are lost
+ * and counted in \ref usbd_evt_queue::overflows.
+ * \param dev Pointer to device structure
+ * \param budget Maximum number of the events to be captured by this call
+ * \return Number of the captured events, including lost ones.
+ * \note should be called from USB interrupt
+ */
+uint32_t usbd_poll_capture(usbd_device *dev, uint32_t budget);
+
+/**\brief Checks the event queue for the room for one driver poll
+ * \param dev Pointer to device structure
+ * \return true if \ref usbd_poll_capture can poll the hardware
+ */
+inline static bool usbd_queue_ready(usbd_device *dev) {
+    usbd_evt_queue *q = dev->queue;
+    return (q->mask + 1 - (uint8_t)(q->head - q->tail)) >= USBD_HW_MAX_EP;
+}
+
+/**\brief Processes queued USB events
+ * \details Consumer side of the split mode.
+ * \param dev Pointer to device structure
+ * \param budget Maximum number of the events to be processed by this call
+ * \return Number of the processed events
+ * \note should be called from the main loop or a task
+ */
+uint32_t usbd_process_queue(usbd_device *dev, uint32_t budget);
+
 /**\brief Asynchronous device control
  * \param dev dev usb device \ref _usbd_device
  * \param cmd Asynchronous control command
@@ -360,6 +767,28 @@ inline static void usbd_reg_config(usbd_device *dev, usbd_cfg_callback callback)
     dev->config_callback = callback;
 }
 
+/**\brief Register callback for SET_INTERFACE control request
+ * \details Drivers without \ref USBD_HW_EPREUSE take new packet memory every time the endpoint
+ * is configured, so switching the alternate settings runs out of it. The callback is not
+ * registered for them and only the default setting 0 is accepted.
+ * \param dev dev usb device \ref _usbd_device
+ * \param callback pointer to user \ref usbd_alt_callback
+ * \return TRUE if callback is registered
+ */
+inline static bool usbd_reg_altset(usbd_device *dev, usbd_alt_callback callback) {
+    if (callback && !(dev->driver->caps & USBD_HW_EPREUSE)) return false;
+    dev->alt_callback = callback;
+    return true;
+}
+
+/**\brief Register platform descriptors
+ * \param dev dev usb device \ref _usbd_device
+ * \param bos pointer to \ref usbd_bos, NULL to remove
+ */
+inline static void usbd_reg_bos(usbd_device *dev, const usbd_bos *bos) {
+    dev->bos = bos;
+}
+
 /**\brief Register callback for GET_DESCRIPTOR control request
  * \param dev dev usb device \ref _usbd_device
  * \param callback pointer to user \ref usbd_ctl_callback
@@ -381,6 +810,7 @@ inline static bool usbd_ep_config(usbd_device *dev, uint8_t ep, uint8_t eptype,
  * \copydetails usbd_hw_ep_deconfig
  */
 inline static void usbd_ep_deconfig(usbd_device *dev, uint8_t ep) {
+    dev->xfer[(ep & 0x07) | ((ep & 0x80) >> 4)] = 0;
     dev->driver->ep_deconfig(ep);
 }
 
@@ -418,6 +848,169 @@ inline static int32_t usbd_ep_read(usbd_device *dev, uint8_t ep, void *buf, uint
     return dev->driver->ep_read(ep, buf, blen);
 }
 
+/**\brief Write data fragments to endpoint
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_writev
+ */
+inline static int32_t usbd_ep_writev(usbd_device *dev, uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    return dev->driver->ep_writev(ep, iov, iovcnt);
+}
+
+/**\brief Read data from endpoint to the several buffers
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_readv
+ */
+inline static int32_t usbd_ep_readv(usbd_device *dev, uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    return dev->driver->ep_readv(ep, iov, iovcnt);
+}
+
+/**\brief Leases next free packet buffer of the IN endpoint
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_write_begin
+ */
+inline static int32_t usbd_ep_write_begin(usbd_device *dev, uint8_t ep, usbd_epbuf *epbuf) {
+    return dev->driver->ep_write_begin(ep, epbuf);
+}
+
+/**\brief Transmits previously leased packet buffer
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_write_commit
+ */
+inline static int32_t usbd_ep_write_commit(usbd_device *dev, uint8_t ep, uint16_t len) {
+    return dev->driver->ep_write_commit(ep, len);
+}
+
+/**\brief Forwards received packet from OUT endpoint to IN endpoint
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_forward
+ */
+inline static int32_t usbd_ep_forward(usbd_device *dev, uint8_t ep_out, uint8_t ep_in) {
+    return dev->driver->ep_forward(ep_out, ep_in);
+}
+
+/**\brief Gets number of free packet buffers of the IN endpoint
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_txfree
+ */
+inline static int32_t usbd_ep_txfree(usbd_device *dev, uint8_t ep) {
+    return dev->driver->ep_txfree(ep);
+}
+
+/**\brief Sets receive ring of the OUT endpoint
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_setring
+ */
+inline static bool usbd_ep_setring(usbd_device *dev, uint8_t ep, usbd_rxring *ring) {
+    return dev->driver->ep_setring(ep, ring);
+}
+
+/**\brief Streams data from the application buffer to IN endpoint
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_stream
+ */
+inline static int32_t usbd_ep_stream(usbd_device *dev, uint8_t ep, const void *buf, uint16_t blen) {
+    if (!(dev->driver->caps & USBD_HW_STREAM)) return -1;
+    return dev->driver->ep_stream(ep, buf, blen);
+}
+
+/**\brief Plans packet memory layout for the whole endpoint set
+ * \param dev dev usb device \ref _usbd_device
+ * \copydetails usbd_hw_ep_layout
+ */
+inline static bool usbd_ep_layout(usbd_device *dev, const usbd_epcfg *cfg, uint8_t count,
+                                  usbd_layout_report *rep) {
+    if (!(dev->driver->caps & USBD_HW_LAYOUT)) return false;
+    return dev->driver->ep_layout(cfg, count, rep);
+}
+
+/**\brief Initializes receive ring
+ * \param ring pointer to the ring
+ * \param buf pointer to the ring data
+ * \param size ring size in bytes. Should be a power of two, 32768 max.
+ */
+inline static void usbd_rxring_init(usbd_rxring *ring, void *buf, uint16_t size) {
+    ring->buf = buf;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->full = 0;
+}
+
+/**\brief Gets free space of the receive ring
+ * \details Used by the drivers to write the packet with a single vectored read.
+ * \param ring pointer to the ring
+ * \param[out] iov two fragments of the free space. The second one starts at the ring beginning.
+ * \return free space in bytes
+ */
+inline static uint16_t usbd_rxring_space(const usbd_rxring *ring, usbd_iovec *iov) {
+    uint16_t pos = ring->head & ring->mask;
+    uint16_t space = ring->mask + 1 - (uint16_t)(ring->head - ring->tail);
+    iov[0].buf = ring->buf + pos;
+    iov[0].len = ring->mask + 1 - pos;
+    if (iov[0].len > space) iov[0].len = space;
+    iov[1].buf = ring->buf;
+    iov[1].len = space - iov[0].len;
+    return space;
+}
+
+/**\brief Reads data from the receive ring
+ * \param ring pointer to the ring
+ * \param buf pointer to the data buffer
+ * \param blen data buffer size
+ * \return number of the read bytes
+ */
+uint16_t usbd_rxring_read(usbd_rxring *ring, void *buf, uint16_t blen);
+
+/**\brief Stores a halfword to the leased packet buffer
+ * \param epbuf pointer to the buffer lease
+ * \param offset byte offset in the buffer, should be even
+ * \param data two bytes of the packet, the first one in the low byte
+ */
+inline static void usbd_epbuf_put(const usbd_epbuf *epbuf, uint16_t offset, uint16_t data) {
+    *(volatile uint16_t*)((uint8_t*)epbuf->buf + ((uint32_t)offset << epbuf->shift)) = data;
+}
+
+/**\brief Submits endpoint transfer
+ * \details The core passes data to or from the endpoint on each TX or RX event of this endpoint
+ * and calls xfer->complete once, when the transfer is done. Endpoint callback doesn't receive the
+ * events of the endpoint while transfer is active. IN packets are written ahead while the endpoint
+ * has free buffers, so doublebuffered endpoints transmit back-to-back packets. Drivers with
+ * \ref USBD_HW_MULTIPKT capability get as much data as the TX buffer holds per write. Drivers with
+ * \ref USBD_HW_STREAM capability stream the whole transfer.
+ * \param dev dev usb device \ref _usbd_device
+ * \param ep endpoint address. EP0 is not supported.
+ * \param xfer pointer to the transfer descriptor. Should be valid until completion. The core doesn't
+ * change buf, len, mps and flags, so the same descriptor can be submitted again.
+ * \return TRUE if transfer is started. FALSE if the endpoint has an active transfer, it's not
+ * ready to transmit, xfer->mps is 0 or OUT transfer length is not a multiple of xfer->mps.
+ * \note OUT transfer should be submitted before the first packet arrives. Its length should be a
+ * non-zero multiple of the max packet size, so the received packet always fits the buffer.
+ */
+bool usbd_ep_submit(usbd_device *dev, uint8_t ep, usbd_xfer *xfer);
+
+/**\brief Registers class handler for the interfaces
+ * \details Class and vendor requests to the interfaces go straight to the handler, before the
+ * \ref usbd_ctl_callback. SET_CONFIGURATION is forwarded to all handlers after the
+ * \ref usbd_cfg_callback, SET_INTERFACE is forwarded to the handler of the interface instead of the
+ * \ref usbd_alt_callback. Registering the same callbacks and context again remaps the handler.
+ * \param dev dev usb device \ref _usbd_device
+ * \param cls pointer to the class callbacks. Should be valid while the handler is registered.
+ * \param ctx handler context passed to the callbacks
+ * \param iface first interface of the handler
+ * \param count number of the interfaces
+ * \return TRUE if handler is registered. FALSE if all \ref USBD_MAX_HANDLERS handlers are in use or
+ * the interface number is out of \ref USBD_MAX_IFACES.
+ */
+bool usbd_reg_class(usbd_device *dev, const struct usbd_class *cls, void *ctx, uint8_t iface, uint8_t count);
+
+/**\brief Routes requests to the endpoint to the class handler of the interface
+ * \param dev dev usb device \ref _usbd_device
+ * \param iface interface number with the registered handler
+ * \param ep endpoint address
+ * \return TRUE if endpoint is routed
+ */
+bool usbd_reg_class_ep(usbd_device *dev, uint8_t iface, uint8_t ep);
+
 /**\brief Stall endpoint
  * \param dev dev usb device \ref _usbd_device
  * \param ep endpoint address
@@ -29,7 +29,7 @@
 #define USB_EP_SWBUF_RX     USB_EP_DTOG_TX
 
 
-#define EP_TOGGLE_SET(epr, bits, mask) *(epr) = (*(epr) ^ (bits)) & (USB_EPREG_MASK | (mask))
+#define EP_TOGGLE_SET(epr, bits, mask) _WSE(*(epr), (*(epr) ^ (bits)) & (USB_EPREG_MASK | (mask)))
 
 #define EP_TX_STALL(epr)    EP_TOGGLE_SET((epr), USB_EP_TX_STALL,                   USB_EPTX_STAT)
 #define EP_RX_STALL(epr)    EP_TOGGLE_SET((epr), USB_EP_RX_STALL,                   USB_EPRX_STAT)
@@ -40,6 +40,25 @@
 #define EP_TX_VALID(epr)    EP_TOGGLE_SET((epr), USB_EP_TX_VALID,                   USB_EPTX_STAT)
 #define EP_RX_VALID(epr)    EP_TOGGLE_SET((epr), USB_EP_RX_VALID,                   USB_EPRX_STAT)
 
+/* doublebuffered bulk IN endpoints with a packet waiting for the buffer owned by the hardware.
+ * Byte per endpoint, so evt_poll and ep_write can be called from different contexts. */
+static volatile uint8_t tx_pending[8];
+
+/* configured sizes of the IN endpoints. Leased buffer is limited to it, because the buffer taken
+ * by the endpoint can be larger */
+static uint16_t tx_size[8];
+
+/* receive rings of the OUT endpoints */
+static usbd_rxring *rx_ring[8];
+
+/* PMA buffers of the endpoints. Planned by ep_layout or taken by ep_config below the planned
+ * area. Both have fixed addresses, taken buffers are released by the bus reset */
+static struct {
+    uint16_t    low;            /* lowest planned address */
+    uint16_t    taken;          /* taken buffers, bit per descriptor */
+    uint16_t    addr[8][2];     /* TX and RX buffer descriptor addresses, 0 if not allocated */
+} pma_plan = { .low = USB_PMASIZE };
+
 typedef struct {
     uint16_t    addr;
     uint16_t    :16;
@@ -81,14 +100,13 @@ inline static volatile uint16_t *EPR(uint8_t ep) {
  *
  * \param sz uint16_t Requested buffer size.
  * \return uint16_t Buffer address for PMA table.
- * \note PMA buffers grown from top to bottom like stack.
+ * \note PMA buffers grown from top to bottom like stack, starting below the planned area.
  */
 static uint16_t get_next_pma(uint16_t sz) {
-    unsigned _result = USB_PMASIZE;
+    unsigned _result = pma_plan.low;
     for (int i = 0; i < 8; i++) {
-        pma_table *tbl = EPT(i);
-        if ((tbl->tx.addr) && (tbl->tx.addr < _result)) _result = tbl->tx.addr;
-        if ((tbl->rx.addr) && (tbl->rx.addr < _result)) _result = tbl->rx.addr;
+        if ((pma_plan.addr[i][0]) && (pma_plan.addr[i][0] < _result)) _result = pma_plan.addr[i][0];
+        if ((pma_plan.addr[i][1]) && (pma_plan.addr[i][1] < _result)) _result = pma_plan.addr[i][1];
     }
     if ( _result < (4 * sizeof(pma_table) + sz)) {
         return 0;
@@ -111,6 +129,7 @@ void ep_setstall(uint8_t ep, bool stall) {
             /* if it's a doublebuffered endpoint */
             if ((USB_EP_KIND | USB_EP_BULK) == (*reg & (USB_EP_T_FIELD | USB_EP_KIND))) {
                 /* set endpoint to VALID and clear DTOG_TX & SWBUF_TX */
+                tx_pending[ep & 0x07] = 0;
                 EP_DTX_UNSTALL(reg);
             } else {
                 /* set endpoint to NAKED and clear DTOG_TX */
@@ -170,6 +189,65 @@ uint8_t connect(bool connect) {
     return usbd_lane_unk;
 }
 
+/** \brief Helper function. Returns size of the PMA buffer.
+ * \note PMA buffers are allocated one after another, so buffer ends where the next one starts.
+ */
+static uint16_t get_pma_size(uint16_t addr) {
+    unsigned _result = USB_PMASIZE;
+    for (int i = 0; i < 8; i++) {
+        if ((pma_plan.addr[i][0] > addr) && (pma_plan.addr[i][0] < _result)) _result = pma_plan.addr[i][0];
+        if ((pma_plan.addr[i][1] > addr) && (pma_plan.addr[i][1] < _result)) _result = pma_plan.addr[i][1];
+    }
+    return _result - addr;
+}
+
+/** \brief Helper function. Returns PMA buffer for the buffer descriptor.
+ *
+ * \param ep uint8_t Endpoint number.
+ * \param slot int 0 for the TX descriptor, 1 for the RX descriptor.
+ * \param sz uint16_t Requested buffer size.
+ * \return uint16_t Buffer address. 0 if buffer doesn't fit.
+ * \note Descriptor keeps its buffer until the bus reset, so the reconfigured endpoint takes the
+ * same buffer if it fits. Planned buffers are never moved.
+ */
+static uint16_t get_ep_pma(uint8_t ep, int slot, uint16_t sz) {
+    uint16_t *_pma = &pma_plan.addr[ep & 0x07][slot];
+    uint16_t _bit = 1 << ((ep & 0x07) * 2 + slot);
+    if (*_pma) {
+        if (get_pma_size(*_pma) >= sz) return *_pma;
+        if (!(pma_plan.taken & _bit)) return 0;
+        /* dropping the small buffer. it's reused if it's the lowest one */
+        *_pma = 0;
+    }
+    *_pma = get_next_pma(sz);
+    if (*_pma) pma_plan.taken |= _bit;
+    return *_pma;
+}
+
+/** \brief Helper function. Releases PMA buffers taken by ep_config. Planned buffers are kept.
+ */
+static void pma_release(void) {
+    for (int i = 0; i < 16; i++) {
+        if (pma_plan.taken & (1 << i)) pma_plan.addr[i >> 1][i & 0x01] = 0;
+    }
+    pma_plan.taken = 0;
+}
+
+/** \brief Helper function. Swaps PMA buffers of two descriptors in the plan, so the plan follows
+ * the buffers swapped by ep_forward.
+ */
+static void pma_swap(uint8_t ep_a, uint16_t addr_a, uint8_t ep_b, uint16_t addr_b) {
+    uint16_t *_pma = &pma_plan.addr[0][0];
+    int _a = (ep_a & 0x07) * 2 + ((pma_plan.addr[ep_a & 0x07][0] == addr_a) ? 0 : 1);
+    int _b = (ep_b & 0x07) * 2 + ((pma_plan.addr[ep_b & 0x07][0] == addr_b) ? 0 : 1);
+    uint16_t _taken = pma_plan.taken & ~((1 << _a) | (1 << _b));
+    if (pma_plan.taken & (1 << _a)) _taken |= (1 << _b);
+    if (pma_plan.taken & (1 << _b)) _taken |= (1 << _a);
+    pma_plan.taken = _taken;
+    _pma[_a] = addr_b;
+    _pma[_b] = addr_a;
+}
+
 void setaddr (uint8_t addr) {
     USB->DADDR = USB_DADDR_EF | addr;
 }
@@ -183,31 +261,32 @@ bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
 
     switch (eptype) {
     case USB_EPTYPE_CONTROL:
-        *reg = USB_EP_CONTROL | (ep & 0x07);
+        _WSE(*reg, USB_EP_CONTROL | (ep & 0x07));
         break;
     case USB_EPTYPE_ISOCHRONUS:
-        *reg = USB_EP_ISOCHRONOUS | (ep & 0x07);
+        _WSE(*reg, USB_EP_ISOCHRONOUS | (ep & 0x07));
         break;
     case USB_EPTYPE_BULK:
-        *reg = USB_EP_BULK | (ep & 0x07);
+        _WSE(*reg, USB_EP_BULK | (ep & 0x07));
         break;
     case USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF:
-        *reg = USB_EP_BULK | USB_EP_KIND | (ep & 0x07);
+        _WSE(*reg, USB_EP_BULK | USB_EP_KIND | (ep & 0x07));
         break;
     default:
-        *reg = USB_EP_INTERRUPT | (ep & 0x07);
+        _WSE(*reg, USB_EP_INTERRUPT | (ep & 0x07));
         break;
     }
     /* if it TX or CONTROL endpoint */
     if ((ep & 0x80) || (eptype == USB_EPTYPE_CONTROL)) {
         uint16_t _pma;
-        _pma = get_next_pma(epsize);
+        _pma = get_ep_pma(ep, 0, epsize);
         if (_pma == 0) return false;
         tbl->tx.addr = _pma;
         tbl->tx.cnt  = 0;
+        tx_size[ep & 0x07] = epsize;
         if ((eptype == USB_EPTYPE_ISOCHRONUS) ||
             (eptype == (USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF))) {
-            _pma = get_next_pma(epsize);
+            _pma = get_ep_pma(ep, 1, epsize);
             if (_pma == 0) return false;
             tbl->tx1.addr = _pma;
             tbl->tx1.cnt  = 0;
@@ -221,7 +300,7 @@ bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
         uint16_t _pma;
         if (epsize > 62) {
             if (epsize & 0x1F) {
-                epsize &= 0x1F;
+                epsize &= ~0x1F;
             } else {
                 epsize -= 0x20;
             }
@@ -230,13 +309,13 @@ bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
         } else {
             _rxcnt = epsize << 9;
         }
-        _pma = get_next_pma(epsize);
+        _pma = get_ep_pma(ep, 1, epsize);
         if (_pma == 0) return false;
         tbl->rx.addr = _pma;
         tbl->rx.cnt  = _rxcnt;
         if ((eptype == USB_EPTYPE_ISOCHRONUS) ||
             (eptype == (USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF))) {
-            _pma = get_next_pma(epsize);
+            _pma = get_ep_pma(ep, 0, epsize);
             if (_pma == 0) return false;
             tbl->rx0.addr = _pma;
             tbl->rx0.cnt  = _rxcnt;
@@ -248,122 +327,476 @@ bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
     return true;
 }
 
+/** \brief Helper function. Plans PMA buffers of the endpoint.
+ *
+ * \param plan uint16_t[8][2] Planned TX and RX buffer descriptor addresses.
+ * \param top int* Lowest planned address. Buffers are placed below it even if they don't fit.
+ * \param cfg const usbd_epcfg* Endpoint configuration.
+ * \return bool false if endpoint is invalid or its buffers are already planned.
+ */
+static bool plan_ep(uint16_t plan[][2], int *top, const usbd_epcfg *cfg) {
+    uint16_t *_addr = plan[cfg->ep & 0x07];
+    uint16_t _sz[2];
+    if (cfg->ep & 0x78) return false;
+    switch (cfg->eptype) {
+    case USB_EPTYPE_CONTROL:
+        _sz[0] = USBD_PMA_TXSZ(cfg->epsize);
+        _sz[1] = USBD_PMA_RXSZ(cfg->epsize);
+        break;
+    case USB_EPTYPE_ISOCHRONUS:
+    case USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF:
+        _sz[0] = (cfg->ep & 0x80) ? USBD_PMA_TXSZ(cfg->epsize) : USBD_PMA_RXSZ(cfg->epsize);
+        _sz[1] = _sz[0];
+        break;
+    default:
+        _sz[0] = (cfg->ep & 0x80) ? USBD_PMA_TXSZ(cfg->epsize) : 0;
+        _sz[1] = (cfg->ep & 0x80) ? 0 : USBD_PMA_RXSZ(cfg->epsize);
+        break;
+    }
+    /* buffers are placed in the same order as ep_config takes them. OUT endpoint starts from RX */
+    for (int i = 0; i < 2; i++) {
+        int _slot = ((cfg->ep & 0x80) || (cfg->eptype == USB_EPTYPE_CONTROL)) ? i : 1 - i;
+        if (_sz[_slot] == 0) continue;
+        if (_addr[_slot]) return false;
+        *top -= _sz[_slot];
+        _addr[_slot] = (*top > 0) ? *top : 1;
+    }
+    return true;
+}
+
+bool ep_layout(const usbd_epcfg *cfg, uint8_t count, usbd_layout_report *rep) {
+    static const usbd_epcfg ep0 = {0x00, USB_EPTYPE_CONTROL, 0x40};
+    uint16_t addr[8][2] = {{0}};
+    int top = USB_PMASIZE;
+    uint8_t ep = 0xFF;
+    const usbd_epcfg *_c = &ep0;
+    /* EP0 goes first, so it takes the place where ep_config puts it after the bus reset */
+    for (int i = 0; i < count; i++) {
+        if ((cfg[i].ep & 0x7F) == 0) _c = &cfg[i];
+    }
+    for (int i = -1; i < count; i++) {
+        if (i >= 0) {
+            _c = &cfg[i];
+            if ((_c->ep & 0x7F) == 0) continue;
+        }
+        if (!plan_ep(addr, &top, _c)) {
+            ep = _c->ep;
+            break;
+        }
+        if ((top < (int)(4 * sizeof(pma_table))) && (ep == 0xFF)) ep = _c->ep;
+    }
+    if (ep == 0xFF) {
+        pma_plan.low = top;
+        pma_plan.taken = 0;
+        for (int i = 0; i < 8; i++) {
+            pma_plan.addr[i][0] = addr[i][0];
+            pma_plan.addr[i][1] = addr[i][1];
+        }
+    }
+    if (rep) {
+        rep->size = USB_PMASIZE;
+        rep->used = USB_PMASIZE - top + 4 * sizeof(pma_table);
+        rep->ep = ep;
+    }
+    return (ep == 0xFF);
+}
+
 void ep_deconfig(uint8_t ep) {
     pma_table *ept = EPT(ep);
-    *EPR(ep) &= ~USB_EPREG_MASK;
+    _WSE(*EPR(ep), *EPR(ep) & ~USB_EPREG_MASK);
+    tx_pending[ep & 0x07] = 0;
+    rx_ring[ep & 0x07] = 0;
     ept->rx.addr = 0;
     ept->rx.cnt  = 0;
     ept->tx.addr = 0;
     ept->tx.cnt  = 0;
 }
 
-static uint16_t pma_read (uint8_t *buf, uint16_t blen, pma_rec *rx) {
+/* buffer accessors for the aligned copy paths */
+typedef uint16_t __attribute__((may_alias)) buf16_t;
+typedef uint32_t __attribute__((may_alias)) buf32_t;
+
+/** \brief Helper function. Copies halfwords from the PMA buffer to the RAM buffer.
+ * \details PMA is read by 32-bit words, upper halfwords are dropped. Consecutive words
+ * can be fetched by LDM.
+ * \param pma PMA buffer.
+ * \param buf destination buffer. Word and halfword aligned buffers use wide stores.
+ * \param hcnt number of halfwords to copy.
+ */
+static void pma_get(const uint16_t *pma, uint8_t *buf, uint16_t hcnt) {
+    const uint32_t *src = (const void*)pma;
+    if (((uintptr_t)buf & 0x03) == 0) {
+        buf32_t *dst = (void*)buf;
+        for (; hcnt > 3; hcnt -= 4) {
+            uint32_t _a = src[0];
+            uint32_t _b = src[1];
+            uint32_t _c = src[2];
+            uint32_t _d = src[3];
+            dst[0] = (uint16_t)_a | (_b << 16);
+            dst[1] = (uint16_t)_c | (_d << 16);
+            dst += 2;
+            src += 4;
+        }
+        buf = (void*)dst;
+    }
+    if (((uintptr_t)buf & 0x01) == 0) {
+        buf16_t *dst = (void*)buf;
+        for (; hcnt > 1; hcnt -= 2) {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            dst += 2;
+            src += 2;
+        }
+        if (hcnt) *dst = *src;
+        return;
+    }
+    for (; hcnt; hcnt--) {
+        uint32_t _t = *src++;
+        *buf++ = _t & 0xFF;
+        *buf++ = _t >> 8;
+    }
+}
+
+/** \brief Helper function. Copies halfwords from the RAM buffer to the PMA buffer.
+ * \details PMA is written by 32-bit words with zeroed upper halfwords.
+ * \param pma PMA buffer.
+ * \param buf source buffer. Word and halfword aligned buffers use wide loads.
+ * \param hcnt number of halfwords to copy.
+ */
+static void pma_put(uint16_t *pma, const uint8_t *buf, uint16_t hcnt) {
+    volatile uint32_t *dst = (void*)pma;
+    if (((uintptr_t)buf & 0x03) == 0) {
+        const buf32_t *src = (const void*)buf;
+        for (; hcnt > 3; hcnt -= 4) {
+            uint32_t _a = src[0];
+            uint32_t _b = src[1];
+            dst[0] = (uint16_t)_a;
+            dst[1] = _a >> 16;
+            dst[2] = (uint16_t)_b;
+            dst[3] = _b >> 16;
+            src += 2;
+            dst += 4;
+        }
+        buf = (const void*)src;
+    }
+    if (((uintptr_t)buf & 0x01) == 0) {
+        const buf16_t *src = (const void*)buf;
+        for (; hcnt > 1; hcnt -= 2) {
+            dst[0] = src[0];
+            dst[1] = src[1];
+            src += 2;
+            dst += 2;
+        }
+        if (hcnt) *dst = *src;
+        return;
+    }
+    for (; hcnt; hcnt--) {
+        *dst++ = buf[1] << 8 | buf[0];
+        buf += 2;
+    }
+}
+
+static uint16_t pma_readv(const usbd_iovec *iov, uint8_t iovcnt, pma_rec *rx) {
     uint16_t *pma = (void*)(USB_PMAADDR + 2 * rx->addr);
     uint16_t rxcnt = rx->cnt & 0x03FF;
+    uint16_t cnt = 0;
+    uint16_t _t = 0;
     rx->cnt &= ~0x3FF;
-    if (blen > rxcnt) {
-        blen = rxcnt;
-    }
-    rxcnt = blen;
-    while (blen) {
-        uint16_t _t = *pma;
-        *buf++ = _t & 0xFF;
-        if (--blen) {
+    for (; iovcnt && (cnt < rxcnt); iovcnt--, iov++) {
+        uint8_t *buf = iov->buf;
+        uint16_t blen = iov->len;
+        if (blen > (rxcnt - cnt)) {
+            blen = rxcnt - cnt;
+        }
+        if (blen == 0) continue;
+        /* previous fragment ends in the middle of the PMA halfword */
+        if (cnt & 0x01) {
             *buf++ = _t >> 8;
             pma += 2;
+            cnt++;
             blen--;
-        } else break;
+        }
+        cnt += blen;
+        pma_get(pma, buf, blen >> 1);
+        pma += (blen >> 1) * 2;
+        buf += blen & ~0x01;
+        if (blen & 0x01) {
+            _t = *pma;
+            *buf = _t & 0xFF;
+        }
     }
-    return rxcnt;
+    return cnt;
 }
 
-int32_t ep_read(uint8_t ep, void *buf, uint16_t blen) {
+/** \brief Helper function. Returns RX buffer descriptor containing received data.
+ * \return pointer to the buffer descriptor, NULL if endpoint has no data.
+ */
+static pma_rec *ep_rxbuf(uint8_t ep) {
     pma_table *tbl = EPT(ep);
     volatile uint16_t *reg = EPR(ep);
     switch (*reg & (USB_EPRX_STAT | USB_EP_T_FIELD | USB_EP_KIND)) {
     /* doublebuffered bulk endpoint */
     case (USB_EP_RX_VALID | USB_EP_BULK | USB_EP_KIND):
+        /* held packet of the ring endpoint stays in the application buffer */
+        if (rx_ring[ep & 0x07] && rx_ring[ep & 0x07]->full) {
+            return (*reg & USB_EP_SWBUF_RX) ? &(tbl->rx1) : &(tbl->rx0);
+        }
         /* switching SWBUF if EP is NAKED */
         switch (*reg & (USB_EP_DTOG_RX | USB_EP_SWBUF_RX)) {
         case 0:
         case (USB_EP_DTOG_RX | USB_EP_SWBUF_RX):
-            *reg = (*reg & USB_EPREG_MASK) | USB_EP_SWBUF_RX;
+            _WSE(*reg, (*reg & USB_EPREG_MASK) | USB_EP_SWBUF_RX);
         default:
             break;
         }
-        if (*reg & USB_EP_SWBUF_RX) {
-            return pma_read(buf, blen, &(tbl->rx1));
-        } else {
-            return pma_read(buf, blen, &(tbl->rx0));
-        }
+        return (*reg & USB_EP_SWBUF_RX) ? &(tbl->rx1) : &(tbl->rx0);
     /* isochronous endpoint */
     case (USB_EP_RX_VALID | USB_EP_ISOCHRONOUS):
-        if (*reg & USB_EP_DTOG_RX) {
-            return pma_read(buf, blen, &(tbl->rx1));
-        } else {
-            return pma_read(buf, blen, &(tbl->rx0));
-        }
+        return (*reg & USB_EP_DTOG_RX) ? &(tbl->rx1) : &(tbl->rx0);
     /* regular endpoint */
     case (USB_EP_RX_NAK | USB_EP_BULK):
     case (USB_EP_RX_NAK | USB_EP_CONTROL):
     case (USB_EP_RX_NAK | USB_EP_INTERRUPT):
-        {
-        int32_t res = pma_read(buf, blen, &(tbl->rx));
-        /* setting endpoint to VALID state */
-        EP_RX_VALID(reg);
-        return res;
-        }
+        return &(tbl->rx);
     /* invalid or not ready */
     default:
-        return -1;
+        return 0;
     }
 }
 
-static void pma_write(const uint8_t *buf, uint16_t blen, pma_rec *tx) {
-    uint16_t *pma = (void*)(USB_PMAADDR + 2 * (tx->addr));
-    tx->cnt = blen;
-    while (blen > 1) {
-        *pma = buf[1] << 8 | buf[0];
-        pma += 2;
-        buf += 2;
-        blen -= 2;
+/** \brief Helper function. Returns processed RX buffer to the hardware.
+ */
+static void ep_rxrelease(uint8_t ep) {
+    volatile uint16_t *reg = EPR(ep);
+    switch (*reg & (USB_EP_T_FIELD | USB_EP_KIND)) {
+    /* buffers are switched by SWBUF or by the hardware */
+    case (USB_EP_BULK | USB_EP_KIND):
+    case USB_EP_ISOCHRONOUS:
+        break;
+    /* setting endpoint to VALID state */
+    default:
+        EP_RX_VALID(reg);
+        break;
     }
-    if (blen) *pma = *buf;
 }
 
-int32_t ep_write(uint8_t ep, void *buf, uint16_t blen) {
+int32_t ep_readv(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    pma_rec *rx = ep_rxbuf(ep);
+    int32_t res;
+    if (rx == 0) return -1;
+    res = pma_readv(iov, iovcnt, rx);
+    ep_rxrelease(ep);
+    return res;
+}
+
+int32_t ep_read(uint8_t ep, void *buf, uint16_t blen) {
+    usbd_iovec iov = {buf, blen};
+    return ep_readv(ep, &iov, 1);
+}
+
+static uint16_t pma_writev(const usbd_iovec *iov, uint8_t iovcnt, pma_rec *tx) {
+    uint16_t *pma = (void*)(USB_PMAADDR + 2 * tx->addr);
+    uint16_t cnt = 0;
+    uint16_t _t = 0;
+    for (; iovcnt; iovcnt--, iov++) {
+        const uint8_t *buf = iov->buf;
+        uint16_t blen = iov->len;
+        if (blen == 0) continue;
+        /* completing the PMA halfword started by the previous fragment */
+        if (cnt & 0x01) {
+            *pma = _t | (*buf++ << 8);
+            pma += 2;
+            cnt++;
+            blen--;
+        }
+        cnt += blen;
+        pma_put(pma, buf, blen >> 1);
+        pma += (blen >> 1) * 2;
+        buf += blen & ~0x01;
+        if (blen & 0x01) _t = *buf;
+    }
+    if (cnt & 0x01) *pma = _t;
+    tx->cnt = cnt;
+    return cnt;
+}
+
+/** \brief Helper function. Returns TX buffer descriptor to be filled.
+ * \return pointer to the buffer descriptor, NULL if endpoint is not ready.
+ */
+static pma_rec *ep_txbuf(uint8_t ep) {
     pma_table *tbl = EPT(ep);
+    uint16_t epr = *EPR(ep);
+    switch (epr & (USB_EPTX_STAT | USB_EP_T_FIELD | USB_EP_KIND)) {
+    /* doublebuffered bulk endpoint */
+    case (USB_EP_TX_VALID | USB_EP_BULK | USB_EP_KIND):
+        /* both buffers are filled */
+        if (tx_pending[ep & 0x07]) return 0;
+        return (epr & USB_EP_SWBUF_TX) ? &(tbl->tx1) : &(tbl->tx0);
+    /* isochronous endpoint */
+    case (USB_EP_TX_VALID | USB_EP_ISOCHRONOUS):
+        return (epr & USB_EP_DTOG_TX) ? &(tbl->tx0) : &(tbl->tx1);
+    /* regular endpoint */
+    case (USB_EP_TX_NAK | USB_EP_BULK):
+    case (USB_EP_TX_NAK | USB_EP_CONTROL):
+    case (USB_EP_TX_NAK | USB_EP_INTERRUPT):
+        return &(tbl->tx);
+    /* invalid or not ready */
+    default:
+        return 0;
+    }
+}
+
+/** \brief Helper function. Passes filled TX buffer to the hardware.
+ */
+static void ep_txcommit(uint8_t ep) {
     volatile uint16_t *reg = EPR(ep);
-    switch (*reg & (USB_EPTX_STAT | USB_EP_T_FIELD | USB_EP_KIND)) {
+    uint16_t _t;
+    switch (*reg & (USB_EP_T_FIELD | USB_EP_KIND)) {
     /* doublebuffered bulk endpoint */
-    case (USB_EP_TX_NAK   | USB_EP_BULK | USB_EP_KIND):
-        if (*reg & USB_EP_SWBUF_TX) {
-            pma_write(buf, blen, &(tbl->tx1));
-        } else {
-            pma_write(buf, blen, &(tbl->tx0));
+    case (USB_EP_BULK | USB_EP_KIND):
+        if (!(*reg & USB_EP_DTOG_TX) != !(*reg & USB_EP_SWBUF_TX)) {
+            /* other buffer is not sent yet. packet will be passed by evt_poll on its TX completion */
+            tx_pending[ep & 0x07] = 1;
+            /* TX completion could be processed before the packet was queued */
+            _t = *reg;
+            if (!(_t & USB_EP_DTOG_TX) != !(_t & USB_EP_SWBUF_TX)) break;
+            if ((_t & USB_EP_CTR_TX) || !tx_pending[ep & 0x07]) break;
+            tx_pending[ep & 0x07] = 0;
         }
-        *reg = (*reg & USB_EPREG_MASK) | USB_EP_SWBUF_TX;
+        _WSE(*reg, (*reg & USB_EPREG_MASK) | USB_EP_SWBUF_TX);
+        break;
+    /* isochronous endpoint. buffer is swapped by the hardware */
+    case USB_EP_ISOCHRONOUS:
         break;
+    /* regular endpoint */
+    default:
+        EP_TX_VALID(reg);
+        break;
+    }
+}
+
+int32_t ep_writev(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    pma_rec *tx = ep_txbuf(ep);
+    int32_t res;
+    if (tx == 0) return -1;
+    res = pma_writev(iov, iovcnt, tx);
+    ep_txcommit(ep);
+    return res;
+}
+
+int32_t ep_write_begin(uint8_t ep, usbd_epbuf *epbuf) {
+    pma_rec *tx = ep_txbuf(ep);
+    if (tx == 0) return -1;
+    epbuf->buf = (void*)(USB_PMAADDR + 2 * tx->addr);
+    epbuf->size = tx_size[ep & 0x07];
+    epbuf->shift = 1;
+    return epbuf->size;
+}
+
+int32_t ep_write_commit(uint8_t ep, uint16_t len) {
+    pma_rec *tx = ep_txbuf(ep);
+    if ((tx == 0) || (len > tx_size[ep & 0x07])) return -1;
+    tx->cnt = len;
+    ep_txcommit(ep);
+    return len;
+}
+
+int32_t ep_write(uint8_t ep, void *buf, uint16_t blen) {
+    usbd_iovec iov = {buf, blen};
+    return ep_writev(ep, &iov, 1);
+}
+
+int32_t ep_forward(uint8_t ep_out, uint8_t ep_in) {
+    pma_rec *rx = ep_rxbuf(ep_out);
+    pma_rec *tx = ep_txbuf(ep_in);
+    uint16_t _t;
+    if ((rx == 0) || (tx == 0)) return -1;
+    /* OUT endpoint takes the IN buffer, so it should be large enough for the RX */
+    if (get_pma_size(tx->addr) < get_pma_size(rx->addr)) return -1;
+    /* swapping buffers */
+    pma_swap(ep_in, tx->addr, ep_out, rx->addr);
+    _t = tx->addr;
+    tx->addr = rx->addr;
+    rx->addr = _t;
+    _t = rx->cnt & 0x03FF;
+    tx->cnt = _t;
+    rx->cnt &= ~0x03FF;
+    ep_txcommit(ep_in);
+    ep_rxrelease(ep_out);
+    return _t;
+}
+
+int32_t ep_txfree(uint8_t ep) {
+    uint16_t epr = *EPR(ep);
+    switch (epr & (USB_EPTX_STAT | USB_EP_T_FIELD | USB_EP_KIND)) {
+    /* doublebuffered bulk endpoint */
+    case (USB_EP_TX_VALID | USB_EP_BULK | USB_EP_KIND):
+        if (tx_pending[ep & 0x07]) return 0;
+        /* hardware owns one buffer if DTOG_TX differs from SWBUF_TX */
+        return (!(epr & USB_EP_DTOG_TX) != !(epr & USB_EP_SWBUF_TX)) ? 1 : 2;
     /* isochronous endpoint */
     case (USB_EP_TX_VALID | USB_EP_ISOCHRONOUS):
-        if (!(*reg & USB_EP_DTOG_TX)) {
-            pma_write(buf, blen, &(tbl->tx1));
-        } else {
-            pma_write(buf, blen, &(tbl->tx0));
-        }
-        break;
     /* regular endpoint */
     case (USB_EP_TX_NAK | USB_EP_BULK):
     case (USB_EP_TX_NAK | USB_EP_CONTROL):
     case (USB_EP_TX_NAK | USB_EP_INTERRUPT):
-        pma_write(buf, blen, &(tbl->tx));
-        EP_TX_VALID(reg);
-        break;
-    /* invalid or not ready */
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* drains received packets of the OUT endpoint to its ring */
+static void ep_rxdrain(uint8_t ep) {
+    usbd_rxring *ring = rx_ring[ep];
+    volatile uint16_t *reg = EPR(ep);
+    usbd_iovec iov[2];
+    pma_rec *rx;
+    uint16_t _t;
+    for (;;) {
+        /* nothing received to the hardware buffer of the doublebuffered bulk endpoint */
+        if (((*reg & (USB_EP_T_FIELD | USB_EP_KIND)) == (USB_EP_BULK | USB_EP_KIND)) && !ring->full &&
+            (!(*reg & USB_EP_DTOG_RX) != !(*reg & USB_EP_SWBUF_RX))) {
+            return;
+        }
+        /* drained buffer goes back to the hardware before the data is copied */
+        rx = ep_rxbuf(ep);
+        if (rx == 0) return;
+        /* packet is held by the endpoint until the ring has enough space */
+        if ((rx->cnt & 0x03FF) > usbd_rxring_space(ring, iov)) {
+            ring->full = 1;
+            return;
+        }
+        _t = pma_readv(iov, 2, rx);
+        /* data must be written before the head */
+        __asm__ volatile ("" ::: "memory");
+        ring->head += _t;
+        ring->full = 0;
+        ep_rxrelease(ep);
+    }
+}
+
+bool ep_setring(uint8_t ep, usbd_rxring *ring) {
+    uint16_t epr;
+    ep &= 0x07;
+    if (ring == 0) {
+        rx_ring[ep] = 0;
+        return true;
+    }
+    epr = *EPR(ep);
+    /* endpoint RX is disabled */
+    if ((epr & USB_EPRX_STAT) == USB_EP_RX_DIS) return false;
+    switch (epr & (USB_EP_T_FIELD | USB_EP_KIND)) {
+    case USB_EP_BULK:
+    case (USB_EP_BULK | USB_EP_KIND):
+    case USB_EP_INTERRUPT:
+        rx_ring[ep] = ring;
+        /* draining packets received before */
+        ep_rxdrain(ep);
+        return true;
     default:
-        return -1;
+        return false;
     }
-    return blen;
 }
 
 uint16_t get_frame (void) {
@@ -378,12 +811,19 @@ void evt_poll(usbd_device *dev, usbd_evt_callback callback) {
     if (_istr & USB_ISTR_CTR) {
         volatile uint16_t *reg = EPR(_ep);
         if (*reg & USB_EP_CTR_TX) {
-            *reg &= (USB_EPREG_MASK ^ USB_EP_CTR_TX);
+            _WSE(*reg, *reg & (USB_EPREG_MASK ^ USB_EP_CTR_TX));
+            /* passing the queued packet to the hardware */
+            if (tx_pending[_ep]) {
+                tx_pending[_ep] = 0;
+                _WSE(*reg, (*reg & USB_EPREG_MASK) | USB_EP_SWBUF_TX);
+            }
             _ep |= 0x80;
             _ev = usbd_evt_eptx;
         } else {
-            *reg &= (USB_EPREG_MASK ^ USB_EP_CTR_RX);
+            _WSE(*reg, *reg & (USB_EPREG_MASK ^ USB_EP_CTR_RX));
             _ev = (*reg & USB_EP_SETUP) ? usbd_evt_epsetup : usbd_evt_eprx;
+            /* early release of the endpoint buffers */
+            if (rx_ring[_ep]) ep_rxdrain(_ep);
         }
     } else if (_istr & USB_ISTR_RESET) {
         USB->ISTR &= ~USB_ISTR_RESET;
@@ -391,6 +831,7 @@ void evt_poll(usbd_device *dev, usbd_evt_callback callback) {
         for (int i = 0; i < 8; i++) {
             ep_deconfig(i);
         }
+        pma_release();
         _ev = usbd_evt_reset;
     } else if (_istr & USB_ISTR_SOF) {
         _ev = usbd_evt_sof;
@@ -442,7 +883,7 @@ uint16_t get_serialno_desc(void *buffer) {
 }
 
 const struct usbd_driver usb_stmv1 = {
-    0,
+    USBD_HW_LAYOUT | USBD_HW_EPREUSE,
     enable,
     reset,
     connect,
@@ -451,6 +892,15 @@ const struct usbd_driver usb_stmv1 = {
     ep_deconfig,
     ep_read,
     ep_write,
+    ep_readv,
+    ep_writev,
+    ep_write_begin,
+    ep_write_commit,
+    ep_forward,
+    ep_txfree,
+    ep_setring,
+    0,
+    ep_layout,
     ep_setstall,
     ep_isstalled,
     evt_poll,
@@ -25,6 +25,8 @@
 #define MAX_RX_PACKET   128
 #define MAX_CONTROL_EP  1
 #define MAX_FIFO_SZ     320  /*in 32-bit chunks */
+#define TX_STAGE_SZ     64   /* staging buffer for the leased IN packets in bytes */
+#define RX_STAGE_SZ     64   /* per-endpoint RX staging buffer in bytes, 0 to read packets from RX FIFO */
 
 #define RX_FIFO_SZ      ((4 * MAX_CONTROL_EP + 6) + ((MAX_RX_PACKET / 4) + 1) + (MAX_EP * 2) + 1)
 
@@ -32,6 +34,41 @@ USB_OTG_GlobalTypeDef * const OTG  = (void*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_GL
 USB_OTG_DeviceTypeDef * const OTGD = (void*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_DEVICE_BASE);
 volatile uint32_t * const OTGPCTL  = (void*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_PCGCCTL_BASE);
 
+/* TX FIFO can't be filled before the transfer size is known, so leased packets are staged here */
+static struct {
+    uint32_t    data[TX_STAGE_SZ / 4];
+    uint8_t     ep;     /* leased endpoint address, 0 if buffer is free */
+    uint8_t     size;   /* leased size, endpoint max packet size limited by TX_STAGE_SZ */
+} tx_stage;
+
+/* receive rings of the OUT endpoints */
+static usbd_rxring *rx_ring[MAX_EP];
+
+#if (RX_STAGE_SZ)
+/* OUT packets popped from the shared RX FIFO, so the packet that is not read yet doesn't block
+ * other endpoints */
+static struct {
+    uint32_t    data[RX_STAGE_SZ / 4];
+    uint16_t    len;
+    uint8_t     busy;
+} rx_stage[MAX_EP];
+#endif
+
+/* FIFO layout in 32-bit words. TX FIFOs of size 0 are allocated by ep_config */
+static struct {
+    uint16_t    rx;
+    uint16_t    tx[MAX_EP];
+} fifo_plan = {RX_FIFO_SZ, {0x10}};
+
+/* TX FIFOs taken by ep_config next to the planned ones. DIEPTXF values, released by the bus reset */
+static uint32_t tx_fifo[MAX_EP];
+
+/* IN streams. Data that is not pushed to the TX FIFO yet */
+static struct {
+    const uint8_t   *buf;
+    uint16_t        len;
+} tx_stream[MAX_EP];
+
 
 inline static volatile uint32_t* EPFIFO(uint8_t ep) {
     return (uint32_t*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_FIFO_BASE + (ep << 12));
@@ -45,15 +82,93 @@ inline static USB_OTG_OUTEndpointTypeDef* EPOUT(uint8_t ep) {
     return (void*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_OUT_ENDPOINT_BASE + (ep << 5));
 }
 
+/* unaligned word access */
+typedef struct __attribute__((packed)) {
+    uint32_t    w;
+} uword_t;
+
+/**\brief Helper. Pops data from RX FIFO
+ * \details Aligned buffers are filled by 4-word LDM/STM bursts on Cortex-M4. The last word is
+ * stored bytewise, so nothing is written beyond the buffer.
+ * \param fifo RX FIFO
+ * \param buf pointer to the buffer
+ * \param len number of bytes. (len + 3) / 4 words are popped.
+ */
+static void fifo_read(volatile uint32_t *fifo, void *buf, uint32_t len) {
+    uint8_t *_b = buf;
+#if defined(__ARM_ARCH_7EM__) && !defined(USBD_EMU)
+    if ((len >= 16) && !((uint32_t)_b & 0x03)) {
+        uint32_t _n = len >> 4;
+        len &= 0x0F;
+        /* all addresses in the FIFO window access the FIFO */
+        __asm__ volatile (
+            "1:                                 \n\t"
+            "ldm    %[fifo], {r2, r3, r4, r5}    \n\t"
+            "stmia  %[dst]!, {r2, r3, r4, r5}    \n\t"
+            "subs   %[n], #1                    \n\t"
+            "bne    1b                          \n\t"
+            : [dst] "+r" (_b), [n] "+r" (_n)
+            : [fifo] "r" (fifo)
+            : "r2", "r3", "r4", "r5", "cc", "memory");
+    }
+#endif
+    for (; len >= 4; len -= 4, _b += 4) {
+        ((uword_t*)_b)->w = _RSE(*fifo);
+    }
+    if (len) {
+        uint32_t _t = _RSE(*fifo);
+        while (len--) {
+            *_b++ = _t & 0xFF;
+            _t >>= 8;
+        }
+    }
+}
+
+/**\brief Helper. Pushes data to TX FIFO
+ * \details Aligned buffers are read by 4-word LDM/STM bursts on Cortex-M4. The last word is
+ * loaded bytewise, so nothing is read beyond the buffer.
+ * \param fifo TX FIFO
+ * \param buf pointer to the data
+ * \param len number of bytes. (len + 3) / 4 words are pushed.
+ */
+static void fifo_write(volatile uint32_t *fifo, const void *buf, uint32_t len) {
+    const uint8_t *_b = buf;
+#if defined(__ARM_ARCH_7EM__) && !defined(USBD_EMU)
+    if ((len >= 16) && !((uint32_t)_b & 0x03)) {
+        uint32_t _n = len >> 4;
+        len &= 0x0F;
+        __asm__ volatile (
+            "1:                                 \n\t"
+            "ldmia  %[src]!, {r2, r3, r4, r5}    \n\t"
+            "stm    %[fifo], {r2, r3, r4, r5}    \n\t"
+            "subs   %[n], #1                    \n\t"
+            "bne    1b                          \n\t"
+            : [src] "+r" (_b), [n] "+r" (_n)
+            : [fifo] "r" (fifo)
+            : "r2", "r3", "r4", "r5", "cc", "memory");
+    }
+#endif
+    for (; len >= 4; len -= 4, _b += 4) {
+        _WSE(*fifo, ((const uword_t*)_b)->w);
+    }
+    if (len) {
+        uint32_t _t = 0;
+        for (unsigned i = 0; i < len; i++) {
+            _t |= (uint32_t)_b[i] << (i << 3);
+        }
+        _WSE(*fifo, _t);
+    }
+}
+
 inline static void Flush_RX(void) {
     _BST(OTG->GRSTCTL, USB_OTG_GRSTCTL_RXFFLSH);
-    _WBC(OTG->GRSTCTL, USB_OTG_GRSTCTL_RXFFLSH);
+    _WBC(_RSE(OTG->GRSTCTL), USB_OTG_GRSTCTL_RXFFLSH);
 }
 
 inline static void Flush_TX(uint8_t ep) {
     _BMD(OTG->GRSTCTL, USB_OTG_GRSTCTL_TXFNUM,
          _VAL2FLD(USB_OTG_GRSTCTL_TXFNUM, ep) | USB_OTG_GRSTCTL_TXFFLSH);
-    _WBC(OTG->GRSTCTL, USB_OTG_GRSTCTL_TXFFLSH);
+    _WBC(_RSE(OTG->GRSTCTL), USB_OTG_GRSTCTL_TXFFLSH);
 }
 
 void ep_setstall(uint8_t ep, bool stall) {
@@ -103,7 +218,7 @@ void enable(bool enable) {
         /* do core soft reset */
         _WBS(OTG->GRSTCTL, USB_OTG_GRSTCTL_AHBIDL);
         _BST(OTG->GRSTCTL, USB_OTG_GRSTCTL_CSRST);
-        _WBC(OTG->GRSTCTL, USB_OTG_GRSTCTL_CSRST);
+        _WBC(_RSE(OTG->GRSTCTL), USB_OTG_GRSTCTL_CSRST);
         /* configure OTG as device */
         OTG->GUSBCFG = USB_OTG_GUSBCFG_FDMOD | USB_OTG_GUSBCFG_PHYSEL |
                        _VAL2FLD(USB_OTG_GUSBCFG_TRDT, 0x06);
@@ -123,19 +238,20 @@ void enable(bool enable) {
              _VAL2FLD(USB_OTG_DCFG_PERSCHIVL, 0) | _VAL2FLD(USB_OTG_DCFG_DSPD, 0x03));
         /* unmask EP interrupts */
         OTGD->DIEPMSK = USB_OTG_DIEPMSK_XFRCM;
+        OTGD->DOEPMSK = USB_OTG_DOEPMSK_XFRCM | USB_OTG_DOEPMSK_STUPM;
         /* unmask core interrupts */
         OTG->GINTMSK  = USB_OTG_GINTMSK_USBRST | USB_OTG_GINTMSK_ENUMDNEM |
                         USB_OTG_GINTMSK_SOFM |
                         USB_OTG_GINTMSK_USBSUSPM | USB_OTG_GINTMSK_WUIM |
-                        USB_OTG_GINTMSK_IEPINT | USB_OTG_GINTMSK_RXFLVLM;
+                        USB_OTG_GINTMSK_IEPINT | USB_OTG_GINTMSK_OEPINT |
+                        USB_OTG_GINTMSK_RXFLVLM;
         /* clear pending interrupts */
-        OTG->GINTSTS = 0xFFFFFFFF;
-        /* unmask global interrupt */
+        _WSE(OTG->GINTSTS, 0xFFFFFFFF);
+        /* unmask global interrupt. TX FIFO empty interrupt is raised on half empty FIFO */
         OTG->GAHBCFG = USB_OTG_GAHBCFG_GINT;
-        /* setting max RX FIFO size */
-        OTG->GRXFSIZ = RX_FIFO_SZ;
-        /* setting up EP0 TX FIFO SZ as 64 byte */
-        OTG->GNPTXFSIZ = RX_FIFO_SZ | (0x10 << 16);
+        /* setting RX FIFO and EP0 TX FIFO sizes */
+        OTG->GRXFSIZ = fifo_plan.rx;
+        OTG->GNPTXFSIZ = fifo_plan.rx | (fifo_plan.tx[0] << 16);
     } else {
         if (RCC->AHB2ENR & RCC_AHB2ENR_OTGFSEN) {
             _BCL(PWR->CR2, PWR_CR2_USV);
@@ -196,29 +312,49 @@ void setaddr (uint8_t addr) {
  * \return true if TX fifo is successfully set
  */
 static bool set_tx_fifo(uint8_t ep, uint16_t epsize) {
-    uint32_t _fsa = OTG->GNPTXFSIZ;
-    /* calculating initial TX FIFO address. next from EP0 TX fifo */
-    _fsa = 0xFFFF & (_fsa + (_fsa >> 16));
+    uint32_t _fsa = fifo_plan.rx;
+    /* getting in 32 bit terms */
+    epsize = (epsize + 0x03) >> 2;
+    /* planned fifo. placed next to the previous one */
+    if (fifo_plan.tx[ep]) {
+        if (epsize > fifo_plan.tx[ep]) return false;
+        for (int i = 0; i < ep; i++) {
+            _fsa += fifo_plan.tx[i];
+        }
+        OTG->DIEPTXF[ep - 1] = _fsa | (fifo_plan.tx[ep] << 16);
+        return true;
+    }
+    /* calculating requited TX fifo size */
+    /* it must be 16 32-bit words minimum */
+    if (epsize < 0x10) epsize = 0x10;
+    /* reconfigured endpoint takes the same fifo if it fits */
+    if (tx_fifo[ep]) {
+        if (epsize <= (tx_fifo[ep] >> 16)) {
+            OTG->DIEPTXF[ep - 1] = tx_fifo[ep];
+            return true;
+        }
+        tx_fifo[ep] = 0;
+    }
+    /* calculating initial TX FIFO address. next from the planned fifos */
+    for (int i = 0; i < MAX_EP; i++) {
+        _fsa += fifo_plan.tx[i];
+    }
     /* looking for next free TX fifo address */
-    for (int i = 0; i < (MAX_EP - 1); i++) {
-        uint32_t _t = OTG->DIEPTXF[i];
-        if ((_t & 0xFFFF) < 0x200) {
+    for (int i = 1; i < MAX_EP; i++) {
+        uint32_t _t = tx_fifo[i];
+        if (_t) {
             _t = 0xFFFF & (_t + (_t >> 16));
             if (_t > _fsa) {
                 _fsa = _t;
             }
         }
     }
-    /* calculating requited TX fifo size */
-    /* getting in 32 bit terms */
-    epsize = (epsize + 0x03) >> 2;
-    /* it must be 16 32-bit words minimum */
-    if (epsize < 0x10) epsize = 0x10;
     /* checking for the available fifo */
     if ((_fsa + epsize) > MAX_FIFO_SZ) return false;
     /* programming fifo register */
     _fsa |= (epsize << 16);
     OTG->DIEPTXF[ep - 1] = _fsa;
+    tx_fifo[ep] = _fsa;
     return true;
 }
 
@@ -239,7 +375,14 @@ bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
             epsize = 0x40;
             mpsize = 0x00;
         }
-        /* EP0 TX FIFO size is setted on init level */
+        /* EP0 TX FIFO size is setted on init level. Applying the new layout if it's changed */
+        if ((OTG->GRXFSIZ != fifo_plan.rx) ||
+            (OTG->GNPTXFSIZ != (fifo_plan.rx | (fifo_plan.tx[0] << 16)))) {
+            OTG->GRXFSIZ = fifo_plan.rx;
+            OTG->GNPTXFSIZ = fifo_plan.rx | (fifo_plan.tx[0] << 16);
+            Flush_RX();
+            Flush_TX(0x10);
+        }
         /* enabling RX and TX interrupts from EP0 */
         OTGD->DAINTMSK |= 0x00010001;
         /* setting up EP0 TX and RX registers */
@@ -254,13 +397,9 @@ bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
         ep &= 0x7F;
         USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
         /* configuring TX endpoint */
-        /* setting up TX fifo and size register */
-        if ((eptype == USB_EPTYPE_ISOCHRONUS) ||
-            (eptype == (USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF))) {
-            if (!set_tx_fifo(ep, epsize << 1)) return false;
-        } else {
-            if (!set_tx_fifo(ep, epsize)) return false;
-        }
+        /* setting up TX fifo and size register. FIFO holds two packets, so the next packet is
+         * pushed on the half empty FIFO while the previous one is sent */
+        if (!set_tx_fifo(ep, epsize << 1)) return false;
         /* enabling EP TX interrupt */
         OTGD->DAINTMSK |= (0x0001UL << ep);
         /* setting up TX control register*/
@@ -286,6 +425,10 @@ bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
     } else {
         /* configuring RX endpoint */
         USB_OTG_OUTEndpointTypeDef* epo = EPOUT(ep);
+        /* enabling EP RX interrupt */
+        OTGD->DAINTMSK |= (0x10000UL << ep);
+        /* 1 packet per transfer */
+        epo->DOEPTSIZ = (1 << 19) | epsize;
         /* setting up RX control register */
         switch (eptype) {
         case USB_EPTYPE_ISOCHRONUS:
@@ -309,6 +452,66 @@ bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
     return true;
 }
 
+bool ep_layout(const usbd_epcfg *cfg, uint8_t count, usbd_layout_report *rep) {
+    uint16_t tx[MAX_EP] = {0x10};
+    uint32_t rxmax = 0x10;
+    uint32_t rxbuf = 1;
+    uint32_t outs = 1;
+    uint32_t rx, used = 0;
+    uint8_t ep = 0xFF;
+    for (; count; count--, cfg++) {
+        uint32_t _t = (cfg->epsize + 0x03) >> 2;
+        uint8_t _ep = cfg->ep & 0x7F;
+        if (_ep >= MAX_EP) {
+            ep = cfg->ep;
+            break;
+        }
+        if (_ep == 0) {
+            /* control endpoint uses both EP0 TX FIFO and RX FIFO */
+            if (_t > tx[0]) tx[0] = _t;
+            if (_t > rxmax) rxmax = _t;
+            continue;
+        }
+        /* second packet for the doublebuffered and isochronous OUT endpoints */
+        if (!(cfg->ep & 0x80) && ((cfg->eptype == USB_EPTYPE_ISOCHRONUS) ||
+            (cfg->eptype == (USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF)))) {
+            rxbuf = 2;
+        }
+        if (cfg->ep & 0x80) {
+            /* TX FIFO holds two packets, it must be 16 32-bit words minimum */
+            _t <<= 1;
+            tx[_ep] = (_t < 0x10) ? 0x10 : _t;
+        } else {
+            outs++;
+            if (_t > rxmax) rxmax = _t;
+        }
+    }
+    if (ep == 0xFF) {
+        /* RX FIFO holds SETUP packets, the largest OUT packets with the status word and the
+         * transfer completion words of each OUT endpoint */
+        rx = (4 * MAX_CONTROL_EP + 6) + (rxmax * rxbuf + 1) + (outs * 2) + 1;
+        used = rx;
+        if (used > MAX_FIFO_SZ) ep = 0x00;
+        for (int i = 0; i < MAX_EP; i++) {
+            used += tx[i];
+            if ((used > MAX_FIFO_SZ) && (ep == 0xFF)) ep = 0x80 | i;
+        }
+        /* new layout is applied by the bus reset */
+        if (ep == 0xFF) {
+            fifo_plan.rx = rx;
+            for (int i = 0; i < MAX_EP; i++) {
+                fifo_plan.tx[i] = tx[i];
+            }
+        }
+    }
+    if (rep) {
+        rep->size = MAX_FIFO_SZ * 4;
+        rep->used = used * 4;
+        rep->ep = ep;
+    }
+    return (ep == 0xFF);
+}
+
 void ep_deconfig(uint8_t ep) {
     ep &= 0x7F;
     volatile USB_OTG_INEndpointTypeDef*  epi = EPIN(ep);
@@ -326,122 +529,537 @@ void ep_deconfig(uint8_t ep) {
         _WBS(epi->DIEPINT, USB_OTG_DIEPINT_EPDISD);
     }
     /* clean EP interrupts */
-    epi->DIEPINT = 0xFF;
+    _WSE(epi->DIEPINT, 0xFF);
+    /* dropping IN stream and the leased packet */
+    tx_stream[ep].len = 0;
+    if (tx_stage.ep == (ep | 0x80)) tx_stage.ep = 0;
+    _BCL(OTGD->DIEPEMPMSK, 0x0001UL << ep);
     /* deconfiguring TX FIFO */
     if (ep > 0) {
         OTG->DIEPTXF[ep-1] = 0x02000200 + 0x200 * ep;
     }
     /* deconfigureing RX part */
+    rx_ring[ep] = 0;
+#if (RX_STAGE_SZ)
+    rx_stage[ep].busy = 0;
+#endif
     _BCL(epo->DOEPCTL, USB_OTG_DOEPCTL_USBAEP);
     if ((epo->DOEPCTL & USB_OTG_DOEPCTL_EPENA) && (ep != 0)) {
         epo->DOEPCTL = USB_OTG_DOEPCTL_EPDIS;
         _WBS(epo->DOEPINT, USB_OTG_DOEPINT_EPDISD);
     }
-    epo->DOEPINT = 0xFF;
+    _WSE(epo->DOEPINT, 0xFF);
+}
+
+#if (RX_STAGE_SZ)
+/**\brief Helper. Pops the packet on top of the RX FIFO to the endpoint staging buffer
+ * \param ep endpoint index
+ * \param setup true for SETUP packet. It overrides the staged packet.
+ * \return true if packet is staged
+ */
+static bool rx_stage_pop(uint8_t ep, bool setup) {
+    volatile uint32_t *fifo = EPFIFO(0);
+    uint32_t len = _FLD2VAL(USB_OTG_GRXSTSP_BCNT, OTG->GRXSTSR);
+    /* packet stays in RX FIFO */
+    if ((rx_stage[ep].busy && !setup) || (len > RX_STAGE_SZ)) return false;
+    (void)_RSE(OTG->GRXSTSP);
+    fifo_read(fifo, rx_stage[ep].data, len);
+    rx_stage[ep].len = len;
+    rx_stage[ep].busy = 1;
+    return true;
+}
+
+/**\brief Helper. Reads staged packet and releases the endpoint
+ * \return number of the read bytes
+ */
+static int32_t rx_stage_readv(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    const uint8_t *src = (const uint8_t*)rx_stage[ep].data;
+    uint32_t rem = rx_stage[ep].len;
+    for (; iovcnt && rem; iovcnt--, iov++) {
+        uint8_t *buf = iov->buf;
+        uint32_t _t = (iov->len < rem) ? iov->len : rem;
+        rem -= _t;
+        while (_t--) {
+            *buf++ = *src++;
+        }
+    }
+    rx_stage[ep].busy = 0;
+    _BST(EPOUT(ep)->DOEPCTL, USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA);
+    return rx_stage[ep].len - rem;
+}
+#endif
+
+/**\brief Helper. Gets length of the received packet
+ * \param ep endpoint index
+ * \return packet length, -1 if endpoint has no received packet
+ */
+static int32_t rx_pending(uint8_t ep) {
+#if (RX_STAGE_SZ)
+    if (rx_stage[ep].busy) return rx_stage[ep].len;
+#endif
+    if (!(OTG->GINTSTS & USB_OTG_GINTSTS_RXFLVL)) return -1;
+    if ((OTG->GRXSTSR & USB_OTG_GRXSTSP_EPNUM) != ep) return -1;
+    return _FLD2VAL(USB_OTG_GRXSTSP_BCNT, OTG->GRXSTSR);
 }
 
 int32_t ep_read(uint8_t ep, void* buf, uint16_t blen) {
-    uint32_t len;
+    uint32_t len, _t;
     volatile uint32_t *fifo = EPFIFO(0);
     USB_OTG_OUTEndpointTypeDef* epo = EPOUT(ep);
+#if (RX_STAGE_SZ)
+    if (rx_stage[ep & 0x7F].busy) {
+        usbd_iovec iov = {buf, blen};
+        /* packet length is reported like for the packets read from the RX FIFO */
+        rx_stage_readv(ep & 0x7F, &iov, 1);
+        return rx_stage[ep & 0x7F].len;
+    }
+#endif
     /* no data in RX FIFO */
     if (!(OTG->GINTSTS & USB_OTG_GINTSTS_RXFLVL)) return -1;
     ep &= 0x7F;
     if ((OTG->GRXSTSR & USB_OTG_GRXSTSP_EPNUM) != ep) return -1;
     /* pop data from fifo */
-    len = _FLD2VAL(USB_OTG_GRXSTSP_BCNT, OTG->GRXSTSP);
-    for (unsigned i = 0; i < len; i +=4) {
-        uint32_t _t = *fifo;
-        if (blen >= 4) {
-            *(__attribute__((packed))uint32_t*)buf = _t;
-            blen -= 4;
-            buf += 4;
-        } else {
-            while (blen){
-                *(uint8_t*)buf = 0xFF & _t;
+    len = _FLD2VAL(USB_OTG_GRXSTSP_BCNT, _RSE(OTG->GRXSTSP));
+    _t = (blen < len) ? blen : len;
+    fifo_read(fifo, buf, _t);
+    /* dropping the rest of the packet */
+    for (_t = ((len + 3) >> 2) - ((_t + 3) >> 2); _t; _t--) {
+        (void)_RSE(*fifo);
+    }
+    _BST(epo->DOEPCTL, USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA);
+    /* packet is read. next RX FIFO entry can be reported */
+    _BST(OTG->GINTMSK, USB_OTG_GINTMSK_RXFLVLM);
+    return len;
+}
+
+int32_t ep_readv(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    uint32_t len, rem, _t = 0;
+    unsigned _s = 0;
+    volatile uint32_t *fifo = EPFIFO(0);
+    USB_OTG_OUTEndpointTypeDef* epo = EPOUT(ep);
+#if (RX_STAGE_SZ)
+    if (rx_stage[ep & 0x7F].busy) return rx_stage_readv(ep & 0x7F, iov, iovcnt);
+#endif
+    /* no data in RX FIFO */
+    if (!(OTG->GINTSTS & USB_OTG_GINTSTS_RXFLVL)) return -1;
+    ep &= 0x7F;
+    if ((OTG->GRXSTSR & USB_OTG_GRXSTSP_EPNUM) != ep) return -1;
+    /* pop data from fifo */
+    len = _FLD2VAL(USB_OTG_GRXSTSP_BCNT, _RSE(OTG->GRXSTSP));
+    rem = len;
+    for (; iovcnt; iovcnt--, iov++) {
+        uint8_t *buf = iov->buf;
+        uint16_t blen = iov->len;
+        /* taking bytes left from the FIFO word popped for the previous fragment */
+        while (blen && _s) {
+            *buf++ = _t & 0xFF;
+            _t >>= 8;
+            _s--;
+            blen--;
+        }
+        if (blen >= 4 && rem >= 4) {
+            uint32_t _n = ((blen < rem) ? blen : rem) & ~0x03UL;
+            fifo_read(fifo, buf, _n);
+            buf += _n;
+            blen -= _n;
+            rem -= _n;
+        }
+        if (blen && rem) {
+            _t = _RSE(*fifo);
+            _s = (rem < 4) ? rem : 4;
+            rem -= _s;
+            while (blen && _s) {
+                *buf++ = _t & 0xFF;
                 _t >>= 8;
-                blen --;
+                _s--;
+                blen--;
             }
         }
     }
+    len -= rem + _s;
+    /* dropping the rest of the packet */
+    for (rem = (rem + 3) >> 2; rem; rem--) {
+        (void)_RSE(*fifo);
+    }
     _BST(epo->DOEPCTL, USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA);
+    /* packet is read. next RX FIFO entry can be reported */
+    _BST(OTG->GINTMSK, USB_OTG_GINTMSK_RXFLVLM);
     return len;
 }
 
+/**\brief Helper. Gets number of packets for the IN transfer
+ * \param epi IN endpoint registers
+ * \param blen transfer size in bytes
+ * \return packet count for DIEPTSIZ, 0 if the endpoint is not configured. Isochronous endpoints
+ * pass a single packet.
+ */
+static uint32_t tx_pktcnt(USB_OTG_INEndpointTypeDef* epi, uint32_t blen) {
+    uint32_t _mps = epi->DIEPCTL & USB_OTG_DIEPCTL_MPSIZ;
+    if (_mps == 0) return 0;
+    if (blen <= _mps) return 1;
+    if (((epi->DIEPCTL & USB_OTG_DIEPCTL_EPTYP) >> 18) == 0x01) return 1;
+    return (blen + _mps - 1) / _mps;
+}
+
+/**\brief Helper. Fits IN transfer to the TX FIFO
+ * \details Multi-packet transfer is cut to the max packet size packets that fit the TX FIFO.
+ * \param ep endpoint index
+ * \param[in,out] blen transfer size in bytes
+ * \return packet count for DIEPTSIZ, 0 if the transfer can't be started
+ */
+static uint32_t tx_fit(uint8_t ep, uint32_t *blen) {
+    USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
+    uint32_t _pkt = 1;
+    if (ep != 0) {
+        if (epi->DIEPCTL & USB_OTG_DIEPCTL_EPENA) return 0;
+        _pkt = tx_pktcnt(epi, *blen);
+        if (_pkt > 1 && ((*blen + 3) >> 2) > epi->DTXFSTS) {
+            uint32_t _mps = epi->DIEPCTL & USB_OTG_DIEPCTL_MPSIZ;
+            _pkt = (epi->DTXFSTS << 2) / _mps;
+            *blen = _pkt * _mps;
+        }
+    }
+    /* no enough space in TX fifo */
+    if (((*blen + 3) >> 2) > epi->DTXFSTS) return 0;
+    return _pkt;
+}
+
 int32_t ep_write(uint8_t ep, void *buf, uint16_t blen) {
     ep &= 0x7F;
     volatile uint32_t* _fifo = EPFIFO(ep);
     USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
-    /* transfer data size in 32-bit words */
-    uint32_t  _len = (blen + 3) >> 2;
-    /* no enough space in TX fifo */
-    if (_len > epi->DTXFSTS) return -1;
-    if (ep != 0 && epi->DIEPCTL & USB_OTG_DIEPCTL_EPENA) {
+    uint32_t _len = blen;
+    uint32_t _pkt = tx_fit(ep, &_len);
+    if (_pkt == 0) return -1;
+    epi->DIEPTSIZ = 0;
+    epi->DIEPTSIZ = (_pkt << 19) + _len;
+    _BMD(epi->DIEPCTL, USB_OTG_DIEPCTL_STALL, USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK);
+    fifo_write(_fifo, buf, _len);
+    return _len;
+}
+
+int32_t ep_writev(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    ep &= 0x7F;
+    volatile uint32_t* _fifo = EPFIFO(ep);
+    USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
+    uint32_t blen = 0;
+    uint32_t _t = 0;
+    unsigned _s = 0;
+    for (unsigned i = 0; i < iovcnt; i++) {
+        blen += iov[i].len;
+    }
+    uint32_t _pkt = tx_fit(ep, &blen);
+    if (_pkt == 0) return -1;
+    epi->DIEPTSIZ = 0;
+    epi->DIEPTSIZ = (_pkt << 19) + blen;
+    _BMD(epi->DIEPCTL, USB_OTG_DIEPCTL_STALL, USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK);
+    /* fragments are written up to the fitted transfer size */
+    uint32_t rem = blen;
+    for (; iovcnt && rem; iovcnt--, iov++) {
+        const uint8_t *buf = iov->buf;
+        uint32_t len = (iov->len < rem) ? iov->len : rem;
+        rem -= len;
+        /* completing the FIFO word started by the previous fragment */
+        while (len && _s) {
+            _t |= (uint32_t)*buf++ << _s;
+            len--;
+            _s = (_s + 8) & 0x1F;
+            if (_s == 0) {
+                _WSE(*_fifo, _t);
+                _t = 0;
+            }
+        }
+        if (len >= 4) {
+            fifo_write(_fifo, buf, len & ~0x03);
+            buf += len & ~0x03;
+            len &= 0x03;
+        }
+        while (len) {
+            _t |= (uint32_t)*buf++ << _s;
+            _s += 8;
+            len--;
+        }
+    }
+    if (_s) _WSE(*_fifo, _t);
+    return blen;
+}
+
+/**\brief Helper. Tops up TX FIFO from the IN stream
+ * \details Pushes whole packets while they fit the FIFO. TX FIFO empty interrupt is masked when
+ * all stream data is pushed.
+ * \param ep endpoint index
+ */
+static void tx_fill(uint8_t ep) {
+    volatile uint32_t* _fifo = EPFIFO(ep);
+    USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
+    uint32_t _mps = epi->DIEPCTL & USB_OTG_DIEPCTL_MPSIZ;
+    while (tx_stream[ep].len) {
+        uint32_t _t = (tx_stream[ep].len < _mps) ? tx_stream[ep].len : _mps;
+        uint32_t _len = (_t + 3) >> 2;
+        if (_len > epi->DTXFSTS) return;
+        fifo_write(_fifo, tx_stream[ep].buf, _t);
+        tx_stream[ep].buf += _t;
+        tx_stream[ep].len -= _t;
+    }
+    _BCL(OTGD->DIEPEMPMSK, 0x0001UL << ep);
+}
+
+int32_t ep_stream(uint8_t ep, const void *buf, uint16_t blen) {
+    ep &= 0x7F;
+    USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
+    uint32_t _mps = epi->DIEPCTL & USB_OTG_DIEPCTL_MPSIZ;
+    uint32_t _pkt;
+    if (ep == 0 || blen == 0 || _mps == 0) return -1;
+    if (epi->DIEPCTL & USB_OTG_DIEPCTL_EPENA) return -1;
+    /* isochronous endpoint passes a single packet per frame */
+    if (((epi->DIEPCTL & USB_OTG_DIEPCTL_EPTYP) >> 18) == 0x01) {
+        return ep_write(ep, (void*)buf, (blen < _mps) ? blen : _mps);
+    }
+    /* cutting stream to the PKTCNT field range */
+    _pkt = (blen + _mps - 1) / _mps;
+    if (_pkt > 0x3FF) {
+        _pkt = 0x3FF;
+        blen = _pkt * _mps;
+    }
+    tx_stream[ep].buf = buf;
+    tx_stream[ep].len = blen;
+    epi->DIEPTSIZ = 0;
+    epi->DIEPTSIZ = (_pkt << 19) + blen;
+    _BMD(epi->DIEPCTL, USB_OTG_DIEPCTL_STALL, USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK);
+    /* the rest of data is pushed on TX FIFO empty interrupts */
+    _BST(OTGD->DIEPEMPMSK, 0x0001UL << ep);
+    tx_fill(ep);
+    return blen;
+}
+
+int32_t ep_write_begin(uint8_t ep, usbd_epbuf *epbuf) {
+    uint32_t _mps;
+    ep &= 0x7F;
+    volatile USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
+    /* staging buffer is shared, the endpoint holding it can lease it again */
+    if (tx_stage.ep && (tx_stage.ep != (ep | 0x80))) return -1;
+    if (ep == 0) {
+        _mps = 0x40 >> (epi->DIEPCTL & 0x03);
+    } else if (epi->DIEPCTL & USB_OTG_DIEPCTL_USBAEP) {
+        _mps = epi->DIEPCTL & USB_OTG_DIEPCTL_MPSIZ;
+    } else {
         return -1;
     }
+    if (epi->DIEPCTL & USB_OTG_DIEPCTL_EPENA) return -1;
+    if (_mps > TX_STAGE_SZ) _mps = TX_STAGE_SZ;
+    tx_stage.ep = ep | 0x80;
+    tx_stage.size = _mps;
+    epbuf->buf = tx_stage.data;
+    epbuf->size = _mps;
+    epbuf->shift = 0;
+    return _mps;
+}
+
+int32_t ep_write_commit(uint8_t ep, uint16_t len) {
+    int32_t res;
+    if (tx_stage.ep != (ep | 0x80)) return -1;
+    if (len > tx_stage.size) return -1;
+    res = ep_write(ep, tx_stage.data, len);
+    if (res >= 0) tx_stage.ep = 0;
+    return res;
+}
+
+int32_t ep_forward(uint8_t ep_out, uint8_t ep_in) {
+    int32_t len;
+    uint32_t _len;
+    volatile uint32_t *_rxfifo = EPFIFO(0);
+    ep_in &= 0x7F;
+    ep_out &= 0x7F;
+    volatile uint32_t *_txfifo = EPFIFO(ep_in);
+    USB_OTG_OUTEndpointTypeDef* epo = EPOUT(ep_out);
+    USB_OTG_INEndpointTypeDef* epi = EPIN(ep_in);
+    /* no received packet */
+    len = rx_pending(ep_out);
+    if (len < 0) return -1;
+    _len = (len + 3) >> 2;
+    /* packet stays in RX FIFO until IN endpoint is ready */
+    if (_len > epi->DTXFSTS) return -1;
+    if (ep_in != 0) {
+        if (epi->DIEPCTL & USB_OTG_DIEPCTL_EPENA) return -1;
+        if (len > (epi->DIEPCTL & USB_OTG_DIEPCTL_MPSIZ)) return -1;
+    }
     epi->DIEPTSIZ = 0;
-    epi->DIEPTSIZ = (1 << 19) + blen;
+    epi->DIEPTSIZ = (1 << 19) + len;
     _BMD(epi->DIEPCTL, USB_OTG_DIEPCTL_STALL, USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK);
+#if (RX_STAGE_SZ)
+    if (rx_stage[ep_out].busy) {
+        /* moving data from the staging buffer to TX FIFO */
+        for (unsigned i = 0; i < _len; i++) {
+            _WSE(*_txfifo, rx_stage[ep_out].data[i]);
+        }
+        rx_stage[ep_out].busy = 0;
+        _BST(epo->DOEPCTL, USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA);
+        return len;
+    }
+#endif
+    (void)_RSE(OTG->GRXSTSP);
+    /* moving data from RX FIFO to TX FIFO */
     while (_len--) {
-        *_fifo = *(__attribute__((packed)) uint32_t*)buf;
-        buf += 4;
+        _WSE(*_txfifo, _RSE(*_rxfifo));
+    }
+    _BST(epo->DOEPCTL, USB_OTG_DOEPCTL_CNAK | USB_OTG_DOEPCTL_EPENA);
+    /* packet is read. next RX FIFO entry can be reported */
+    _BST(OTG->GINTMSK, USB_OTG_GINTMSK_RXFLVLM);
+    return len;
+}
+
+int32_t ep_txfree(uint8_t ep) {
+    ep &= 0x7F;
+    /* single packet is transmitted at once */
+    if (ep != 0 && EPIN(ep)->DIEPCTL & USB_OTG_DIEPCTL_EPENA) return 0;
+    return 1;
+}
+
+/* drains the staged OUT packet or the packet on top of the RX FIFO to the endpoint ring */
+static bool ep_rxdrain(uint8_t ep) {
+    usbd_rxring *ring = rx_ring[ep];
+    usbd_iovec iov[2];
+    int32_t len;
+    /* packet stays in the endpoint until the ring has enough space */
+    if (rx_pending(ep) > usbd_rxring_space(ring, iov)) {
+        ring->full = 1;
+        return false;
+    }
+    len = ep_readv(ep, iov, 2);
+    /* data must be written before the head */
+    __asm__ volatile ("" ::: "memory");
+    ring->head += len;
+    ring->full = 0;
+    return true;
+}
+
+bool ep_setring(uint8_t ep, usbd_rxring *ring) {
+    ep &= 0x7F;
+    USB_OTG_OUTEndpointTypeDef* epo = EPOUT(ep);
+    if (ring == 0) {
+        rx_ring[ep] = 0;
+        return true;
+    }
+    if (ep == 0 || !(epo->DOEPCTL & USB_OTG_DOEPCTL_USBAEP)) return false;
+    switch ((epo->DOEPCTL & USB_OTG_DOEPCTL_EPTYP) >> 18) {
+    case 0x02:
+    case 0x03:
+        rx_ring[ep] = ring;
+        /* draining the held packet */
+#if (RX_STAGE_SZ)
+        if (rx_stage[ep].busy) {
+            ep_rxdrain(ep);
+            return true;
+        }
+#endif
+        if ((OTG->GINTSTS & USB_OTG_GINTSTS_RXFLVL) &&
+            ((OTG->GRXSTSR & USB_OTG_GRXSTSP_EPNUM) == ep) &&
+            (_FLD2VAL(USB_OTG_GRXSTSP_PKTSTS, OTG->GRXSTSR) == 0x02)) {
+            ep_rxdrain(ep);
+        }
+        return true;
+    default:
+        return false;
     }
-    return blen;
 }
 
 uint16_t get_frame (void) {
     return _FLD2VAL(USB_OTG_DSTS_FNSOF, OTGD->DSTS);
 }
 
+/**\brief Helper. Services endpoint interrupts by the DAINT bitmap
+ * \details All pending endpoints are serviced in one pass, so the event cost doesn't depend on the
+ * endpoint index and busy low endpoints don't starve the others.
+ * \return number of the events passed to the core
+ */
+static uint32_t ep_evt_poll(usbd_device *dev, usbd_evt_callback callback) {
+    uint32_t _d = OTGD->DAINT & OTGD->DAINTMSK;
+    uint32_t cnt = 0;
+    /* OUT endpoints. data is reported by RXFLVL. transfer is rearmed for the next packet */
+    for (uint32_t _o = _d >> 16; _o; _o &= _o - 1) {
+        uint8_t ep = __builtin_ctz(_o);
+        USB_OTG_OUTEndpointTypeDef* epo = EPOUT(ep);
+        _WSE(epo->DOEPINT, USB_OTG_DOEPINT_XFRC | USB_OTG_DOEPINT_STUP);
+        if (ep == 0) {
+            epo->DOEPTSIZ = (1 << 29) | (1 << 19) | (0x40 >> (epo->DOEPCTL & 0x03));
+        } else {
+            epo->DOEPTSIZ = (1 << 19) | (epo->DOEPCTL & USB_OTG_DOEPCTL_MPSIZ);
+        }
+    }
+    /* IN endpoints */
+    for (uint32_t _i = _d & 0xFFFF; _i; _i &= _i - 1) {
+        uint8_t ep = __builtin_ctz(_i);
+        USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
+        /* topping up the IN stream. not passed to the core */
+        if ((OTGD->DIEPEMPMSK & (0x0001UL << ep)) && (epi->DIEPINT & USB_OTG_DIEPINT_TXFE)) {
+            tx_fill(ep);
+        }
+        if (epi->DIEPINT & USB_OTG_DIEPINT_XFRC) {
+            _WSE(epi->DIEPINT, USB_OTG_DIEPINT_XFRC);
+            callback(dev, usbd_evt_eptx, ep | 0x80);
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
 void evt_poll(usbd_device *dev, usbd_evt_callback callback) {
     uint32_t evt;
     uint32_t ep = 0;
+    uint32_t _m = 0xFFFFFFFF;
     while (1) {
-        uint32_t _t = OTG->GINTSTS;
+        uint32_t _t = OTG->GINTSTS & OTG->GINTMSK & _m;
         /* bus RESET event */
         if (_t & USB_OTG_GINTSTS_USBRST) {
-            OTG->GINTSTS = USB_OTG_GINTSTS_USBRST;
+            _WSE(OTG->GINTSTS, USB_OTG_GINTSTS_USBRST);
             for (uint8_t i = 0; i < MAX_EP; i++ ) {
                 ep_deconfig(i);
+                tx_fifo[i] = 0;
             }
             Flush_RX();
+            _BST(OTG->GINTMSK, USB_OTG_GINTMSK_RXFLVLM);
             continue;
         } else if (_t & USB_OTG_GINTSTS_ENUMDNE) {
-            OTG->GINTSTS = USB_OTG_GINTSTS_ENUMDNE;
+            _WSE(OTG->GINTSTS, USB_OTG_GINTSTS_ENUMDNE);
             evt = usbd_evt_reset;
-        } else if (_t & USB_OTG_GINTSTS_IEPINT) {
-            for (;; ep++) {
-                USB_OTG_INEndpointTypeDef* epi = EPIN(ep);
-                if (ep >= MAX_EP) return;
-                if (epi->DIEPINT & USB_OTG_DIEPINT_XFRC) {
-                    epi->DIEPINT = USB_OTG_DIEPINT_XFRC;
-                    evt = usbd_evt_eptx;
-                    ep |= 0x80;
-                    break;
-                }
-            }
+        } else if (_t & (USB_OTG_GINTSTS_IEPINT | USB_OTG_GINTSTS_OEPINT)) {
+            if (ep_evt_poll(dev, callback)) return;
+            /* nothing for the core. endpoint interrupts are serviced once per call */
+            _m &= ~(USB_OTG_GINTSTS_IEPINT | USB_OTG_GINTSTS_OEPINT);
+            continue;
         } else if (_t & USB_OTG_GINTSTS_RXFLVL) {
             _t = OTG->GRXSTSR;
             ep = _t & USB_OTG_GRXSTSP_EPNUM;
             switch (_FLD2VAL(USB_OTG_GRXSTSP_PKTSTS, _t)) {
             case 0x02:
                 evt = usbd_evt_eprx;
+                /* early release of the endpoint. packet is drained to the ring */
+                if (rx_ring[ep] && ep_rxdrain(ep)) return callback(dev, evt, ep);
+#if (RX_STAGE_SZ)
+                /* RX FIFO is released. packet waits for ep_read in the endpoint staging buffer */
+                if (rx_stage_pop(ep, false)) return callback(dev, evt, ep);
+#endif
                 break;
             case 0x06:
                 evt = usbd_evt_epsetup;
+#if (RX_STAGE_SZ)
+                if (rx_stage_pop(ep, true)) return callback(dev, evt, ep);
+#endif
                 break;
             default:
-                OTG->GRXSTSP;
+                _RSE(OTG->GRXSTSP);
                 continue;
             }
+            /* the packet stays in RX FIFO until ep_read. report it once */
+            _BCL(OTG->GINTMSK, USB_OTG_GINTMSK_RXFLVLM);
         } else if (_t & USB_OTG_GINTSTS_SOF) {
-            OTG->GINTSTS = USB_OTG_GINTSTS_SOF;
+            _WSE(OTG->GINTSTS, USB_OTG_GINTSTS_SOF);
             evt = usbd_evt_sof;
         } else if (_t & USB_OTG_GINTSTS_USBSUSP) {
             evt = usbd_evt_susp;
-            OTG->GINTSTS = USB_OTG_GINTSTS_USBSUSP;
+            _WSE(OTG->GINTSTS, USB_OTG_GINTSTS_USBSUSP);
         } else if (_t & USB_OTG_GINTSTS_WKUINT) {
-            OTG->GINTSTS = USB_OTG_GINTSTS_WKUINT;
+            _WSE(OTG->GINTSTS, USB_OTG_GINTSTS_WKUINT);
             evt = usbd_evt_wkup;
         } else {
             /* no more supported events */
@@ -478,7 +1096,8 @@ uint16_t get_serialno_desc(void *buffer) {
 }
 
 const struct usbd_driver usb_stmv2 = {
-    USBD_HW_ADDRFST | USBD_HW_BC,
+    USBD_HW_ADDRFST | USBD_HW_BC | USBD_HW_MULTIPKT | USBD_HW_STREAM |
+    USBD_HW_LAYOUT | USBD_HW_EPREUSE,
     enable,
     reset,
     connect,
@@ -487,6 +1106,15 @@ const struct usbd_driver usb_stmv2 = {
     ep_deconfig,
     ep_read,
     ep_write,
+    ep_readv,
+    ep_writev,
+    ep_write_begin,
+    ep_write_commit,
+    ep_forward,
+    ep_txfree,
+    ep_setring,
+    ep_stream,
+    ep_layout,
     ep_setstall,
     ep_isstalled,
     evt_poll,
@@ -0,0 +1,316 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "stm32.h"
+#include "../usb.h"
+
+#if defined(USBD_EMU) && (defined(USE_STMV0_DRIVER) || defined(USE_STMV1_DRIVER))
+
+#if defined(USE_STMV1_DRIVER)
+    #define PMA_STRIDE  2   /* 16-bit PMA words with 32-bit access stride */
+#else
+    #define PMA_STRIDE  1
+#endif
+
+#define USB_EP_SWBUF_TX     USB_EP_DTOG_RX
+#define USB_EP_SWBUF_RX     USB_EP_DTOG_TX
+
+/* EPR bits toggled by writing 1 */
+#define EPR_TOGGLE  (USB_EP_DTOG_RX | USB_EPRX_STAT | USB_EP_DTOG_TX | USB_EPTX_STAT)
+/* EPR bits written as is */
+#define EPR_RW      (USB_EP_T_FIELD | USB_EP_KIND | USB_EPADDR_FIELD)
+
+/* buffer descriptor record index */
+#define BD_ADDR0    0
+#define BD_COUNT0   1
+#define BD_ADDR1    2
+#define BD_COUNT1   3
+
+USB_TypeDef     usb_emu_regs;
+RCC_TypeDef     usb_emu_rcc;
+uint8_t         usb_emu_pma[0x400] __attribute__((aligned(4)));
+#if defined(USE_STMV1_DRIVER)
+SYSCFG_TypeDef  usb_emu_syscfg;
+#endif
+const uint32_t  usb_emu_uid[6] = {0x55534245, 0x4D553332, 0x46530000, 0, 0, 0x00000001};
+
+static struct usb_sim_stats stats;
+
+/** \brief Helper function. Returns pointer to the 16-bit PMA word.
+ * \param addr local PMA address as seen by the USB peripheral.
+ */
+inline static uint16_t *PMA(uint16_t addr) {
+    return (uint16_t*)&usb_emu_pma[(addr & ~0x01) * PMA_STRIDE];
+}
+
+/** \brief Helper function. Returns pointer to the buffer descriptor record.
+ */
+inline static uint16_t *BD(uint8_t ep, uint8_t rec) {
+    return PMA(USB->BTABLE + (ep & 0x07) * 8 + rec * 2);
+}
+
+inline static volatile uint16_t *EPR(uint8_t ep) {
+    return &USB->EPR[(ep & 0x07) * 2];
+}
+
+static bool hw_enabled(void) {
+    return (RCC->APB1ENR & RCC_APB1ENR_USBEN) && !(RCC->APB1RSTR & RCC_APB1RSTR_USBRST);
+}
+
+static bool hw_connected(void) {
+#if defined(USE_STMV1_DRIVER)
+    return (SYSCFG->PMC & SYSCFG_PMC_USB_PU);
+#else
+    return (USB->BCDR & USB_BCDR_DPPU);
+#endif
+}
+
+/** \brief Helper function. Updates CTR, DIR and EP_ID fields of the ISTR.
+ * \details The lowest endpoint with a pending correct transfer is reported first.
+ */
+static void update_istr(void) {
+    uint16_t istr = USB->ISTR & ~(USB_ISTR_CTR | USB_ISTR_DIR | USB_ISTR_EP_ID);
+    for (int i = 0; i < 8; i++) {
+        uint16_t epr = *EPR(i);
+        if (epr & (USB_EP_CTR_RX | USB_EP_CTR_TX)) {
+            istr |= USB_ISTR_CTR | i;
+            if (epr & USB_EP_CTR_RX) istr |= USB_ISTR_DIR;
+            break;
+        }
+    }
+    USB->ISTR = istr;
+}
+
+void usb_emu_write(volatile void *reg, uint32_t val) {
+    uintptr_t addr = (uintptr_t)reg;
+    stats.reg_writes++;
+    if ((addr >= (uintptr_t)&USB->EPR[0]) && (addr < (uintptr_t)&USB->RESERVED0[0])) {
+        volatile uint16_t *epr = reg;
+        uint16_t old = *epr;
+        /* CTR_x are rc_w0, DTOG_x and STAT_x are t, SETUP is read-only */
+        *epr = (old & val & (USB_EP_CTR_RX | USB_EP_CTR_TX)) |
+               ((old ^ val) & EPR_TOGGLE) |
+               (old & USB_EP_SETUP) |
+               (val & EPR_RW);
+        update_istr();
+    } else if ((addr >= USB_BASE) && (addr < USB_BASE + sizeof(USB_TypeDef))) {
+        *(volatile uint16_t*)reg = val;
+    } else {
+        *(volatile uint32_t*)reg = val;
+    }
+}
+
+uint32_t usb_emu_read(volatile void *reg) {
+    uintptr_t addr = (uintptr_t)reg;
+    if ((addr >= USB_BASE) && (addr < USB_BASE + sizeof(USB_TypeDef))) {
+        return *(volatile uint16_t*)reg;
+    } else {
+        return *(volatile uint32_t*)reg;
+    }
+}
+
+/** \brief Helper function. Returns RX buffer size from the COUNT_RX record.
+ */
+static uint16_t rx_alloc(uint16_t cnt) {
+    uint16_t blocks = (cnt >> 10) & 0x1F;
+    return (cnt & 0x8000) ? (blocks + 1) * 32 : blocks * 2;
+}
+
+/** \brief Helper function. Copies packet to the PMA buffer and updates COUNT_RX.
+ * \return false if the packet doesn't fit the buffer.
+ */
+static bool bus_to_pma(uint8_t ep, uint8_t rec, const uint8_t *buf, uint16_t len) {
+    uint16_t *cnt = BD(ep, rec + 1);
+    uint16_t addr = *BD(ep, rec);
+    if (len > rx_alloc(*cnt)) {
+        USB->ISTR |= USB_ISTR_ERR;
+        return false;
+    }
+    for (int i = 0; i < len; i += 2) {
+        uint16_t _t = buf[i];
+        if (i + 1 < len) _t |= buf[i + 1] << 8;
+        *PMA(addr + i) = _t;
+    }
+    *cnt = (*cnt & ~0x03FF) | len;
+    stats.rx_bytes += len;
+    return true;
+}
+
+/** \brief Helper function. Copies packet from the PMA buffer.
+ * \return packet length
+ */
+static uint16_t pma_to_bus(uint8_t ep, uint8_t rec, uint8_t *buf, uint16_t blen) {
+    uint16_t addr = *BD(ep, rec);
+    uint16_t len = *BD(ep, rec + 1) & 0x03FF;
+    for (int i = 0; (i < len) && (i < blen); i++) {
+        uint16_t _t = *PMA(addr + i);
+        buf[i] = (i & 0x01) ? (_t >> 8) : _t;
+    }
+    stats.tx_bytes += len;
+    return len;
+}
+
+/** \brief Helper function. Checks device is able to answer the token.
+ */
+static bool bus_active(void) {
+    return hw_enabled() && hw_connected() && (USB->DADDR & USB_DADDR_EF);
+}
+
+void usb_sim_reset(void) {
+    if (!hw_enabled() || !hw_connected()) return;
+    for (int i = 0; i < 8; i++) {
+        *EPR(i) = 0;
+    }
+    USB->DADDR = 0;
+    USB->ISTR |= USB_ISTR_RESET;
+    update_istr();
+}
+
+void usb_sim_sof(void) {
+    if (!hw_enabled()) return;
+    USB->FNR = (USB->FNR & ~USB_FNR_FN) | ((USB->FNR + 1) & USB_FNR_FN);
+    USB->ISTR |= USB_ISTR_SOF;
+}
+
+void usb_sim_suspend(bool suspend) {
+    if (!hw_enabled()) return;
+    USB->ISTR |= (suspend) ? USB_ISTR_SUSP : USB_ISTR_WKUP;
+}
+
+int32_t usb_sim_setup(uint8_t ep, const void *req) {
+    volatile uint16_t *reg = EPR(ep);
+    uint16_t epr = *reg;
+    if (!bus_active() || (USB_EP_CONTROL != (epr & USB_EP_T_FIELD)) ||
+        (USB_EP_RX_DIS == (epr & USB_EPRX_STAT))) {
+        stats.stalls++;
+        return usb_sim_stall;
+    }
+    /* SETUP is always ACKed, even if endpoint is stalled or NAKed */
+    if (!bus_to_pma(ep, BD_ADDR1, req, 8)) return usb_sim_nak;
+    epr &= ~(USB_EPRX_STAT | USB_EPTX_STAT);
+    *reg = epr | USB_EP_RX_NAK | USB_EP_TX_NAK | USB_EP_DTOG_RX | USB_EP_DTOG_TX |
+           USB_EP_SETUP | USB_EP_CTR_RX;
+    update_istr();
+    return 8;
+}
+
+int32_t usb_sim_out(uint8_t ep, const void *buf, uint16_t len) {
+    volatile uint16_t *reg = EPR(ep);
+    uint16_t epr = *reg;
+    uint8_t rec = BD_ADDR1;
+    if (!bus_active()) {
+        stats.stalls++;
+        return usb_sim_stall;
+    }
+    switch (epr & USB_EPRX_STAT) {
+    case USB_EP_RX_VALID:
+        break;
+    case USB_EP_RX_NAK:
+        stats.naks++;
+        return usb_sim_nak;
+    default:
+        stats.stalls++;
+        return usb_sim_stall;
+    }
+    switch (epr & (USB_EP_T_FIELD | USB_EP_KIND)) {
+    case (USB_EP_BULK | USB_EP_KIND):
+        /* both buffers are owned by the application */
+        if (!(epr & USB_EP_DTOG_RX) == !(epr & USB_EP_SWBUF_RX)) {
+            stats.naks++;
+            return usb_sim_nak;
+        }
+        /* fall through */
+    case USB_EP_ISOCHRONOUS:
+    case (USB_EP_ISOCHRONOUS | USB_EP_KIND):
+        rec = (epr & USB_EP_DTOG_RX) ? BD_ADDR1 : BD_ADDR0;
+        break;
+    default:
+        /* single-buffered endpoint NAKs until ep_read */
+        epr = (epr & ~USB_EPRX_STAT) | USB_EP_RX_NAK;
+        break;
+    }
+    if (!bus_to_pma(ep, rec, buf, len)) return usb_sim_nak;
+    *reg = ((epr ^ USB_EP_DTOG_RX) & ~USB_EP_SETUP) | USB_EP_CTR_RX;
+    update_istr();
+    return len;
+}
+
+int32_t usb_sim_in(uint8_t ep, void *buf, uint16_t blen) {
+    volatile uint16_t *reg = EPR(ep);
+    uint16_t epr = *reg;
+    uint8_t rec = BD_ADDR0;
+    if (!bus_active()) {
+        stats.stalls++;
+        return usb_sim_stall;
+    }
+    switch (epr & USB_EPTX_STAT) {
+    case USB_EP_TX_VALID:
+        break;
+    case USB_EP_TX_NAK:
+        stats.naks++;
+        return usb_sim_nak;
+    default:
+        stats.stalls++;
+        return usb_sim_stall;
+    }
+    switch (epr & (USB_EP_T_FIELD | USB_EP_KIND)) {
+    case (USB_EP_BULK | USB_EP_KIND):
+        /* no buffers are filled by the application */
+        if (!(epr & USB_EP_DTOG_TX) == !(epr & USB_EP_SWBUF_TX)) {
+            stats.naks++;
+            return usb_sim_nak;
+        }
+        /* fall through */
+    case USB_EP_ISOCHRONOUS:
+    case (USB_EP_ISOCHRONOUS | USB_EP_KIND):
+        rec = (epr & USB_EP_DTOG_TX) ? BD_ADDR1 : BD_ADDR0;
+        break;
+    default:
+        /* single-buffered endpoint NAKs until next ep_write */
+        epr = (epr & ~USB_EPTX_STAT) | USB_EP_TX_NAK;
+        break;
+    }
+    int32_t len = pma_to_bus(ep, rec, buf, blen);
+    *reg = (epr ^ USB_EP_DTOG_TX) | USB_EP_CTR_TX;
+    update_istr();
+    return len;
+}
+
+bool usb_sim_pending(void) {
+    if (!hw_enabled()) return false;
+    return (USB->ISTR & (USB_ISTR_CTR | USB_ISTR_ERR | USB_ISTR_WKUP | USB_ISTR_SUSP |
+                         USB_ISTR_RESET | USB_ISTR_SOF | USB_ISTR_ESOF));
+}
+
+#include "sim_control.inc"
+
+void usb_sim_get_stats(struct usb_sim_stats *st, bool clear) {
+    stats.address = USB->DADDR & ~USB_DADDR_EF;
+    stats.enabled = hw_enabled();
+    stats.connected = hw_connected();
+    *st = stats;
+    if (clear) {
+        stats.rx_bytes = 0;
+        stats.tx_bytes = 0;
+        stats.reg_writes = 0;
+        stats.naks = 0;
+        stats.stalls = 0;
+    }
+}
+
+#endif //USBD_EMU
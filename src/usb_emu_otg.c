@@ -0,0 +1,479 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "stm32.h"
+#include "../usb.h"
+
+#if defined(USBD_EMU) && defined(USE_STMV2_DRIVER)
+
+#define MAX_EP          6
+#define FIFO_RAM_SZ     320     /* shared FIFO RAM size in 32-bit words */
+
+/* RX FIFO packet status */
+#define PKT_OUT_DATA    0x02
+#define PKT_OUT_DONE    0x03
+#define PKT_SETUP_DONE  0x04
+#define PKT_SETUP_DATA  0x06
+
+/* write-only and self-clearing control bits */
+#define CTL_WO      (USB_OTG_DIEPCTL_CNAK | USB_OTG_DIEPCTL_SNAK | USB_OTG_DIEPCTL_SD0PID_SEVNFRM | \
+                     USB_OTG_DIEPCTL_SODDFRM | USB_OTG_DIEPCTL_EPDIS)
+
+#define GINT_CHANGED    (USB_OTG_GINTSTS_RXFLVL | USB_OTG_GINTSTS_IEPINT | USB_OTG_GINTSTS_OEPINT)
+#define GINT_EVENTS     (USB_OTG_GINTSTS_USBRST | USB_OTG_GINTSTS_ENUMDNE | USB_OTG_GINTSTS_SOF | \
+                         USB_OTG_GINTSTS_USBSUSP | USB_OTG_GINTSTS_WKUINT | GINT_CHANGED)
+
+#define OFS(reg)    ((uintptr_t)&(reg) - USB_OTG_FS_PERIPH_BASE)
+
+typedef struct {
+    uint16_t    start;      /* FIFO start address in words */
+    uint16_t    depth;      /* FIFO depth in words */
+    uint16_t    head;       /* read position */
+    uint16_t    used;       /* words in FIFO */
+} emu_fifo;
+
+uint32_t        usb_emu_otg[0x2000] __attribute__((aligned(4)));
+RCC_TypeDef     usb_emu_rcc;
+PWR_TypeDef     usb_emu_pwr;
+const uint32_t  usb_emu_uid[6] = {0x55534245, 0x4D553332, 0x4F544700, 0, 0, 0x00000002};
+
+static struct {
+    uint32_t    ram[FIFO_RAM_SZ];
+    emu_fifo    rx;
+    emu_fifo    tx[MAX_EP];
+    struct usb_sim_stats stats;
+} emu;
+
+#define OTG     ((USB_OTG_GlobalTypeDef*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_GLOBAL_BASE))
+#define OTGD    ((USB_OTG_DeviceTypeDef*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_DEVICE_BASE))
+
+inline static USB_OTG_INEndpointTypeDef* EPIN(uint8_t ep) {
+    return (void*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_IN_ENDPOINT_BASE + (ep << 5));
+}
+
+inline static USB_OTG_OUTEndpointTypeDef* EPOUT(uint8_t ep) {
+    return (void*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_OUT_ENDPOINT_BASE + (ep << 5));
+}
+
+/** \brief Helper function. Pushes word to the FIFO.
+ */
+static void fifo_push(emu_fifo *f, uint32_t data) {
+    if (f->used >= f->depth) {
+        emu.stats.fifo_errors++;
+        return;
+    }
+    unsigned pos = f->start + (f->head + f->used) % f->depth;
+    if (pos >= FIFO_RAM_SZ) {
+        emu.stats.fifo_errors++;
+        return;
+    }
+    emu.ram[pos] = data;
+    f->used++;
+}
+
+/** \brief Helper function. Pops word from the FIFO.
+ */
+static uint32_t fifo_pop(emu_fifo *f) {
+    unsigned pos = f->start + f->head;
+    if ((f->used == 0) || (pos >= FIFO_RAM_SZ)) {
+        emu.stats.fifo_errors++;
+        return 0;
+    }
+    f->head = (f->head + 1) % f->depth;
+    f->used--;
+    return emu.ram[pos];
+}
+
+inline static void fifo_flush(emu_fifo *f) {
+    f->head = 0;
+    f->used = 0;
+}
+
+inline static uint16_t fifo_free(emu_fifo *f) {
+    return f->depth - f->used;
+}
+
+/** \brief Helper function. Reprograms FIFO if the size register was changed.
+ * \return true if FIFO layout was changed.
+ */
+static bool fifo_setup(emu_fifo *f, uint16_t start, uint16_t depth) {
+    if ((f->start == start) && (f->depth == depth)) return false;
+    f->start = start;
+    f->depth = depth;
+    fifo_flush(f);
+    return true;
+}
+
+/** \brief Helper function. Checks all FIFOs placed in the FIFO RAM for overlapping.
+ * \note FIFOs outside the FIFO RAM are reported on the first access only.
+ */
+static void fifo_check(void) {
+    emu_fifo *f[MAX_EP + 1];
+    f[0] = &emu.rx;
+    for (int i = 0; i < MAX_EP; i++) f[i + 1] = &emu.tx[i];
+    for (int i = 0; i <= MAX_EP; i++) {
+        if ((f[i]->depth == 0) || (f[i]->start + f[i]->depth > FIFO_RAM_SZ)) continue;
+        for (int j = i + 1; j <= MAX_EP; j++) {
+            if ((f[j]->depth == 0) || (f[j]->start + f[j]->depth > FIFO_RAM_SZ)) continue;
+            if ((f[i]->start < f[j]->start + f[j]->depth) &&
+                (f[j]->start < f[i]->start + f[i]->depth)) {
+                emu.stats.fifo_errors++;
+            }
+        }
+    }
+}
+
+/** \brief Helper function. Updates RX FIFO status and the endpoint interrupt summary.
+ */
+static void update_int(void) {
+    uint32_t gint = OTG->GINTSTS & ~GINT_CHANGED;
+    uint32_t daint = 0;
+    if (emu.rx.used) {
+        gint |= USB_OTG_GINTSTS_RXFLVL;
+        OTG->GRXSTSR = emu.ram[emu.rx.start + emu.rx.head];
+    } else {
+        OTG->GRXSTSR = 0;
+    }
+    for (int i = 0; i < MAX_EP; i++) {
+        USB_OTG_INEndpointTypeDef *epi = EPIN(i);
+        uint32_t msk = OTGD->DIEPMSK;
+        /* TX FIFO empty level is completely empty or half empty */
+        uint16_t lvl = (OTG->GAHBCFG & USB_OTG_GAHBCFG_TXFELVL) ? 0 : (emu.tx[i].depth >> 1);
+        if (emu.tx[i].used > lvl) {
+            epi->DIEPINT &= ~USB_OTG_DIEPINT_TXFE;
+        } else {
+            epi->DIEPINT |= USB_OTG_DIEPINT_TXFE;
+        }
+        epi->DTXFSTS = fifo_free(&emu.tx[i]);
+        if (OTGD->DIEPEMPMSK & (1 << i)) msk |= USB_OTG_DIEPINT_TXFE;
+        if (epi->DIEPINT & msk) daint |= (0x0001 << i);
+        if (EPOUT(i)->DOEPINT & OTGD->DOEPMSK) daint |= (0x10000 << i);
+    }
+    OTGD->DAINT = daint;
+    daint &= OTGD->DAINTMSK;
+    if (daint & 0x0000FFFF) gint |= USB_OTG_GINTSTS_IEPINT;
+    if (daint & 0xFFFF0000) gint |= USB_OTG_GINTSTS_OEPINT;
+    OTG->GINTSTS = gint;
+}
+
+/** \brief Helper function. Applies the write-only endpoint control bits.
+ */
+static void sync_ctl(volatile uint32_t *ctl, volatile uint32_t *intr) {
+    uint32_t _t = *ctl;
+    if (_t & USB_OTG_DIEPCTL_SNAK) _t |= USB_OTG_DIEPCTL_NAKSTS;
+    if (_t & USB_OTG_DIEPCTL_CNAK) _t &= ~USB_OTG_DIEPCTL_NAKSTS;
+    if (_t & USB_OTG_DIEPCTL_EPDIS) {
+        _t &= ~USB_OTG_DIEPCTL_EPENA;
+        *intr |= USB_OTG_DIEPINT_EPDISD;
+    }
+    _t &= ~CTL_WO;
+    *ctl = _t;
+}
+
+/** \brief Helper function. Applies the register writes that don't pass through the hooks.
+ * \details Register writes are plain memory writes for the model. Self-clearing core reset
+ * and FIFO flush requests, FIFO size registers and endpoint NAK and disable requests are
+ * processed here, before any access with side effects and before any bus transaction.
+ */
+static void sync(void) {
+    uint32_t rst = OTG->GRSTCTL;
+    bool changed = false;
+    if (rst & USB_OTG_GRSTCTL_CSRST) {
+        fifo_flush(&emu.rx);
+        for (int i = 0; i < MAX_EP; i++) fifo_flush(&emu.tx[i]);
+    }
+    if (rst & USB_OTG_GRSTCTL_RXFFLSH) {
+        fifo_flush(&emu.rx);
+    }
+    if (rst & USB_OTG_GRSTCTL_TXFFLSH) {
+        unsigned n = _FLD2VAL(USB_OTG_GRSTCTL_TXFNUM, rst);
+        for (unsigned i = 0; i < MAX_EP; i++) {
+            if ((n == 0x10) || (n == i)) fifo_flush(&emu.tx[i]);
+        }
+    }
+    OTG->GRSTCTL = (rst & ~(USB_OTG_GRSTCTL_CSRST | USB_OTG_GRSTCTL_RXFFLSH |
+                            USB_OTG_GRSTCTL_TXFFLSH)) | USB_OTG_GRSTCTL_AHBIDL;
+
+    changed |= fifo_setup(&emu.rx, 0, OTG->GRXFSIZ & 0xFFFF);
+    changed |= fifo_setup(&emu.tx[0], OTG->GNPTXFSIZ & 0xFFFF, OTG->GNPTXFSIZ >> 16);
+    for (int i = 1; i < MAX_EP; i++) {
+        changed |= fifo_setup(&emu.tx[i], OTG->DIEPTXF[i - 1] & 0xFFFF, OTG->DIEPTXF[i - 1] >> 16);
+    }
+    if (changed) fifo_check();
+
+    for (int i = 0; i < MAX_EP; i++) {
+        sync_ctl(&EPIN(i)->DIEPCTL, &EPIN(i)->DIEPINT);
+        sync_ctl(&EPOUT(i)->DOEPCTL, &EPOUT(i)->DOEPINT);
+    }
+    /* EP0 is always active */
+    _BST(EPIN(0)->DIEPCTL, USB_OTG_DIEPCTL_USBAEP);
+    _BST(EPOUT(0)->DOEPCTL, USB_OTG_DOEPCTL_USBAEP);
+    update_int();
+}
+
+/** \brief Helper function. Returns maximum packet size from the endpoint control register.
+ */
+static uint16_t ep_mps(uint8_t ep, uint32_t ctl) {
+    if (ep == 0) {
+        return 0x40 >> (ctl & 0x03);
+    }
+    return ctl & USB_OTG_DIEPCTL_MPSIZ;
+}
+
+void usb_emu_write(volatile void *reg, uint32_t val) {
+    uintptr_t ofs = (uintptr_t)reg - USB_OTG_FS_PERIPH_BASE;
+    sync();
+    emu.stats.reg_writes++;
+    if (ofs >= USB_OTG_FIFO_BASE) {
+        uint8_t ep = (ofs - USB_OTG_FIFO_BASE) / USB_OTG_FIFO_SIZE;
+        emu.stats.fifo_words++;
+        if (ep < MAX_EP) {
+            fifo_push(&emu.tx[ep], val);
+        } else {
+            emu.stats.fifo_errors++;
+        }
+    } else if ((ofs == OFS(OTG->GINTSTS)) ||
+               ((ofs >= USB_OTG_IN_ENDPOINT_BASE) && (ofs < USB_OTG_PCGCCTL_BASE) &&
+                ((ofs & (USB_OTG_EP_REG_SIZE - 1)) == 0x08))) {
+        /* GINTSTS, DIEPINTx and DOEPINTx are rc_w1 */
+        *(volatile uint32_t*)reg &= ~val;
+    } else {
+        *(volatile uint32_t*)reg = val;
+    }
+    update_int();
+}
+
+uint32_t usb_emu_read(volatile void *reg) {
+    uintptr_t ofs = (uintptr_t)reg - USB_OTG_FS_PERIPH_BASE;
+    uint32_t _t;
+    sync();
+    if (ofs >= USB_OTG_FIFO_BASE) {
+        /* all FIFO windows are reading the shared RX FIFO */
+        emu.stats.fifo_words++;
+        _t = fifo_pop(&emu.rx);
+    } else if (ofs == OFS(OTG->GRXSTSP)) {
+        emu.stats.fifo_words++;
+        _t = fifo_pop(&emu.rx);
+        uint8_t ep = _t & USB_OTG_GRXSTSP_EPNUM;
+        if (ep < MAX_EP) {
+            switch (_FLD2VAL(USB_OTG_GRXSTSP_PKTSTS, _t)) {
+            case PKT_OUT_DONE:
+                EPOUT(ep)->DOEPINT |= USB_OTG_DOEPINT_XFRC;
+                break;
+            case PKT_SETUP_DONE:
+                EPOUT(ep)->DOEPINT |= USB_OTG_DOEPINT_STUP;
+                break;
+            default:
+                break;
+            }
+        }
+    } else {
+        _t = *(volatile uint32_t*)reg;
+    }
+    update_int();
+    return _t;
+}
+
+static bool hw_enabled(void) {
+    return (RCC->AHB2ENR & RCC_AHB2ENR_OTGFSEN);
+}
+
+static bool hw_connected(void) {
+    return hw_enabled() && !(OTGD->DCTL & USB_OTG_DCTL_SDIS);
+}
+
+/** \brief Helper function. Pushes received packet with its status to the RX FIFO.
+ * \return false if RX FIFO has not enough space.
+ */
+static bool rx_push(uint8_t ep, uint8_t pktsts, const uint8_t *buf, uint16_t len, bool done) {
+    uint16_t words = 1 + ((len + 3) >> 2) + (done ? 1 : 0);
+    if (words > fifo_free(&emu.rx)) return false;
+    fifo_push(&emu.rx, ep | _VAL2FLD(USB_OTG_GRXSTSP_BCNT, len) |
+                       _VAL2FLD(USB_OTG_GRXSTSP_PKTSTS, pktsts));
+    for (int i = 0; i < len; i += 4) {
+        uint32_t _t = 0;
+        for (int j = 3; j >= 0; j--) {
+            _t <<= 8;
+            if (i + j < len) _t |= buf[i + j];
+        }
+        fifo_push(&emu.rx, _t);
+    }
+    if (done) {
+        fifo_push(&emu.rx, ep | _VAL2FLD(USB_OTG_GRXSTSP_PKTSTS,
+                  (pktsts == PKT_SETUP_DATA) ? PKT_SETUP_DONE : PKT_OUT_DONE));
+    }
+    emu.stats.rx_bytes += len;
+    return true;
+}
+
+void usb_sim_reset(void) {
+    sync();
+    if (!hw_connected()) return;
+    for (int i = 0; i < MAX_EP; i++) {
+        _BCL(EPIN(i)->DIEPCTL, USB_OTG_DIEPCTL_EPENA | USB_OTG_DIEPCTL_STALL);
+        _BCL(EPOUT(i)->DOEPCTL, USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_STALL);
+    }
+    _BCL(OTGD->DCFG, USB_OTG_DCFG_DAD);
+    _BMD(OTGD->DSTS, USB_OTG_DSTS_ENUMSPD, _VAL2FLD(USB_OTG_DSTS_ENUMSPD, 0x03));
+    _BST(OTG->GINTSTS, USB_OTG_GINTSTS_USBRST | USB_OTG_GINTSTS_ENUMDNE);
+    update_int();
+}
+
+void usb_sim_sof(void) {
+    sync();
+    if (!hw_enabled()) return;
+    uint32_t fn = _FLD2VAL(USB_OTG_DSTS_FNSOF, OTGD->DSTS) + 1;
+    _BMD(OTGD->DSTS, USB_OTG_DSTS_FNSOF, _VAL2FLD(USB_OTG_DSTS_FNSOF, fn));
+    _BST(OTG->GINTSTS, USB_OTG_GINTSTS_SOF);
+}
+
+void usb_sim_suspend(bool suspend) {
+    sync();
+    if (!hw_enabled()) return;
+    _BST(OTG->GINTSTS, (suspend) ? USB_OTG_GINTSTS_USBSUSP : USB_OTG_GINTSTS_WKUINT);
+}
+
+int32_t usb_sim_setup(uint8_t ep, const void *req) {
+    ep &= 0x0F;
+    USB_OTG_OUTEndpointTypeDef *epo = EPOUT(ep);
+    USB_OTG_INEndpointTypeDef *epi = EPIN(ep);
+    sync();
+    if (!hw_connected() || (ep != 0)) {
+        emu.stats.stalls++;
+        return usb_sim_stall;
+    }
+    if (!rx_push(0, PKT_SETUP_DATA, req, 8, true)) {
+        emu.stats.naks++;
+        return usb_sim_nak;
+    }
+    /* SETUP clears STALL and sets NAK on both directions of EP0 */
+    epo->DOEPCTL = (epo->DOEPCTL & ~USB_OTG_DOEPCTL_STALL) | USB_OTG_DOEPCTL_NAKSTS;
+    epi->DIEPCTL = (epi->DIEPCTL & ~USB_OTG_DIEPCTL_STALL) | USB_OTG_DIEPCTL_NAKSTS;
+    update_int();
+    return 8;
+}
+
+int32_t usb_sim_out(uint8_t ep, const void *buf, uint16_t len) {
+    ep &= 0x0F;
+    USB_OTG_OUTEndpointTypeDef *epo = EPOUT(ep);
+    sync();
+    if (!hw_connected() || (ep >= MAX_EP)) {
+        emu.stats.stalls++;
+        return usb_sim_stall;
+    }
+    uint32_t ctl = epo->DOEPCTL;
+    if (((ep != 0) && !(ctl & USB_OTG_DOEPCTL_USBAEP)) || (ctl & USB_OTG_DOEPCTL_STALL)) {
+        emu.stats.stalls++;
+        return usb_sim_stall;
+    }
+    if (!(ctl & USB_OTG_DOEPCTL_EPENA) || (ctl & USB_OTG_DOEPCTL_NAKSTS)) {
+        emu.stats.naks++;
+        return usb_sim_nak;
+    }
+    uint32_t siz = epo->DOEPTSIZ;
+    uint32_t xfr = _FLD2VAL(USB_OTG_DOEPTSIZ_XFRSIZ, siz);
+    uint32_t pkt = _FLD2VAL(USB_OTG_DOEPTSIZ_PKTCNT, siz);
+    if (pkt) pkt--;
+    xfr = (len > xfr) ? 0 : xfr - len;
+    /* transfer completes on the last packet or on a short packet */
+    bool done = (pkt == 0) || (len < ep_mps(ep, ctl));
+    if (!rx_push(ep, PKT_OUT_DATA, buf, len, done)) {
+        emu.stats.naks++;
+        return usb_sim_nak;
+    }
+    epo->DOEPTSIZ = (siz & ~(USB_OTG_DOEPTSIZ_XFRSIZ | USB_OTG_DOEPTSIZ_PKTCNT)) |
+                    _VAL2FLD(USB_OTG_DOEPTSIZ_XFRSIZ, xfr) |
+                    _VAL2FLD(USB_OTG_DOEPTSIZ_PKTCNT, pkt);
+    if (done) {
+        /* endpoint NAKs until it will be reenabled */
+        epo->DOEPCTL = (ctl & ~USB_OTG_DOEPCTL_EPENA) | USB_OTG_DOEPCTL_NAKSTS;
+    }
+    update_int();
+    return len;
+}
+
+int32_t usb_sim_in(uint8_t ep, void *buf, uint16_t blen) {
+    ep &= 0x0F;
+    USB_OTG_INEndpointTypeDef *epi = EPIN(ep);
+    sync();
+    if (!hw_connected() || (ep >= MAX_EP)) {
+        emu.stats.stalls++;
+        return usb_sim_stall;
+    }
+    uint32_t ctl = epi->DIEPCTL;
+    if (((ep != 0) && !(ctl & USB_OTG_DIEPCTL_USBAEP)) || (ctl & USB_OTG_DIEPCTL_STALL)) {
+        emu.stats.stalls++;
+        return usb_sim_stall;
+    }
+    uint32_t siz = epi->DIEPTSIZ;
+    uint32_t xfr = _FLD2VAL(USB_OTG_DIEPTSIZ_XFRSIZ, siz);
+    uint32_t pkt = _FLD2VAL(USB_OTG_DIEPTSIZ_PKTCNT, siz);
+    uint16_t len = ep_mps(ep, ctl);
+    if (len > xfr) len = xfr;
+    /* not enabled, NAKed or not enough data in TX FIFO */
+    if (!(ctl & USB_OTG_DIEPCTL_EPENA) || (ctl & USB_OTG_DIEPCTL_NAKSTS) ||
+        (pkt == 0) || (emu.tx[ep].used < ((len + 3) >> 2))) {
+        emu.stats.naks++;
+        return usb_sim_nak;
+    }
+    uint8_t *_buf = buf;
+    for (int i = 0; i < len; i += 4) {
+        uint32_t _t = fifo_pop(&emu.tx[ep]);
+        for (int j = 0; (j < 4) && (i + j < len); j++, _t >>= 8) {
+            if (i + j < blen) _buf[i + j] = _t & 0xFF;
+        }
+    }
+    pkt--;
+    xfr -= len;
+    epi->DIEPTSIZ = (siz & ~(USB_OTG_DIEPTSIZ_XFRSIZ | USB_OTG_DIEPTSIZ_PKTCNT)) |
+                    _VAL2FLD(USB_OTG_DIEPTSIZ_XFRSIZ, xfr) |
+                    _VAL2FLD(USB_OTG_DIEPTSIZ_PKTCNT, pkt);
+    if (pkt == 0) {
+        epi->DIEPCTL = ctl & ~USB_OTG_DIEPCTL_EPENA;
+        epi->DIEPINT |= USB_OTG_DIEPINT_XFRC;
+    }
+    emu.stats.tx_bytes += len;
+    update_int();
+    return len;
+}
+
+bool usb_sim_pending(void) {
+    sync();
+    if (!hw_enabled()) return false;
+    return (OTG->GINTSTS & OTG->GINTMSK & GINT_EVENTS) ? true : false;
+}
+
+#include "sim_control.inc"
+
+void usb_sim_get_stats(struct usb_sim_stats *stats, bool clear) {
+    emu.stats.address = _FLD2VAL(USB_OTG_DCFG_DAD, OTGD->DCFG);
+    emu.stats.enabled = hw_enabled();
+    emu.stats.connected = hw_connected();
+    *stats = emu.stats;
+    if (clear) {
+        emu.stats.rx_bytes = 0;
+        emu.stats.tx_bytes = 0;
+        emu.stats.reg_writes = 0;
+        emu.stats.fifo_words = 0;
+        emu.stats.fifo_errors = 0;
+        emu.stats.naks = 0;
+        emu.stats.stalls = 0;
+    }
+}
+
+#endif //USBD_EMU
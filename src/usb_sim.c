@@ -0,0 +1,559 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../usb.h"
+
+#if defined(USE_SIM_DRIVER)
+
+#define MAX_EP          8
+#ifndef USB_SIM_BUFSZ
+    #define USB_SIM_BUFSZ   0x40    /* endpoint buffer size in bytes */
+#endif
+
+/* endpoint direction state */
+#define SIM_DIS         0x00
+#define SIM_ACTIVE      0x01
+#define SIM_STALL       0x02
+
+/* pending bus events */
+#define SIM_EVT_RESET   (1 << 0)
+#define SIM_EVT_SOF     (1 << 1)
+#define SIM_EVT_WKUP    (1 << 2)
+#define SIM_EVT_SUSP    (1 << 3)
+
+#define STAT(call)      sim.stats.calls[usb_sim_call_##call]++
+
+typedef struct {
+    uint16_t    len;
+    uint8_t     data[USB_SIM_BUFSZ];
+} sim_buf;
+
+typedef struct {
+    uint8_t     state;
+    uint8_t     nbuf;       /* 1 for single-buffered or 2 for double-buffered endpoint */
+    uint8_t     count;      /* number of the filled buffers */
+    uint8_t     head;
+    sim_buf     buf[2];
+} sim_pipe;
+
+typedef struct {
+    uint8_t     eptype;
+    uint16_t    epsize;
+    bool        setup;      /* the first RX buffer contains a SETUP packet */
+    bool        ctr_rx;     /* RX completion pending */
+    bool        ctr_tx;     /* TX completion pending */
+    usbd_rxring *ring;      /* receive ring of the OUT endpoint */
+    sim_pipe    rx;
+    sim_pipe    tx;
+} sim_ep;
+
+static struct {
+    sim_ep      ep[MAX_EP];
+    uint8_t     events;
+    uint16_t    frame;
+    struct usb_sim_stats stats;
+} sim;
+
+static const uint32_t sim_uid[3] = {0x55534253, 0x494D5354, 0x4D333200};
+
+inline static sim_ep *EPS(uint8_t ep) {
+    return &sim.ep[ep & 0x07];
+}
+
+inline static sim_pipe *PIPE(uint8_t ep) {
+    return (ep & 0x80) ? &EPS(ep)->tx : &EPS(ep)->rx;
+}
+
+/** \brief Helper function. Puts data to the pipe.
+ * \return number of bytes stored, -1 if pipe is full.
+ */
+static int32_t pipe_push(sim_pipe *p, const void *buf, uint16_t len) {
+    if (p->count >= p->nbuf) return -1;
+    sim_buf *b = &p->buf[(p->head + p->count) % p->nbuf];
+    if (len > USB_SIM_BUFSZ) len = USB_SIM_BUFSZ;
+    if (len) memcpy(b->data, buf, len);
+    b->len = len;
+    p->count++;
+    return len;
+}
+
+/** \brief Helper function. Gets data from the pipe.
+ * \return number of bytes copied, -1 if pipe is empty.
+ */
+static int32_t pipe_pop(sim_pipe *p, void *buf, uint16_t blen) {
+    if (p->count == 0) return -1;
+    sim_buf *b = &p->buf[p->head];
+    if (blen > b->len) blen = b->len;
+    if (blen) memcpy(buf, b->data, blen);
+    p->head = (p->head + 1) % p->nbuf;
+    p->count--;
+    return blen;
+}
+
+inline static void pipe_flush(sim_pipe *p) {
+    p->count = 0;
+    p->head = 0;
+}
+
+void ep_setstall(uint8_t ep, bool stall) {
+    sim_pipe *p = PIPE(ep);
+    STAT(ep_setstall);
+    /* ISOCHRONOUS endpoint can't be stalled or unstalled */
+    if (EPS(ep)->eptype == USB_EPTYPE_ISOCHRONUS) return;
+    /* DISABLED endpoint can't be stalled or unstalled */
+    if (p->state == SIM_DIS) return;
+    if (stall) {
+        p->state = SIM_STALL;
+    } else {
+        p->state = SIM_ACTIVE;
+        pipe_flush(p);
+    }
+}
+
+bool ep_isstalled(uint8_t ep) {
+    STAT(ep_isstalled);
+    return (PIPE(ep)->state == SIM_STALL);
+}
+
+void enable(bool enable) {
+    STAT(enable);
+    memset(sim.ep, 0, sizeof(sim.ep));
+    sim.events = 0;
+    sim.stats.enabled = enable;
+    sim.stats.connected = false;
+    sim.stats.address = 0;
+}
+
+void reset (void) {
+    STAT(reset);
+    sim.events |= SIM_EVT_RESET;
+}
+
+uint8_t connect(bool connect) {
+    STAT(connect);
+    sim.stats.connected = connect;
+    return (connect) ? usbd_lane_sdp : usbd_lane_dsc;
+}
+
+void setaddr (uint8_t addr) {
+    STAT(setaddr);
+    sim.stats.address = addr;
+}
+
+bool ep_config(uint8_t ep, uint8_t eptype, uint16_t epsize) {
+    sim_ep *eps = EPS(ep);
+    uint8_t nbuf = 1;
+    STAT(ep_config);
+    if (epsize > USB_SIM_BUFSZ) return false;
+    if ((eptype == USB_EPTYPE_ISOCHRONUS) ||
+        (eptype == (USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF))) {
+        nbuf = 2;
+    }
+    eps->eptype = eptype;
+    eps->epsize = epsize;
+    /* if it TX or CONTROL endpoint */
+    if ((ep & 0x80) || (eptype == USB_EPTYPE_CONTROL)) {
+        memset(&eps->tx, 0, sizeof(sim_pipe));
+        eps->tx.state = SIM_ACTIVE;
+        eps->tx.nbuf = nbuf;
+        eps->ctr_tx = false;
+    }
+    if (!(ep & 0x80)) {
+        memset(&eps->rx, 0, sizeof(sim_pipe));
+        eps->rx.state = SIM_ACTIVE;
+        eps->rx.nbuf = nbuf;
+        eps->ctr_rx = false;
+        eps->setup = false;
+    }
+    return true;
+}
+
+void ep_deconfig(uint8_t ep) {
+    STAT(ep_deconfig);
+    memset(EPS(ep), 0, sizeof(sim_ep));
+}
+
+int32_t ep_read(uint8_t ep, void *buf, uint16_t blen) {
+    sim_ep *eps = EPS(ep);
+    int32_t res;
+    STAT(ep_read);
+    if (eps->rx.state != SIM_ACTIVE) return -1;
+    res = pipe_pop(&eps->rx, buf, blen);
+    if (res >= 0) {
+        eps->setup = false;
+        sim.stats.rx_bytes += res;
+    }
+    return res;
+}
+
+int32_t ep_write(uint8_t ep, void *buf, uint16_t blen) {
+    sim_ep *eps = EPS(ep);
+    int32_t res;
+    STAT(ep_write);
+    if (eps->tx.state != SIM_ACTIVE) return -1;
+    if (blen > eps->epsize) return -1;
+    res = pipe_push(&eps->tx, buf, blen);
+    if (res >= 0) {
+        sim.stats.tx_bytes += res;
+    }
+    return res;
+}
+
+int32_t ep_readv(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    sim_ep *eps = EPS(ep);
+    uint8_t buf[USB_SIM_BUFSZ];
+    int32_t res;
+    STAT(ep_readv);
+    if (eps->rx.state != SIM_ACTIVE) return -1;
+    res = pipe_pop(&eps->rx, buf, sizeof(buf));
+    if (res < 0) return res;
+    eps->setup = false;
+    /* scattering packet over the fragments */
+    uint16_t cnt = 0;
+    for (; iovcnt && (cnt < res); iovcnt--, iov++) {
+        uint16_t len = (iov->len < (res - cnt)) ? iov->len : (res - cnt);
+        if (len) memcpy(iov->buf, &buf[cnt], len);
+        cnt += len;
+    }
+    sim.stats.rx_bytes += cnt;
+    return cnt;
+}
+
+int32_t ep_writev(uint8_t ep, const usbd_iovec *iov, uint8_t iovcnt) {
+    sim_ep *eps = EPS(ep);
+    uint8_t buf[USB_SIM_BUFSZ];
+    uint16_t blen = 0;
+    int32_t res;
+    STAT(ep_writev);
+    if (eps->tx.state != SIM_ACTIVE) return -1;
+    /* gathering fragments to the single packet */
+    for (; iovcnt; iovcnt--, iov++) {
+        if ((blen + iov->len) > eps->epsize) return -1;
+        if (iov->len) memcpy(&buf[blen], iov->buf, iov->len);
+        blen += iov->len;
+    }
+    res = pipe_push(&eps->tx, buf, blen);
+    if (res >= 0) {
+        sim.stats.tx_bytes += res;
+    }
+    return res;
+}
+
+int32_t ep_write_begin(uint8_t ep, usbd_epbuf *epbuf) {
+    sim_ep *eps = EPS(ep);
+    sim_pipe *p = &eps->tx;
+    STAT(ep_write_begin);
+    if (p->state != SIM_ACTIVE) return -1;
+    if (p->count >= p->nbuf) return -1;
+    /* leasing the next free pipe buffer */
+    epbuf->buf = p->buf[(p->head + p->count) % p->nbuf].data;
+    epbuf->size = eps->epsize;
+    epbuf->shift = 0;
+    return eps->epsize;
+}
+
+int32_t ep_write_commit(uint8_t ep, uint16_t len) {
+    sim_ep *eps = EPS(ep);
+    sim_pipe *p = &eps->tx;
+    STAT(ep_write_commit);
+    if (p->state != SIM_ACTIVE) return -1;
+    if (p->count >= p->nbuf) return -1;
+    if (len > eps->epsize) return -1;
+    p->buf[(p->head + p->count) % p->nbuf].len = len;
+    p->count++;
+    sim.stats.tx_bytes += len;
+    return len;
+}
+
+int32_t ep_forward(uint8_t ep_out, uint8_t ep_in) {
+    sim_ep *epo = EPS(ep_out);
+    sim_ep *epi = EPS(ep_in);
+    uint8_t buf[USB_SIM_BUFSZ];
+    int32_t res;
+    STAT(ep_forward);
+    if ((epo->rx.state != SIM_ACTIVE) || (epi->tx.state != SIM_ACTIVE)) return -1;
+    /* packet stays in OUT pipe until IN pipe is ready */
+    if ((epo->rx.count == 0) || (epi->tx.count >= epi->tx.nbuf)) return -1;
+    if (epo->rx.buf[epo->rx.head].len > epi->epsize) return -1;
+    res = pipe_pop(&epo->rx, buf, sizeof(buf));
+    epo->setup = false;
+    res = pipe_push(&epi->tx, buf, res);
+    sim.stats.rx_bytes += res;
+    sim.stats.tx_bytes += res;
+    return res;
+}
+
+int32_t ep_txfree(uint8_t ep) {
+    sim_pipe *p = &EPS(ep)->tx;
+    STAT(ep_txfree);
+    if (p->state != SIM_ACTIVE) return 0;
+    return p->nbuf - p->count;
+}
+
+uint16_t get_frame (void) {
+    STAT(frame_no);
+    return sim.frame;
+}
+
+/** \brief Helper function. Drains received packets to the endpoint ring.
+ */
+static void ep_rxdrain(sim_ep *eps) {
+    usbd_rxring *ring = eps->ring;
+    usbd_iovec iov[2];
+    uint8_t buf[USB_SIM_BUFSZ];
+    int32_t res;
+    while (eps->rx.count) {
+        /* packet is held by the pipe until the ring has enough space */
+        if (eps->rx.buf[eps->rx.head].len > usbd_rxring_space(ring, iov)) {
+            ring->full = 1;
+            return;
+        }
+        res = pipe_pop(&eps->rx, buf, sizeof(buf));
+        if (res > iov[0].len) {
+            memcpy(iov[0].buf, buf, iov[0].len);
+            memcpy(iov[1].buf, &buf[iov[0].len], res - iov[0].len);
+        } else if (res) {
+            memcpy(iov[0].buf, buf, res);
+        }
+        ring->head += res;
+        ring->full = 0;
+        sim.stats.rx_bytes += res;
+    }
+}
+
+bool ep_setring(uint8_t ep, usbd_rxring *ring) {
+    sim_ep *eps = EPS(ep);
+    STAT(ep_setring);
+    if (ring == 0) {
+        eps->ring = 0;
+        return true;
+    }
+    if (eps->rx.state == SIM_DIS) return false;
+    switch (eps->eptype & ~USB_EPTYPE_DBLBUF) {
+    case USB_EPTYPE_BULK:
+    case USB_EPTYPE_INTERRUPT:
+        eps->ring = ring;
+        /* draining packets received before */
+        ep_rxdrain(eps);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/** \brief Helper function. Looks for the pending endpoint event.
+ */
+static bool get_ctr(uint8_t *ev, uint8_t *ep) {
+    for (int i = 0; i < MAX_EP; i++) {
+        sim_ep *eps = EPS(i);
+        if (eps->ctr_tx) {
+            eps->ctr_tx = false;
+            *ev = usbd_evt_eptx;
+            *ep = i | 0x80;
+            return true;
+        } else if (eps->ctr_rx) {
+            eps->ctr_rx = false;
+            *ev = (eps->setup) ? usbd_evt_epsetup : usbd_evt_eprx;
+            *ep = i;
+            /* early release of the endpoint buffers */
+            if (eps->ring) ep_rxdrain(eps);
+            return true;
+        }
+    }
+    return false;
+}
+
+void evt_poll(usbd_device *dev, usbd_evt_callback callback) {
+    uint8_t _ev, _ep = 0;
+    STAT(poll);
+    if (get_ctr(&_ev, &_ep)) {
+        /* endpoint event */
+    } else if (sim.events & SIM_EVT_RESET) {
+        sim.events &= ~SIM_EVT_RESET;
+        for (int i = 0; i < MAX_EP; i++) {
+            memset(EPS(i), 0, sizeof(sim_ep));
+        }
+        _ev = usbd_evt_reset;
+    } else if (sim.events & SIM_EVT_SOF) {
+        sim.events &= ~SIM_EVT_SOF;
+        _ev = usbd_evt_sof;
+    } else if (sim.events & SIM_EVT_WKUP) {
+        sim.events &= ~SIM_EVT_WKUP;
+        _ev = usbd_evt_wkup;
+    } else if (sim.events & SIM_EVT_SUSP) {
+        sim.events &= ~SIM_EVT_SUSP;
+        _ev = usbd_evt_susp;
+    } else {
+        return;
+    }
+    sim.stats.events++;
+    callback(dev, _ev, _ep);
+}
+
+static uint32_t fnv1a32_turn (uint32_t fnv, uint32_t data ) {
+    for (int i = 0; i < 4 ; i++) {
+        fnv ^= (data & 0xFF);
+        fnv *= 16777619;
+        data >>= 8;
+    }
+    return fnv;
+}
+
+uint16_t get_serialno_desc(void *buffer) {
+    struct  usb_string_descriptor *dsc = buffer;
+    uint8_t *str = (uint8_t*)buffer + 2;
+    uint32_t fnv = 2166136261;
+    STAT(serialno);
+    fnv = fnv1a32_turn(fnv, sim_uid[0]);
+    fnv = fnv1a32_turn(fnv, sim_uid[1]);
+    fnv = fnv1a32_turn(fnv, sim_uid[2]);
+    for (int i = 28; i >= 0; i -= 4 ) {
+        uint16_t c = (fnv >> i) & 0x0F;
+        c += (c < 10) ? '0' : ('A' - 10);
+        *str++ = c;
+        *str++ = 0;
+    }
+    dsc->bDescriptorType = USB_DTYPE_STRING;
+    dsc->bLength = 18;
+    return 18;
+}
+
+/* virtual host side */
+
+void usb_sim_reset(void) {
+    if (sim.stats.enabled && sim.stats.connected) {
+        sim.events |= SIM_EVT_RESET;
+    }
+}
+
+void usb_sim_sof(void) {
+    sim.frame = (sim.frame + 1) & 0x07FF;
+    if (sim.stats.enabled) {
+        sim.events |= SIM_EVT_SOF;
+    }
+}
+
+void usb_sim_suspend(bool suspend) {
+    if (sim.stats.enabled) {
+        sim.events |= (suspend) ? SIM_EVT_SUSP : SIM_EVT_WKUP;
+    }
+}
+
+int32_t usb_sim_setup(uint8_t ep, const void *req) {
+    sim_ep *eps = EPS(ep);
+    if (eps->rx.state == SIM_DIS || eps->eptype != USB_EPTYPE_CONTROL) {
+        sim.stats.stalls++;
+        return usb_sim_stall;
+    }
+    /* SETUP is always accepted. Both directions are NAKed until the next read or write */
+    eps->rx.state = SIM_ACTIVE;
+    eps->tx.state = SIM_ACTIVE;
+    pipe_flush(&eps->rx);
+    pipe_flush(&eps->tx);
+    pipe_push(&eps->rx, req, 8);
+    eps->setup = true;
+    eps->ctr_rx = true;
+    eps->ctr_tx = false;
+    return 8;
+}
+
+int32_t usb_sim_out(uint8_t ep, const void *buf, uint16_t len) {
+    sim_ep *eps = EPS(ep);
+    switch (eps->rx.state) {
+    case SIM_ACTIVE:
+        if (len > eps->epsize || pipe_push(&eps->rx, buf, len) < 0) break;
+        eps->ctr_rx = true;
+        return len;
+    case SIM_STALL:
+        sim.stats.stalls++;
+        return usb_sim_stall;
+    default:
+        /* disabled endpoint doesn't respond */
+        return usb_sim_stall;
+    }
+    sim.stats.naks++;
+    return usb_sim_nak;
+}
+
+int32_t usb_sim_in(uint8_t ep, void *buf, uint16_t blen) {
+    sim_ep *eps = EPS(ep);
+    int32_t res;
+    switch (eps->tx.state) {
+    case SIM_ACTIVE:
+        res = pipe_pop(&eps->tx, buf, blen);
+        if (res < 0) break;
+        eps->ctr_tx = true;
+        return res;
+    case SIM_STALL:
+        sim.stats.stalls++;
+        return usb_sim_stall;
+    default:
+        return usb_sim_stall;
+    }
+    sim.stats.naks++;
+    return usb_sim_nak;
+}
+
+bool usb_sim_pending(void) {
+    for (int i = 0; i < MAX_EP; i++) {
+        if (sim.ep[i].ctr_rx || sim.ep[i].ctr_tx) return true;
+    }
+    return (sim.events != 0);
+}
+
+#include "sim_control.inc"
+
+void usb_sim_get_stats(struct usb_sim_stats *stats, bool clear) {
+    *stats = sim.stats;
+    if (clear) {
+        memset(&sim.stats.calls, 0, sizeof(sim.stats.calls));
+        sim.stats.events = 0;
+        sim.stats.rx_bytes = 0;
+        sim.stats.tx_bytes = 0;
+        sim.stats.naks = 0;
+        sim.stats.stalls = 0;
+    }
+}
+
+const struct usbd_driver usb_sim = {
+    USBD_HW_EPREUSE,
+    enable,
+    reset,
+    connect,
+    setaddr,
+    ep_config,
+    ep_deconfig,
+    ep_read,
+    ep_write,
+    ep_readv,
+    ep_writev,
+    ep_write_begin,
+    ep_write_commit,
+    ep_forward,
+    ep_txfree,
+    ep_setring,
+    0,
+    0,
+    ep_setstall,
+    ep_isstalled,
+    evt_poll,
+    get_frame,
+    get_serialno_desc,
+};
+
+#endif //USE_SIM_DRIVER
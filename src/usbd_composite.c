@@ -0,0 +1,159 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../usb.h"
+#include "../inc/usb_cdc.h"
+
+/** \brief Configures or deconfigures endpoints of all functions
+ * \details Composite handler is registered first, so the endpoints are ready when the function
+ * handlers are called.
+ */
+static usbd_respond usbd_comp_config(usbd_device *dev, void *ctx, uint8_t cfg) {
+    usbd_composite *comp = ctx;
+    const struct usb_config_descriptor *_cfg = comp->desc;
+    if (cfg && (cfg != _cfg->bConfigurationValue)) return usbd_fail;
+    for (int i = 1; i < comp->ep_count; i++) {
+        const usbd_epcfg *ep = &comp->ep[i];
+        if (cfg == 0) {
+            usbd_ep_deconfig(dev, ep->ep);
+            usbd_reg_endpoint(dev, ep->ep, 0);
+        } else if (!usbd_ep_config(dev, ep->ep, ep->eptype, ep->epsize)) {
+            return usbd_fail;
+        }
+    }
+    return usbd_ack;
+}
+
+static const struct usbd_class usbd_comp_class = {
+    .config = usbd_comp_config,
+};
+
+/** \brief Shifts interface numbers and endpoint addresses of the function descriptors
+ * \param func pointer to the function
+ * \param dsc pointer to the copied function descriptors
+ */
+static void usbd_comp_patch(const struct usbd_function *func, uint8_t *dsc) {
+    bool cdc = false;
+    for (uint8_t *end = dsc + func->desc_len; dsc < end; dsc += dsc[0]) {
+        switch (dsc[1]) {
+        case USB_DTYPE_INTERFACE:
+            dsc[2] += func->iface;
+            /* functional descriptors of the other classes use the same subtypes */
+            cdc = (dsc[5] == USB_CLASS_CDC);
+            break;
+        case USB_DTYPE_ENDPOINT:
+            dsc[2] += func->epbase;
+            break;
+        case USB_DTYPE_CS_INTERFACE:
+            if (!cdc) break;
+            if (dsc[2] == USB_DTYPE_CDC_UNION) {
+                /* master and slave interfaces */
+                for (int i = 3; i < dsc[0]; i++) dsc[i] += func->iface;
+            } else if (dsc[2] == USB_DTYPE_CDC_CALL_MANAGEMENT) {
+                /* data interface */
+                dsc[4] += func->iface;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+bool usbd_comp_init(usbd_device *dev, usbd_composite *comp, struct usbd_function *func,
+                    uint8_t count, const struct usb_config_descriptor *cfg, void *buf, uint16_t bsize) {
+    struct usb_config_descriptor *_cfg = buf;
+    uint8_t *pos = (uint8_t*)buf + sizeof(*cfg);
+    uint8_t *end = (uint8_t*)buf + bsize;
+    uint8_t iface = 0;
+    uint8_t epnum = 0;
+    comp->func = func;
+    comp->count = count;
+    comp->ep[0].ep = 0x00;
+    comp->ep[0].eptype = USB_EPTYPE_CONTROL;
+    comp->ep[0].epsize = dev->status.ep0size;
+    comp->ep_count = 1;
+    if (bsize < sizeof(*cfg)) return false;
+    memcpy(_cfg, cfg, sizeof(*cfg));
+    for (int i = 0; i < count; i++) {
+        struct usbd_function *f = &func[i];
+        const struct usb_interface_descriptor *first = 0;
+        uint8_t _n = 0;
+        /* IN and OUT endpoints of the function can share the number */
+        for (int j = 0; j < f->ep_count; j++) {
+            if ((f->ep[j].ep & 0x07) > _n) _n = f->ep[j].ep & 0x07;
+        }
+        /* counting interfaces */
+        f->iface_count = 0;
+        for (const uint8_t *d = f->desc; d < (const uint8_t*)f->desc + f->desc_len; d += d[0]) {
+            if ((d[1] != USB_DTYPE_INTERFACE) || (d[3] != 0)) continue;
+            if (first == 0) first = (const void*)d;
+            f->iface_count++;
+        }
+        if (((epnum + _n) >= USBD_HW_MAX_EP) ||
+            ((comp->ep_count + f->ep_count) > USBD_COMP_MAX_EPCFG) ||
+            ((iface + f->iface_count) > USBD_MAX_IFACES)) return false;
+        f->iface = iface;
+        f->epbase = epnum;
+        iface += f->iface_count;
+        epnum += _n;
+        /* IAD for the multi-interface function */
+        if (f->iface_count > 1) {
+            struct usb_iad_descriptor *iad = (void*)pos;
+            if ((end - pos) < (int)sizeof(*iad)) return false;
+            iad->bLength = sizeof(*iad);
+            iad->bDescriptorType = USB_DTYPE_INTERFASEASSOC;
+            iad->bFirstInterface = f->iface;
+            iad->bInterfaceCount = f->iface_count;
+            iad->bFunctionClass = first->bInterfaceClass;
+            iad->bFunctionSubClass = first->bInterfaceSubClass;
+            iad->bFunctionProtocol = first->bInterfaceProtocol;
+            iad->iFunction = first->iInterface;
+            pos += sizeof(*iad);
+        }
+        if ((end - pos) < f->desc_len) return false;
+        memcpy(pos, f->desc, f->desc_len);
+        usbd_comp_patch(f, pos);
+        pos += f->desc_len;
+        for (int j = 0; j < f->ep_count; j++) {
+            comp->ep[comp->ep_count] = f->ep[j];
+            comp->ep[comp->ep_count].ep += f->epbase;
+            comp->ep_count++;
+        }
+    }
+    _cfg->wTotalLength = pos - (uint8_t*)buf;
+    _cfg->bNumInterfaces = iface;
+    comp->desc = buf;
+    comp->desc_len = _cfg->wTotalLength;
+    /* packet memory for the whole endpoint set */
+    comp->layout.ep = 0xFF;
+    if ((dev->driver->caps & USBD_HW_LAYOUT) &&
+        !usbd_ep_layout(dev, comp->ep, comp->ep_count, &comp->layout)) return false;
+    /* composite handler goes first */
+    if (!usbd_reg_class(dev, &usbd_comp_class, comp, 0, 0)) return false;
+    for (int i = 0; i < count; i++) {
+        struct usbd_function *f = &func[i];
+        if (f->cls == 0) continue;
+        if (!usbd_reg_class(dev, f->cls, f, f->iface, f->iface_count)) return false;
+        for (int j = 0; j < f->ep_count; j++) {
+            usbd_reg_class_ep(dev, f->iface, f->ep[j].ep + f->epbase);
+        }
+    }
+    return true;
+}
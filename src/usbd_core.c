@@ -17,6 +17,8 @@
 #include <stdbool.h>
 #include <string.h>
 #include "../usb.h"
+#include "../inc/usb_msos.h"
+#include "../inc/usb_webusb.h"
 
 #define _MIN(a, b) ((a) < (b)) ? (a) : (b)
 
@@ -30,6 +32,10 @@ static void usbd_process_reset(usbd_device *dev) {
     dev->status.device_state = usbd_state_default;
     dev->status.control_state = usbd_ctl_idle;
     dev->status.device_cfg = 0;
+    memset(dev->status.iface_alt, 0, sizeof(dev->status.iface_alt));
+    for (int i = 0; i < 16; i++) {
+        dev->xfer[i] = 0;
+    }
     dev->driver->ep_config(0, USB_EPTYPE_CONTROL, dev->status.ep0size);
     dev->endpoint[0] = usbd_process_ep0;
     dev->driver->setaddr(0);
@@ -56,20 +62,108 @@ static void usbd_process_callback (usbd_device *dev) {
     }
 }
 
+/** \brief Processes MS OS 2.0 and WebUSB vendor requests
+ * \param dev pointer to usb device
+ * \param req pointer to control request
+ * \return usbd_ack if request was processed
+ */
+static usbd_respond usbd_process_vendrq(usbd_device *dev, usbd_ctlreq *req) {
+    const usbd_bos *bos = dev->bos;
+    if ((bos == 0) || !(req->bmRequestType & USB_REQ_DEVTOHOST)) return usbd_fail;
+    if (bos->msos20 && (req->bRequest == bos->msos20_code) &&
+        (req->wIndex == USB_MSOS20_DESCRIPTOR_INDEX)) {
+        dev->status.data_ptr = (void*)bos->msos20;
+        dev->status.data_count = bos->msos20->wTotalLength;
+        return usbd_ack;
+    }
+    if ((req->bRequest == bos->webusb_code) && (req->wIndex == USB_WEBUSB_GET_URL) &&
+        (req->wValue > 0) && (req->wValue <= bos->url_count)) {
+        dev->status.data_ptr = (void*)bos->url[req->wValue - 1];
+        dev->status.data_count = bos->url[req->wValue - 1]->bLength;
+        return usbd_ack;
+    }
+    return usbd_fail;
+}
+
+/** \brief Looks up class handler of the interface
+ * \param dev usb device
+ * \param iface interface number
+ * \return pointer to the handler, NULL if interface has no handler
+ */
+static const usbd_handler *usbd_iface_handler(const usbd_device *dev, uint16_t iface) {
+    if ((iface >= USBD_MAX_IFACES) || (dev->iface_handler[iface] == 0)) return 0;
+    return &dev->handler[dev->iface_handler[iface] - 1];
+}
+
+/** \brief Looks up class handler of the control request recipient
+ * \param dev usb device
+ * \param req pointer to control request
+ * \return pointer to the handler, NULL if recipient has no handler
+ */
+static const usbd_handler *usbd_req_handler(const usbd_device *dev, const usbd_ctlreq *req) {
+    uint8_t _h;
+    switch (req->bmRequestType & USB_REQ_RECIPIENT) {
+    case USB_REQ_INTERFACE:
+        /* high byte of wIndex may address the entity of the interface */
+        return usbd_iface_handler(dev, req->wIndex & 0xFF);
+    case USB_REQ_ENDPOINT:
+        _h = dev->ep_handler[(req->wIndex & 0x07) | ((req->wIndex & 0x80) >> 4)];
+        return (_h) ? &dev->handler[_h - 1] : 0;
+    default:
+        return 0;
+    }
+}
+
 /** \brief SET_CONFIG request processing
  * \param dev usbd_device
  * \param config config number from request
  * \return usbd_ack if success
  */
 static usbd_respond usbd_configure(usbd_device *dev, uint8_t config) {
+    bool _ack = false;
     if (dev->config_callback) {
-        if (dev->config_callback(dev, config) == usbd_ack) {
-            dev->status.device_cfg = config;
-            dev->status.device_state = (config) ? usbd_state_configured : usbd_state_addressed;
-            return usbd_ack;
+        if (dev->config_callback(dev, config) != usbd_ack) return usbd_fail;
+        _ack = true;
+    }
+    /* notifying class handlers */
+    for (int i = 0; i < USBD_MAX_HANDLERS; i++) {
+        const usbd_handler *h = &dev->handler[i];
+        if (h->cls == 0) continue;
+        if (h->cls->config && (h->cls->config(dev, h->ctx, config) != usbd_ack)) return usbd_fail;
+        _ack = true;
+    }
+    if (!_ack) return usbd_fail;
+    dev->status.device_cfg = config;
+    dev->status.device_state = (config) ? usbd_state_configured : usbd_state_addressed;
+    memset(dev->status.iface_alt, 0, sizeof(dev->status.iface_alt));
+    return usbd_ack;
+}
+
+/** \brief SET_INTERFACE request processing
+ * \param dev usbd_device
+ * \param iface interface number from request
+ * \param alt alternate setting from request
+ * \return usbd_ack if success
+ */
+static usbd_respond usbd_set_interface(usbd_device *dev, uint16_t iface, uint16_t alt) {
+    const usbd_handler *h = usbd_iface_handler(dev, iface);
+    if ((dev->status.device_state != usbd_state_configured) || (iface >= USBD_MAX_IFACES)) {
+        return usbd_fail;
+    }
+    if (h) {
+        /* class takes the alternate settings only if the driver reuses the packet memory */
+        if (h->cls->altset && (dev->driver->caps & USBD_HW_EPREUSE)) {
+            if (h->cls->altset(dev, h->ctx, iface, alt) != usbd_ack) return usbd_fail;
+        } else if (alt != 0) {
+            return usbd_fail;
         }
+    } else if (dev->alt_callback) {
+        if (dev->alt_callback(dev, iface, alt) != usbd_ack) return usbd_fail;
+    } else if (alt != 0) {
+        return usbd_fail;
     }
-    return usbd_fail;
+    dev->status.iface_alt[iface] = alt;
+    return usbd_ack;
 }
 
 
@@ -90,6 +184,10 @@ static usbd_respond usbd_process_devrq (usbd_device *dev, usbd_ctlreq *req) {
         if (req->wValue == ((USB_DTYPE_STRING << 8) | INTSERIALNO_DESCRIPTOR )) {
             dev->status.data_count = dev->driver->get_serialno_desc(req->data);
             return usbd_ack;
+        } else if (((req->wValue >> 8) == USB_DTYPE_BOS) && dev->bos) {
+            dev->status.data_ptr = (void*)dev->bos->bos;
+            dev->status.data_count = dev->bos->bos->wTotalLength;
+            return usbd_ack;
         } else {
             if (dev->descriptor_callback) {
                 return dev->descriptor_callback(req, &(dev->status.data_ptr), &(dev->status.data_count));
@@ -127,12 +225,19 @@ static usbd_respond usbd_process_devrq (usbd_device *dev, usbd_ctlreq *req) {
  * \return TRUE if request is handled
  */
 static usbd_respond usbd_process_intrq(usbd_device *dev, usbd_ctlreq *req) {
-    (void)dev;
     switch (req->bRequest) {
     case USB_STD_GET_STATUS:
         req->data[0] = 0;
         req->data[1] = 0;
         return usbd_ack;
+    case USB_STD_GET_INTERFACE:
+        if ((dev->status.device_state != usbd_state_configured) || (req->wIndex >= USBD_MAX_IFACES)) {
+            break;
+        }
+        req->data[0] = dev->status.iface_alt[req->wIndex];
+        return usbd_ack;
+    case USB_STD_SET_INTERFACE:
+        return usbd_set_interface(dev, req->wIndex, req->wValue);
     default:
         break;
     }
@@ -168,23 +273,38 @@ static usbd_respond usbd_process_eptrq(usbd_device *dev, usbd_ctlreq *req) {
  * \return TRUE if request is handled
  */
 static usbd_respond usbd_process_request(usbd_device *dev, usbd_ctlreq *req) {
+    const usbd_handler *h = usbd_req_handler(dev, req);
+    usbd_respond r;
+    /* class and vendor requests go straight to the class handler */
+    if (h && ((req->bmRequestType & USB_REQ_TYPE) != USB_REQ_STANDARD)) {
+        if (h->cls->control == 0) return usbd_fail;
+        return h->cls->control(dev, h->ctx, req, &(dev->complete_callback));
+    }
     /* processing control request by callback */
     if (dev->control_callback) {
-        usbd_respond r = dev->control_callback(dev, req, &(dev->complete_callback));
+        r = dev->control_callback(dev, req, &(dev->complete_callback));
         if (r != usbd_fail) return r;
     }
     /* continuing standard USB requests */
     switch (req->bmRequestType & (USB_REQ_TYPE | USB_REQ_RECIPIENT)) {
     case USB_REQ_STANDARD | USB_REQ_DEVICE:
         return usbd_process_devrq(dev, req);
+    case USB_REQ_VENDOR | USB_REQ_DEVICE:
+        return usbd_process_vendrq(dev, req);
     case USB_REQ_STANDARD | USB_REQ_INTERFACE:
-        return usbd_process_intrq(dev, req);
+        r = usbd_process_intrq(dev, req);
+        break;
     case USB_REQ_STANDARD | USB_REQ_ENDPOINT:
-        return usbd_process_eptrq(dev, req);
-    default:
+        r = usbd_process_eptrq(dev, req);
         break;
+    default:
+        return usbd_fail;
     }
-    return usbd_fail;
+    /* standard requests that are not processed by the core go to the class handler */
+    if ((r == usbd_fail) && h && h->cls->control) {
+        r = h->cls->control(dev, h->ctx, req, &(dev->complete_callback));
+    }
+    return r;
 }
 
 
@@ -321,6 +441,7 @@ static void usbd_process_ep0 (usbd_device *dev, uint8_t event, uint8_t ep) {
         /* force switch to setup state */
         dev->status.control_state = usbd_ctl_idle;
         dev->complete_callback = 0;
+        /* fall through */
     case usbd_evt_eprx:
         return usbd_process_eprx(dev, ep);
     case usbd_evt_eptx:
@@ -331,6 +452,133 @@ static void usbd_process_ep0 (usbd_device *dev, uint8_t event, uint8_t ep) {
 }
 
 
+bool usbd_reg_class(usbd_device *dev, const struct usbd_class *cls, void *ctx, uint8_t iface, uint8_t count) {
+    int _h = -1;
+    if ((iface + count) > USBD_MAX_IFACES) return false;
+    /* looking for the same handler or the free one */
+    for (int i = USBD_MAX_HANDLERS - 1; i >= 0; i--) {
+        if ((dev->handler[i].cls == cls) && (dev->handler[i].ctx == ctx)) {
+            _h = i;
+            break;
+        }
+        if (dev->handler[i].cls == 0) _h = i;
+    }
+    if (_h < 0) return false;
+    dev->handler[_h].cls = cls;
+    dev->handler[_h].ctx = ctx;
+    for (; count; count--, iface++) {
+        dev->iface_handler[iface] = _h + 1;
+    }
+    return true;
+}
+
+bool usbd_reg_class_ep(usbd_device *dev, uint8_t iface, uint8_t ep) {
+    if ((iface >= USBD_MAX_IFACES) || (dev->iface_handler[iface] == 0)) return false;
+    dev->ep_handler[(ep & 0x07) | ((ep & 0x80) >> 4)] = dev->iface_handler[iface];
+    return true;
+}
+
+/** \brief Completes endpoint transfer
+ * \param dev usb device
+ * \param ep endpoint address
+ * \param slot transfer slot
+ */
+static void usbd_complete_xfer(usbd_device *dev, uint8_t ep, uint8_t slot) {
+    usbd_xfer *const xfer = dev->xfer[slot];
+    /* slot is released before callback, so next transfer can be submitted from it */
+    dev->xfer[slot] = 0;
+    if (xfer->complete) xfer->complete(dev, ep, xfer);
+}
+
+/** \brief Checks IN transfer for the pending ZLP
+ * \param xfer transfer
+ * \return TRUE if transfer should be terminated with ZLP
+ */
+static bool usbd_xfer_zlp(const usbd_xfer *xfer) {
+    return (xfer->flags & USBD_XFER_ZLP) && !xfer->zlp_sent && xfer->len &&
+           (xfer->len % xfer->mps) == 0;
+}
+
+/** \brief Passes IN transfer packets to the endpoint until it has free buffers
+ * \param dev usb device
+ * \param ep endpoint address
+ * \param xfer transfer
+ */
+static void usbd_fill_xfer(usbd_device *dev, uint8_t ep, usbd_xfer *xfer) {
+    int32_t _t;
+    while (xfer->count < xfer->len) {
+        _t = xfer->len - xfer->count;
+        /* driver splits the data to packets by itself */
+        if (dev->driver->caps & USBD_HW_STREAM) {
+            _t = dev->driver->ep_stream(ep, (uint8_t*)xfer->buf + xfer->count, _t);
+        } else {
+            if (!(dev->driver->caps & USBD_HW_MULTIPKT)) _t = _MIN(_t, xfer->mps);
+            _t = dev->driver->ep_write(ep, (uint8_t*)xfer->buf + xfer->count, _t);
+        }
+        if (_t < 0) return;
+        xfer->count += _t;
+        xfer->queued++;
+    }
+    /* all data passed to the endpoint. Checking for the ZLP */
+    if (usbd_xfer_zlp(xfer) && dev->driver->ep_write(ep, 0, 0) == 0) {
+        xfer->zlp_sent = 1;
+        xfer->queued++;
+    }
+}
+
+/** \brief Endpoint transfer processing
+ * \param dev usb device
+ * \param evt usb event
+ * \param ep active endpoint
+ * \return TRUE if event is consumed by the active transfer
+ */
+static bool usbd_process_xfer(usbd_device *dev, uint8_t evt, uint8_t ep) {
+    const uint8_t slot = (ep & 0x07) | ((ep & 0x80) >> 4);
+    usbd_xfer *const xfer = dev->xfer[slot];
+    int32_t _t;
+    if (xfer == 0) return false;
+    if (evt == usbd_evt_eptx) {
+        if (xfer->queued) xfer->queued--;
+        usbd_fill_xfer(dev, ep, xfer);
+        /* completes when all packets are transmitted */
+        if (xfer->queued == 0 && xfer->count == xfer->len && !usbd_xfer_zlp(xfer)) {
+            usbd_complete_xfer(dev, ep, slot);
+        }
+    } else {
+        _t = dev->driver->ep_read(ep, (uint8_t*)xfer->buf + xfer->count, xfer->len - xfer->count);
+        if (_t < 0) return true;
+        /* some drivers report the packet size even if the packet is truncated */
+        xfer->count = _MIN(xfer->count + _t, xfer->len);
+        /* completes on full buffer or short packet */
+        if (xfer->count >= xfer->len || _t < xfer->mps) {
+            usbd_complete_xfer(dev, ep, slot);
+        }
+    }
+    return true;
+}
+
+bool usbd_ep_submit(usbd_device *dev, uint8_t ep, usbd_xfer *xfer) {
+    const uint8_t slot = (ep & 0x07) | ((ep & 0x80) >> 4);
+    if ((ep & 0x07) == 0 || xfer->mps == 0 || dev->xfer[slot]) return false;
+    /* OUT packet never exceeds the rest of the buffer */
+    if (!(ep & 0x80) && (xfer->len == 0 || (xfer->len % xfer->mps))) return false;
+    xfer->count = 0;
+    xfer->queued = 0;
+    xfer->zlp_sent = 0;
+    if (ep & 0x80) {
+        /* packets are written while endpoint has free buffers, next ones on TX completion */
+        if (xfer->len == 0) {
+            if (dev->driver->ep_write(ep, 0, 0) < 0) return false;
+            xfer->queued = 1;
+        } else {
+            usbd_fill_xfer(dev, ep, xfer);
+            if (xfer->queued == 0) return false;
+        }
+    }
+    dev->xfer[slot] = xfer;
+    return true;
+}
+
 /** \brief General event processing callback
  * \param dev usb device
  * \param evt usb event
@@ -343,6 +591,9 @@ static void usbd_process_evt(usbd_device *dev, uint8_t evt, uint8_t ep) {
         break;
     case usbd_evt_eprx:
     case usbd_evt_eptx:
+        if (usbd_process_xfer(dev, evt, ep)) break;
+        /* no active transfer on this endpoint. passing event to the endpoint callback */
+        /* fall through */
     case usbd_evt_epsetup:
         if (dev->endpoint[ep & 0x07]) dev->endpoint[ep & 0x07](dev, evt, ep);
         break;
@@ -356,6 +607,89 @@ void usbd_poll(usbd_device *dev) {
     return dev->driver->poll(dev, usbd_process_evt);
 }
 
+/** \brief Helper function. Counts events for \ref usbd_poll_budget.
+ */
+static void usbd_process_evt_count(usbd_device *dev, uint8_t evt, uint8_t ep) {
+    dev->evt_count++;
+    usbd_process_evt(dev, evt, ep);
+}
+
+uint32_t usbd_poll_budget(usbd_device *dev, uint32_t budget) {
+    uint32_t count = 0;
+    while (count < budget) {
+        dev->evt_count = 0;
+        dev->driver->poll(dev, usbd_process_evt_count);
+        /* hardware is idle */
+        if (dev->evt_count == 0) break;
+        count += dev->evt_count;
+    }
+    return count;
+}
+
+/** \brief Helper function. Puts event to the queue.
+ */
+static void usbd_capture_evt(usbd_device *dev, uint8_t evt, uint8_t ep) {
+    usbd_evt_queue *q = dev->queue;
+    uint8_t head = q->head;
+    dev->evt_count++;
+    if ((uint8_t)(head - q->tail) > q->mask) {
+        q->overflows++;
+        return;
+    }
+    q->buf[head & q->mask].evt = evt;
+    q->buf[head & q->mask].ep = ep;
+    /* record must be written before it will be published */
+    __asm__ volatile ("" ::: "memory");
+    q->head = head + 1;
+}
+
+uint32_t usbd_poll_capture(usbd_device *dev, uint32_t budget) {
+    uint32_t count = 0;
+    /* events are left in the hardware while the queue can't take one poll */
+    while ((count < budget) && usbd_queue_ready(dev)) {
+        dev->evt_count = 0;
+        dev->driver->poll(dev, usbd_capture_evt);
+        if (dev->evt_count == 0) break;
+        count += dev->evt_count;
+    }
+    return count;
+}
+
+uint32_t usbd_process_queue(usbd_device *dev, uint32_t budget) {
+    usbd_evt_queue *q = dev->queue;
+    uint32_t count = 0;
+    uint8_t tail = q->tail;
+    while ((count < budget) && (tail != q->head)) {
+        /* head must be read before the record */
+        __asm__ volatile ("" ::: "memory");
+        usbd_evt_rec rec = q->buf[tail & q->mask];
+        /* record must be read before it will be released */
+        __asm__ volatile ("" ::: "memory");
+        q->tail = ++tail;
+        usbd_process_evt(dev, rec.evt, rec.ep);
+        count++;
+    }
+    return count;
+}
+
+uint16_t usbd_rxring_read(usbd_rxring *ring, void *buf, uint16_t blen) {
+    uint16_t tail = ring->tail;
+    uint16_t cnt = ring->head - tail;
+    uint16_t pos, _t;
+    if (blen < cnt) cnt = blen;
+    /* head must be read before the data */
+    __asm__ volatile ("" ::: "memory");
+    pos = tail & ring->mask;
+    _t = ring->mask + 1 - pos;
+    if (_t > cnt) _t = cnt;
+    memcpy(buf, ring->buf + pos, _t);
+    memcpy((uint8_t*)buf + _t, ring->buf, cnt - _t);
+    /* data must be read before it will be released */
+    __asm__ volatile ("" ::: "memory");
+    ring->tail = tail + cnt;
+    return cnt;
+}
+
 void usbd_control(usbd_device *dev, enum usbd_commands cmd) {
     switch (cmd) {
     case usbd_cmd_enable:
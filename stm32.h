@@ -14,7 +14,12 @@
 /* wait for bitfield value */
 #define _WVL(reg, msk, val)     while(((reg) & (msk)) != (val))
 
-#if defined(STM32F0)
+#if defined(USBD_SIM)
+    /* host-side simulation. no hardware definitions required */
+#elif defined(USBD_EMU)
+    /* host-side emulation. software models of the USB peripherals */
+    #include "inc/usb_emu.h"
+#elif defined(STM32F0)
     #include "STM32F0xx/Include/stm32f0xx.h"
 #elif defined(STM32F1)
     #include "STM32F1xx/Include/stm32f1xx.h"
@@ -31,10 +36,17 @@
 #elif defined(STM32L1)
     #include "STM32L1xx/Include/stm32l1xx.h"
 #elif defined(STM32L4)
-    #include "STM32L1xx/Include/stm32l4xx.h"
+    #include "STM32L4xx/Include/stm32l4xx.h"
 #else
     #error "STM32 family not defined"
 #endif
 
+/* register access with side effects. passed to the peripheral model in the emulation mode */
+#if !defined(_WSE)
+    #define _WSE(reg, val)      (reg) = (val)
+#endif
+#if !defined(_RSE)
+    #define _RSE(reg)           (reg)
+#endif
 
 #endif // _STM32_H_
@@ -0,0 +1,162 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Interface alternate settings. SET_INTERFACE switches the streaming interface between the
+ * zero bandwidth setting and two settings with different packet sizes many times, the
+ * reconfigured endpoint takes its packet memory back and doesn't overlap the endpoint of
+ * the other interface. GET_INTERFACE reports the current setting. Drivers without the packet
+ * memory reuse don't get the alternate settings callback.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define ALT_RXD_EP      0x01    /* interface 0, always configured */
+#define ALT_TXD_EP      0x82    /* interface 1, alternate settings 1 and 2 */
+#define ALT_SZ          0x40
+#define ALT_SZ2         0x20
+#define ALT_CYCLES      0x40
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static uint32_t alt_calls;
+
+static usbd_respond alt_config(usbd_device *dev, uint8_t cfg) {
+    if (cfg != 1) return usbd_fail;
+    CHECK(usbd_ep_config(dev, ALT_RXD_EP, USB_EPTYPE_BULK, ALT_SZ));
+    return usbd_ack;
+}
+
+static usbd_respond alt_select(usbd_device *dev, uint8_t iface, uint8_t alt) {
+    alt_calls++;
+    if ((iface != 1) || (alt > 2)) return usbd_fail;
+    usbd_ep_deconfig(dev, ALT_TXD_EP);
+    switch (alt) {
+    case 1:
+        return usbd_ep_config(dev, ALT_TXD_EP, USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF, ALT_SZ)
+               ? usbd_ack : usbd_fail;
+    case 2:
+        return usbd_ep_config(dev, ALT_TXD_EP, USB_EPTYPE_BULK, ALT_SZ2) ? usbd_ack : usbd_fail;
+    default:
+        return usbd_ack;
+    }
+}
+
+static int32_t control(uint8_t type, uint8_t req, uint16_t value, uint16_t index,
+                       uint16_t length, void *data) {
+    usbd_ctlreq rq = {
+        .bmRequestType  = type,
+        .bRequest       = req,
+        .wValue         = value,
+        .wIndex         = index,
+        .wLength        = length,
+    };
+    return usb_sim_control(&udev, &rq, data);
+}
+
+static int32_t set_iface(uint8_t iface, uint8_t alt) {
+    return control(USB_REQ_STANDARD | USB_REQ_INTERFACE, USB_STD_SET_INTERFACE, alt, iface, 0, 0);
+}
+
+/* returns current alternate setting or negative if request is stalled */
+static int32_t get_iface(uint8_t iface) {
+    uint8_t alt = 0xFF;
+    int32_t res = control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_INTERFACE,
+                          USB_STD_GET_INTERFACE, 0, iface, 1, &alt);
+    return (res == 1) ? alt : (res < 0) ? res : -0x100;
+}
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x100); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+/* one packet through each endpoint. Both are filled before either is drained, so the
+ * overlapped buffers lose data */
+static void check_data(uint8_t seed, uint16_t txsz) {
+    uint8_t out[ALT_SZ], in[ALT_SZ], buf[ALT_SZ];
+    for (int i = 0; i < ALT_SZ; i++) {
+        out[i] = seed + i;
+        in[i] = ~(seed + i);
+    }
+    CHECK_EQ(usb_sim_out(ALT_RXD_EP, out, ALT_SZ), ALT_SZ);
+    CHECK_EQ(usbd_ep_write(&udev, ALT_TXD_EP, in, txsz), txsz);
+    CHECK_EQ(usb_sim_in(ALT_TXD_EP & 0x07, buf, sizeof(buf)), txsz);
+    CHECK(memcmp(buf, in, txsz) == 0);
+    CHECK_EQ(usbd_ep_read(&udev, ALT_RXD_EP, buf, sizeof(buf)), ALT_SZ);
+    CHECK(memcmp(buf, out, ALT_SZ) == 0);
+    pump();
+}
+
+int main(void) {
+    struct usbd_driver noreuse = usbd_hw;
+    usbd_device ndev;
+
+    /* driver that takes new packet memory on every ep_config doesn't get the callback */
+    noreuse.caps &= ~USBD_HW_EPREUSE;
+    memset(&ndev, 0, sizeof(ndev));
+    usbd_init(&ndev, &noreuse, 8, ubuf, sizeof(ubuf));
+    CHECK(!usbd_reg_altset(&ndev, alt_select));
+    CHECK(ndev.alt_callback == 0);
+    CHECK(usbd_reg_altset(&ndev, 0));
+
+    usbd_init(&udev, &usbd_hw, 8, ubuf, sizeof(ubuf));
+    usbd_reg_config(&udev, alt_config);
+    CHECK(udev.driver->caps & USBD_HW_EPREUSE);
+    CHECK(usbd_reg_altset(&udev, alt_select));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+
+    /* interface requests are stalled before the configuration */
+    CHECK(get_iface(1) < 0);
+    CHECK(set_iface(1, 1) < 0);
+    CHECK_EQ(alt_calls, 0);
+
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_CONFIG, 1, 0, 0, 0), 0);
+    CHECK_EQ(get_iface(0), 0);
+    CHECK_EQ(get_iface(1), 0);
+
+    /* every switch reconfigures the endpoint of the interface 1. Without the buffer reuse
+     * the packet memory runs out after a few cycles */
+    for (int i = 0; i < ALT_CYCLES; i++) {
+        uint8_t alt = 1 + (i & 1);
+        CHECK_EQ(set_iface(1, alt), 0);
+        CHECK_EQ(get_iface(1), alt);
+        check_data(i, (alt == 1) ? ALT_SZ : ALT_SZ2);
+        CHECK_EQ(set_iface(1, 0), 0);
+        CHECK_EQ(get_iface(1), 0);
+    }
+    CHECK_EQ(alt_calls, 2 * ALT_CYCLES);
+
+    /* setting refused by the callback keeps the current one */
+    CHECK_EQ(set_iface(1, 1), 0);
+    CHECK(set_iface(1, 3) < 0);
+    CHECK(set_iface(2, 0) < 0);
+    CHECK_EQ(get_iface(1), 1);
+    /* interface beyond USBD_MAX_IFACES */
+    CHECK(get_iface(USBD_MAX_IFACES) < 0);
+    CHECK(set_iface(USBD_MAX_IFACES, 0) < 0);
+
+    /* configuration selects the default settings */
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_CONFIG, 1, 0, 0, 0), 0);
+    CHECK_EQ(get_iface(1), 0);
+    return TEST_DONE();
+}
@@ -0,0 +1,445 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* CDC ACM and HID composite device. The host enumerates the device built by usbd_comp_init,
+ * checks interface numbers and endpoint addresses in the configuration descriptor, moves data
+ * through the endpoints of both functions and sends the class requests of both functions.
+ * Endpoint numbers of the functions are packed up to the hardware limit, and the functional
+ * descriptors are patched in the CDC interfaces only.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "inc/usb_cdc.h"
+#include "inc/usb_hid.h"
+#include "test.h"
+
+/* function-local endpoints */
+#define CDC_RXD_EP      0x01
+#define CDC_TXD_EP      0x81
+#define CDC_NTF_EP      0x82
+#define CDC_DATA_SZ     0x40
+#define CDC_NTF_SZ      0x08
+#define HID_RPT_EP      0x81
+#define HID_RPT_SZ      0x08
+
+struct cdc_desc {
+    struct usb_interface_descriptor     comm;
+    struct usb_cdc_header_desc          cdc_hdr;
+    struct usb_cdc_call_mgmt_desc       cdc_mgmt;
+    struct usb_cdc_acm_desc             cdc_acm;
+    struct usb_cdc_union_desc           cdc_union;
+    struct usb_endpoint_descriptor      comm_ep;
+    struct usb_interface_descriptor     data;
+    struct usb_endpoint_descriptor      data_eprx;
+    struct usb_endpoint_descriptor      data_eptx;
+} __attribute__((packed));
+
+struct hid_desc {
+    struct usb_interface_descriptor     hid;
+    struct usb_hid_descriptor           hid_desc;
+    struct usb_endpoint_descriptor      hid_ep;
+} __attribute__((packed));
+
+static const struct cdc_desc cdc_desc = {
+    .comm = {
+        .bLength                = sizeof(struct usb_interface_descriptor),
+        .bDescriptorType        = USB_DTYPE_INTERFACE,
+        .bInterfaceNumber       = 0,
+        .bNumEndpoints          = 1,
+        .bInterfaceClass        = USB_CLASS_CDC,
+        .bInterfaceSubClass     = USB_CDC_SUBCLASS_ACM,
+        .bInterfaceProtocol     = USB_CDC_PROTO_V25TER,
+        .iInterface             = 4,
+    },
+    .cdc_hdr = {
+        .bFunctionLength        = sizeof(struct usb_cdc_header_desc),
+        .bDescriptorType        = USB_DTYPE_CS_INTERFACE,
+        .bDescriptorSubType     = USB_DTYPE_CDC_HEADER,
+        .bcdCDC                 = VERSION_BCD(1,1,0),
+    },
+    .cdc_mgmt = {
+        .bFunctionLength        = sizeof(struct usb_cdc_call_mgmt_desc),
+        .bDescriptorType        = USB_DTYPE_CS_INTERFACE,
+        .bDescriptorSubType     = USB_DTYPE_CDC_CALL_MANAGEMENT,
+        .bDataInterface         = 1,
+    },
+    .cdc_acm = {
+        .bFunctionLength        = sizeof(struct usb_cdc_acm_desc),
+        .bDescriptorType        = USB_DTYPE_CS_INTERFACE,
+        .bDescriptorSubType     = USB_DTYPE_CDC_ACM,
+    },
+    .cdc_union = {
+        .bFunctionLength        = sizeof(struct usb_cdc_union_desc),
+        .bDescriptorType        = USB_DTYPE_CS_INTERFACE,
+        .bDescriptorSubType     = USB_DTYPE_CDC_UNION,
+        .bMasterInterface0      = 0,
+        .bSlaveInterface0       = 1,
+    },
+    .comm_ep = {
+        .bLength                = sizeof(struct usb_endpoint_descriptor),
+        .bDescriptorType        = USB_DTYPE_ENDPOINT,
+        .bEndpointAddress       = CDC_NTF_EP,
+        .bmAttributes           = USB_EPTYPE_INTERRUPT,
+        .wMaxPacketSize         = CDC_NTF_SZ,
+        .bInterval              = 0xFF,
+    },
+    .data = {
+        .bLength                = sizeof(struct usb_interface_descriptor),
+        .bDescriptorType        = USB_DTYPE_INTERFACE,
+        .bInterfaceNumber       = 1,
+        .bNumEndpoints          = 2,
+        .bInterfaceClass        = USB_CLASS_CDC_DATA,
+    },
+    .data_eprx = {
+        .bLength                = sizeof(struct usb_endpoint_descriptor),
+        .bDescriptorType        = USB_DTYPE_ENDPOINT,
+        .bEndpointAddress       = CDC_RXD_EP,
+        .bmAttributes           = USB_EPTYPE_BULK,
+        .wMaxPacketSize         = CDC_DATA_SZ,
+        .bInterval              = 0x01,
+    },
+    .data_eptx = {
+        .bLength                = sizeof(struct usb_endpoint_descriptor),
+        .bDescriptorType        = USB_DTYPE_ENDPOINT,
+        .bEndpointAddress       = CDC_TXD_EP,
+        .bmAttributes           = USB_EPTYPE_BULK,
+        .wMaxPacketSize         = CDC_DATA_SZ,
+        .bInterval              = 0x01,
+    },
+};
+
+static const uint8_t hid_report[] = {
+    0x06, 0x00, 0xFF,   /* usage page (vendor) */
+    0x09, 0x01,         /* usage */
+    0xA1, 0x01,         /* collection (application) */
+    0x15, 0x00,         /* logical minimum */
+    0x26, 0xFF, 0x00,   /* logical maximum */
+    0x75, 0x08,         /* report size */
+    0x95, HID_RPT_SZ,   /* report count */
+    0x09, 0x01,         /* usage */
+    0x81, 0x02,         /* input */
+    0xC0,               /* end collection */
+};
+
+static const struct hid_desc hid_desc = {
+    .hid = {
+        .bLength                = sizeof(struct usb_interface_descriptor),
+        .bDescriptorType        = USB_DTYPE_INTERFACE,
+        .bInterfaceNumber       = 0,
+        .bNumEndpoints          = 1,
+        .bInterfaceClass        = USB_CLASS_HID,
+        .bInterfaceSubClass     = USB_HID_SUBCLASS_NONBOOT,
+        .bInterfaceProtocol     = USB_HID_PROTO_NONBOOT,
+    },
+    .hid_desc = {
+        .bLength                = sizeof(struct usb_hid_descriptor),
+        .bDescriptorType        = USB_DTYPE_HID,
+        .bcdHID                 = VERSION_BCD(1,1,1),
+        .bNumDescriptors        = 1,
+        .bDescriptorType0       = USB_DTYPE_HID_REPORT,
+        .wDescriptorLength0     = sizeof(hid_report),
+    },
+    .hid_ep = {
+        .bLength                = sizeof(struct usb_endpoint_descriptor),
+        .bDescriptorType        = USB_DTYPE_ENDPOINT,
+        .bEndpointAddress       = HID_RPT_EP,
+        .bmAttributes           = USB_EPTYPE_INTERRUPT,
+        .wMaxPacketSize         = HID_RPT_SZ,
+        .bInterval              = 0x01,
+    },
+};
+
+static const usbd_epcfg cdc_ep[] = {
+    {CDC_RXD_EP,    USB_EPTYPE_BULK,        CDC_DATA_SZ},
+    {CDC_TXD_EP,    USB_EPTYPE_BULK,        CDC_DATA_SZ},
+    {CDC_NTF_EP,    USB_EPTYPE_INTERRUPT,   CDC_NTF_SZ},
+};
+
+static const usbd_epcfg hid_ep[] = {
+    {HID_RPT_EP,    USB_EPTYPE_INTERRUPT,   HID_RPT_SZ},
+};
+
+static const struct usb_config_descriptor config_hdr = {
+    .bLength                = sizeof(struct usb_config_descriptor),
+    .bDescriptorType        = USB_DTYPE_CONFIGURATION,
+    .bConfigurationValue    = 1,
+    .iConfiguration         = NO_DESCRIPTOR,
+    .bmAttributes           = USB_CFG_ATTR_RESERVED | USB_CFG_ATTR_SELFPOWERED,
+    .bMaxPower              = USB_CFG_POWER_MA(100),
+};
+
+static const struct usb_device_descriptor device_desc = {
+    .bLength            = sizeof(struct usb_device_descriptor),
+    .bDescriptorType    = USB_DTYPE_DEVICE,
+    .bcdUSB             = VERSION_BCD(2,0,0),
+    .bDeviceClass       = USB_CLASS_IAD,
+    .bDeviceSubClass    = USB_SUBCLASS_IAD,
+    .bDeviceProtocol    = USB_PROTO_IAD,
+    .bMaxPacketSize0    = 64,
+    .idVendor           = 0x0483,
+    .idProduct          = 0x5740,
+    .bNumConfigurations = 1,
+};
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static usbd_composite comp;
+static uint8_t config_buf[0x100];
+static struct usb_cdc_line_coding line;
+static uint8_t hid_idle;
+
+static usbd_respond cdc_control(usbd_device *dev, void *ctx, usbd_ctlreq *req,
+                                usbd_rqc_callback *callback) {
+    (void)callback;
+    CHECK(((struct usbd_function*)ctx)->ctx == &line);
+    if ((req->bmRequestType & USB_REQ_TYPE) != USB_REQ_CLASS) return usbd_fail;
+    switch (req->bRequest) {
+    case USB_CDC_SET_LINE_CODING:
+        memcpy(&line, req->data, sizeof(line));
+        return usbd_ack;
+    case USB_CDC_GET_LINE_CODING:
+        dev->status.data_ptr = &line;
+        dev->status.data_count = sizeof(line);
+        return usbd_ack;
+    default:
+        return usbd_fail;
+    }
+}
+
+static usbd_respond hid_control(usbd_device *dev, void *ctx, usbd_ctlreq *req,
+                                usbd_rqc_callback *callback) {
+    (void)callback;
+    CHECK(((struct usbd_function*)ctx)->ctx == &hid_idle);
+    if ((req->bmRequestType & USB_REQ_TYPE) == USB_REQ_STANDARD) {
+        if ((req->bRequest != USB_STD_GET_DESCRIPTOR) ||
+            ((req->wValue >> 8) != USB_DTYPE_HID_REPORT)) return usbd_fail;
+        dev->status.data_ptr = (void*)hid_report;
+        dev->status.data_count = sizeof(hid_report);
+        return usbd_ack;
+    }
+    switch (req->bRequest) {
+    case USB_HID_SETIDLE:
+        hid_idle = req->wValue >> 8;
+        return usbd_ack;
+    default:
+        return usbd_fail;
+    }
+}
+
+static const struct usbd_class cdc_class = {
+    .control    = cdc_control,
+};
+
+static const struct usbd_class hid_class = {
+    .control    = hid_control,
+};
+
+static struct usbd_function func[] = {
+    {&cdc_class, &line, &cdc_desc, sizeof(cdc_desc), cdc_ep, USBD_COMP_EPS(cdc_ep)},
+    {&hid_class, &hid_idle, &hid_desc, sizeof(hid_desc), hid_ep, USBD_COMP_EPS(hid_ep)},
+};
+
+/* audio control interface. Its feature unit descriptor has the subtype of the CDC Union */
+static const uint8_t audio_desc[] = {
+    9, USB_DTYPE_INTERFACE, 0, 0, 0, 0x01, 0x01, 0x00, 0,
+    9, USB_DTYPE_CS_INTERFACE, USB_DTYPE_CDC_UNION, 2, 1, 1, 0x01, 0x02, 0,
+};
+
+static usbd_respond comp_getdesc(usbd_ctlreq *req, void **address, uint16_t *length) {
+    switch (req->wValue >> 8) {
+    case USB_DTYPE_DEVICE:
+        *address = (void*)&device_desc;
+        *length = sizeof(device_desc);
+        return usbd_ack;
+    case USB_DTYPE_CONFIGURATION:
+        *address = (void*)comp.desc;
+        *length = comp.desc_len;
+        return usbd_ack;
+    default:
+        return usbd_fail;
+    }
+}
+
+static int32_t control(uint8_t type, uint8_t req, uint16_t value, uint16_t index,
+                       uint16_t length, void *data) {
+    usbd_ctlreq rq = {
+        .bmRequestType  = type,
+        .bRequest       = req,
+        .wValue         = value,
+        .wIndex         = index,
+        .wLength        = length,
+    };
+    return usb_sim_control(&udev, &rq, data);
+}
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x100); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+/* checks the descriptors of the device configuration in order */
+static void check_config(const uint8_t *cfg, uint16_t len) {
+    const struct usbd_function *cdc = &func[0], *hid = &func[1];
+    const uint8_t *d = cfg;
+    const uint8_t *end = cfg + len;
+    CHECK_EQ(d[1], USB_DTYPE_CONFIGURATION);
+    CHECK_EQ(((const struct usb_config_descriptor*)d)->wTotalLength, len);
+    CHECK_EQ(((const struct usb_config_descriptor*)d)->bNumInterfaces, 3);
+    d += d[0];
+    /* two-interface CDC function takes IAD */
+    const struct usb_iad_descriptor *iad = (const void*)d;
+    CHECK_EQ(iad->bDescriptorType, USB_DTYPE_INTERFASEASSOC);
+    CHECK_EQ(iad->bFirstInterface, 0);
+    CHECK_EQ(iad->bInterfaceCount, 2);
+    CHECK_EQ(iad->bFunctionClass, USB_CLASS_CDC);
+    CHECK_EQ(iad->bFunctionSubClass, USB_CDC_SUBCLASS_ACM);
+    CHECK_EQ(iad->bFunctionProtocol, USB_CDC_PROTO_V25TER);
+    CHECK_EQ(iad->iFunction, 4);
+    d += d[0];
+    /* CDC descriptors are copied with interface numbers and endpoints shifted */
+    const struct cdc_desc *c = (const void*)d;
+    CHECK_EQ(c->comm.bInterfaceNumber, cdc->iface);
+    CHECK_EQ(c->cdc_mgmt.bDataInterface, cdc->iface + 1);
+    CHECK_EQ(c->cdc_union.bMasterInterface0, cdc->iface);
+    CHECK_EQ(c->cdc_union.bSlaveInterface0, cdc->iface + 1);
+    CHECK_EQ(c->comm_ep.bEndpointAddress, USBD_FUNC_EP(cdc, CDC_NTF_EP));
+    CHECK_EQ(c->data.bInterfaceNumber, cdc->iface + 1);
+    CHECK_EQ(c->data_eprx.bEndpointAddress, USBD_FUNC_EP(cdc, CDC_RXD_EP));
+    CHECK_EQ(c->data_eptx.bEndpointAddress, USBD_FUNC_EP(cdc, CDC_TXD_EP));
+    CHECK(memcmp(&c->cdc_hdr, &cdc_desc.cdc_hdr, sizeof(c->cdc_hdr)) == 0);
+    d += sizeof(*c);
+    /* single-interface HID function goes without IAD */
+    const struct hid_desc *h = (const void*)d;
+    CHECK_EQ(h->hid.bDescriptorType, USB_DTYPE_INTERFACE);
+    CHECK_EQ(h->hid.bInterfaceNumber, hid->iface);
+    CHECK(memcmp(&h->hid_desc, &hid_desc.hid_desc, sizeof(h->hid_desc)) == 0);
+    CHECK_EQ(h->hid_ep.bEndpointAddress, USBD_FUNC_EP(hid, HID_RPT_EP));
+    d += sizeof(*h);
+    CHECK(d == end);
+}
+
+/* builds composite devices that are not enumerated */
+static void check_build(void) {
+    static usbd_composite scomp;
+    usbd_device sdev;
+    uint8_t buf[0x100];
+    struct usbd_function sfunc[USBD_HW_MAX_EP] = {
+        {0, 0, audio_desc, sizeof(audio_desc), 0, 0},
+        {0, 0, &cdc_desc, sizeof(cdc_desc), cdc_ep, USBD_COMP_EPS(cdc_ep)},
+    };
+    memset(&sdev, 0, sizeof(sdev));
+    usbd_init(&sdev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    CHECK(usbd_comp_init(&sdev, &scomp, sfunc, 2, &config_hdr, buf, sizeof(buf)));
+    /* class-specific descriptor of the other class is copied as is */
+    CHECK(memcmp(buf + sizeof(struct usb_config_descriptor), audio_desc, sizeof(audio_desc)) == 0);
+    /* CDC functional descriptors are shifted */
+    const struct cdc_desc *c = (const void*)(buf + sizeof(struct usb_config_descriptor) +
+                                             sizeof(audio_desc) + sizeof(struct usb_iad_descriptor));
+    CHECK_EQ(c->cdc_union.bMasterInterface0, 1);
+    CHECK_EQ(c->cdc_union.bSlaveInterface0, 2);
+    CHECK_EQ(c->cdc_mgmt.bDataInterface, 2);
+
+    /* endpoint numbers of the CDC and HID functions up to the hardware limit */
+    for (int i = 0; i < USBD_HW_MAX_EP; i++) {
+        sfunc[i] = func[(i) ? 1 : 0];
+        /* no class handlers, so the handler table doesn't limit the function count */
+        sfunc[i].cls = 0;
+    }
+    memset(&sdev, 0, sizeof(sdev));
+    usbd_init(&sdev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    CHECK(usbd_comp_init(&sdev, &scomp, sfunc, USBD_HW_MAX_EP - 2, &config_hdr, buf, sizeof(buf)));
+    CHECK_EQ(sfunc[USBD_HW_MAX_EP - 3].epbase, USBD_HW_MAX_EP - 2);
+    memset(&sdev, 0, sizeof(sdev));
+    usbd_init(&sdev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    CHECK(!usbd_comp_init(&sdev, &scomp, sfunc, USBD_HW_MAX_EP - 1, &config_hdr, buf, sizeof(buf)));
+}
+
+int main(void) {
+    const struct usbd_function *cdc = &func[0], *hid = &func[1];
+    uint8_t buf[0x100], data[CDC_DATA_SZ];
+
+    check_build();
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    CHECK(usbd_comp_init(&udev, &comp, func, 2, &config_hdr, config_buf, sizeof(config_buf)));
+    usbd_reg_descr(&udev, comp_getdesc);
+    CHECK_EQ(comp.layout.ep, 0xFF);
+    CHECK_EQ(comp.ep_count, 1 + USBD_COMP_EPS(cdc_ep) + USBD_COMP_EPS(hid_ep));
+    CHECK_EQ(cdc->iface, 0);
+    CHECK_EQ(cdc->iface_count, 2);
+    CHECK_EQ(cdc->epbase, 0);
+    CHECK_EQ(hid->iface, 2);
+    CHECK_EQ(hid->iface_count, 1);
+    /* HID takes the number after the highest CDC endpoint number */
+    CHECK_EQ(hid->epbase, 2);
+    CHECK_EQ(USBD_FUNC_EP(hid, HID_RPT_EP), 0x83);
+
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+
+    /* enumeration */
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_GET_DESCRIPTOR,
+                     USB_DTYPE_DEVICE << 8, 0, sizeof(buf), buf), sizeof(device_desc));
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_ADDRESS, 5, 0, 0, 0), 0);
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_GET_DESCRIPTOR,
+                     USB_DTYPE_CONFIGURATION << 8, 0, sizeof(struct usb_config_descriptor), buf),
+             sizeof(struct usb_config_descriptor));
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_GET_DESCRIPTOR,
+                     USB_DTYPE_CONFIGURATION << 8, 0, sizeof(buf), buf), comp.desc_len);
+    check_config(buf, comp.desc_len);
+    CHECK(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_CONFIG, 2, 0, 0, 0) < 0);
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_CONFIG, 1, 0, 0, 0), 0);
+
+    /* data through the endpoints of both functions */
+    for (int i = 0; i < CDC_DATA_SZ; i++) data[i] = i * 3;
+    CHECK_EQ(usb_sim_out(USBD_FUNC_EP(cdc, CDC_RXD_EP), data, CDC_DATA_SZ), CDC_DATA_SZ);
+    CHECK_EQ(usbd_ep_write(&udev, USBD_FUNC_EP(hid, HID_RPT_EP), "report!", HID_RPT_SZ),
+             HID_RPT_SZ);
+    CHECK_EQ(usbd_ep_write(&udev, USBD_FUNC_EP(cdc, CDC_NTF_EP), "notify", CDC_NTF_SZ - 1),
+             CDC_NTF_SZ - 1);
+    CHECK_EQ(usbd_ep_read(&udev, USBD_FUNC_EP(cdc, CDC_RXD_EP), buf, sizeof(buf)), CDC_DATA_SZ);
+    CHECK(memcmp(buf, data, CDC_DATA_SZ) == 0);
+    CHECK_EQ(usbd_ep_write(&udev, USBD_FUNC_EP(cdc, CDC_TXD_EP), buf, CDC_DATA_SZ), CDC_DATA_SZ);
+    CHECK_EQ(usb_sim_in(USBD_FUNC_EP(hid, HID_RPT_EP) & 0x07, buf, sizeof(buf)), HID_RPT_SZ);
+    CHECK(memcmp(buf, "report!", HID_RPT_SZ) == 0);
+    CHECK_EQ(usb_sim_in(USBD_FUNC_EP(cdc, CDC_NTF_EP) & 0x07, buf, sizeof(buf)), CDC_NTF_SZ - 1);
+    CHECK(memcmp(buf, "notify", CDC_NTF_SZ - 1) == 0);
+    CHECK_EQ(usb_sim_in(USBD_FUNC_EP(cdc, CDC_TXD_EP) & 0x07, buf, sizeof(buf)), CDC_DATA_SZ);
+    CHECK(memcmp(buf, data, CDC_DATA_SZ) == 0);
+    pump();
+
+    /* class requests go to the function of the interface */
+    struct usb_cdc_line_coding lc = {115200, USB_CDC_1_STOP_BITS, USB_CDC_NO_PARITY, 8};
+    CHECK_EQ(control(USB_REQ_CLASS | USB_REQ_INTERFACE, USB_CDC_SET_LINE_CODING, 0, cdc->iface,
+                     sizeof(lc), &lc), sizeof(lc));
+    CHECK(memcmp(&line, &lc, sizeof(lc)) == 0);
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_CLASS | USB_REQ_INTERFACE, USB_CDC_GET_LINE_CODING,
+                     0, cdc->iface, sizeof(buf), buf), sizeof(lc));
+    CHECK(memcmp(buf, &lc, sizeof(lc)) == 0);
+    CHECK_EQ(control(USB_REQ_CLASS | USB_REQ_INTERFACE, USB_HID_SETIDLE, 0x7D00, hid->iface, 0, 0), 0);
+    CHECK_EQ(hid_idle, 0x7D);
+    CHECK(control(USB_REQ_CLASS | USB_REQ_INTERFACE, USB_HID_SETIDLE, 0x7D00, cdc->iface, 0, 0) < 0);
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_INTERFACE, USB_STD_GET_DESCRIPTOR,
+                     USB_DTYPE_HID_REPORT << 8, hid->iface, sizeof(buf), buf), sizeof(hid_report));
+    CHECK(memcmp(buf, hid_report, sizeof(hid_report)) == 0);
+
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_CONFIG, 0, 0, 0, 0), 0);
+    return TEST_DONE();
+}
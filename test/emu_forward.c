@@ -0,0 +1,125 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* OUT to IN packet forwarding. Packets of every length are received on one endpoint and
+ * relayed to another one, so the swapped buffers are used by the following packets. The IN
+ * endpoint reconfigured after the forward shouldn't take the buffer given to the OUT endpoint.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define FWD_RXD_EP      0x01
+#define FWD_TXD_EP      0x82
+#define FWD_SZ          0x40
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+static void fill(uint8_t *data, uint16_t len, uint8_t seed) {
+    for (int i = 0; i < len; i++) data[i] = (uint8_t)(seed * 7 + i);
+}
+
+static void check_packet(uint16_t len) {
+    uint8_t data[FWD_SZ], pkt[FWD_SZ];
+    fill(data, len, len);
+    CHECK_EQ(usb_sim_out(FWD_RXD_EP, data, len), len);
+    pump();
+    CHECK_EQ(usbd_ep_forward(&udev, FWD_RXD_EP, FWD_TXD_EP), len);
+    /* packet is gone from the OUT endpoint */
+    CHECK_EQ(usbd_ep_forward(&udev, FWD_RXD_EP, FWD_TXD_EP), -1);
+    CHECK_EQ(usb_sim_in(FWD_TXD_EP & 0x07, pkt, sizeof(pkt)), len);
+    CHECK(memcmp(pkt, data, len) == 0);
+    pump();
+}
+
+int main(void) {
+    uint8_t data[FWD_SZ], pkt[FWD_SZ], held[FWD_SZ];
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+    CHECK(usbd_ep_config(&udev, FWD_RXD_EP, USB_EPTYPE_BULK, FWD_SZ));
+    CHECK(usbd_ep_config(&udev, FWD_TXD_EP, USB_EPTYPE_BULK, FWD_SZ));
+    pump();
+
+    /* nothing to forward */
+    CHECK_EQ(usbd_ep_forward(&udev, FWD_RXD_EP, FWD_TXD_EP), -1);
+
+    for (uint16_t len = 0; len <= FWD_SZ; len++) {
+        check_packet(len);
+    }
+
+    /* packet stays in the OUT endpoint while the IN endpoint is busy */
+    fill(held, FWD_SZ, 1);
+    CHECK_EQ(usb_sim_out(FWD_RXD_EP, held, FWD_SZ), FWD_SZ);
+    pump();
+    CHECK_EQ(usbd_ep_forward(&udev, FWD_RXD_EP, FWD_TXD_EP), FWD_SZ);
+    fill(data, 21, 2);
+    CHECK_EQ(usb_sim_out(FWD_RXD_EP, data, 21), 21);
+    pump();
+    CHECK_EQ(usbd_ep_forward(&udev, FWD_RXD_EP, FWD_TXD_EP), -1);
+    CHECK_EQ(usb_sim_in(FWD_TXD_EP & 0x07, pkt, sizeof(pkt)), FWD_SZ);
+    CHECK(memcmp(pkt, held, FWD_SZ) == 0);
+    pump();
+    CHECK_EQ(usbd_ep_read(&udev, FWD_RXD_EP, pkt, sizeof(pkt)), 21);
+    CHECK(memcmp(pkt, data, 21) == 0);
+    pump();
+
+    /* swapped buffers still work for the regular reads and writes */
+    fill(data, FWD_SZ, 3);
+    CHECK_EQ(usbd_ep_write(&udev, FWD_TXD_EP, data, FWD_SZ), FWD_SZ);
+    CHECK_EQ(usb_sim_in(FWD_TXD_EP & 0x07, pkt, sizeof(pkt)), FWD_SZ);
+    CHECK(memcmp(pkt, data, FWD_SZ) == 0);
+    pump();
+    CHECK_EQ(usb_sim_out(FWD_RXD_EP, data, FWD_SZ), FWD_SZ);
+    pump();
+    memset(pkt, 0, sizeof(pkt));
+    CHECK_EQ(usbd_ep_read(&udev, FWD_RXD_EP, pkt, sizeof(pkt)), FWD_SZ);
+    CHECK(memcmp(pkt, data, FWD_SZ) == 0);
+    pump();
+
+    /* odd number of forwards leaves the buffers swapped */
+    fill(held, FWD_SZ, 4);
+    CHECK_EQ(usb_sim_out(FWD_RXD_EP, held, FWD_SZ), FWD_SZ);
+    pump();
+    CHECK_EQ(usbd_ep_forward(&udev, FWD_RXD_EP, FWD_TXD_EP), FWD_SZ);
+    CHECK_EQ(usb_sim_in(FWD_TXD_EP & 0x07, pkt, sizeof(pkt)), FWD_SZ);
+    pump();
+    /* reconfigured IN endpoint and OUT endpoint use different buffers */
+    CHECK(usbd_ep_config(&udev, FWD_TXD_EP, USB_EPTYPE_BULK, FWD_SZ));
+    pump();
+    fill(held, FWD_SZ, 5);
+    CHECK_EQ(usb_sim_out(FWD_RXD_EP, held, FWD_SZ), FWD_SZ);
+    pump();
+    fill(data, FWD_SZ, 6);
+    CHECK_EQ(usbd_ep_write(&udev, FWD_TXD_EP, data, FWD_SZ), FWD_SZ);
+    CHECK_EQ(usbd_ep_read(&udev, FWD_RXD_EP, pkt, sizeof(pkt)), FWD_SZ);
+    CHECK(memcmp(pkt, held, FWD_SZ) == 0);
+    pump();
+    CHECK_EQ(usb_sim_in(FWD_TXD_EP & 0x07, pkt, sizeof(pkt)), FWD_SZ);
+    CHECK(memcmp(pkt, data, FWD_SZ) == 0);
+    return TEST_DONE();
+}
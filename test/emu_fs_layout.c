@@ -0,0 +1,124 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMA layout planner of the usb_stmv0 and usb_stmv1 drivers on the emulated FS peripheral.
+ * Planned buffers keep their addresses, so reconfiguring one endpoint doesn't move it below
+ * the others and doesn't overlap them.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "stm32.h"
+#include "usb.h"
+#include "test.h"
+
+#define DBL_TXD_EP      0x81
+#define BLK_RXD_EP      0x02
+#define INT_TXD_EP      0x83
+#define BLK_SZ          0x40
+#define INT_SZ          0x08
+#define CYCLES          0x20
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+static const usbd_epcfg plan[] = {
+    {0x00,          USB_EPTYPE_CONTROL,                     64},
+    {DBL_TXD_EP,    USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF,    BLK_SZ},
+    {BLK_RXD_EP,    USB_EPTYPE_BULK,                        BLK_SZ},
+    {INT_TXD_EP,    USB_EPTYPE_INTERRUPT,                   INT_SZ},
+};
+
+#define PLAN_SZ     (USBD_PMA_TBLSZ + USBD_PMA_EPSZ(0x00, USB_EPTYPE_CONTROL, 64) +          \
+                     USBD_PMA_EPSZ(DBL_TXD_EP, USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF, BLK_SZ) + \
+                     USBD_PMA_EPSZ(BLK_RXD_EP, USB_EPTYPE_BULK, BLK_SZ) +                     \
+                     USBD_PMA_EPSZ(INT_TXD_EP, USB_EPTYPE_INTERRUPT, INT_SZ))
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+/* fills every endpoint buffer with its own data and checks that nothing was overwritten */
+static void check_buffers(uint8_t seed) {
+    uint8_t data[3][BLK_SZ], buf[BLK_SZ];
+    for (int i = 0; i < BLK_SZ; i++) {
+        data[0][i] = seed + i;
+        data[1][i] = seed ^ i;
+        data[2][i] = seed - i;
+    }
+    CHECK_EQ(usbd_ep_write(&udev, DBL_TXD_EP, data[0], BLK_SZ), BLK_SZ);
+    CHECK_EQ(usbd_ep_write(&udev, INT_TXD_EP, data[1], INT_SZ), INT_SZ);
+    CHECK_EQ(usb_sim_out(BLK_RXD_EP, data[2], BLK_SZ), BLK_SZ);
+    CHECK_EQ(usb_sim_in(DBL_TXD_EP & 0x07, buf, sizeof(buf)), BLK_SZ);
+    CHECK(memcmp(buf, data[0], BLK_SZ) == 0);
+    CHECK_EQ(usb_sim_in(INT_TXD_EP & 0x07, buf, sizeof(buf)), INT_SZ);
+    CHECK(memcmp(buf, data[1], INT_SZ) == 0);
+    CHECK_EQ(usbd_ep_read(&udev, BLK_RXD_EP, buf, sizeof(buf)), BLK_SZ);
+    CHECK(memcmp(buf, data[2], BLK_SZ) == 0);
+    pump();
+}
+
+int main(void) {
+    usbd_layout_report rep;
+
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    CHECK(udev.driver->caps & USBD_HW_LAYOUT);
+
+    CHECK(usbd_ep_layout(&udev, plan, 4, &rep));
+    CHECK_EQ(rep.ep, 0xFF);
+    CHECK_EQ(rep.size, USB_PMASIZE);
+    CHECK_EQ(rep.used, PLAN_SZ);
+    usb_sim_reset();
+    pump();
+    CHECK(usbd_ep_config(&udev, DBL_TXD_EP, USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF, BLK_SZ));
+    CHECK(usbd_ep_config(&udev, BLK_RXD_EP, USB_EPTYPE_BULK, BLK_SZ));
+    CHECK(usbd_ep_config(&udev, INT_TXD_EP, USB_EPTYPE_INTERRUPT, INT_SZ));
+    check_buffers(0);
+
+    /* planned buffers are reused. The runtime allocator moves each endpoint below the other
+     * one and runs out of PMA here */
+    for (int i = 1; i <= CYCLES; i++) {
+        usbd_ep_deconfig(&udev, DBL_TXD_EP);
+        CHECK(usbd_ep_config(&udev, DBL_TXD_EP, USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF, BLK_SZ));
+        usbd_ep_deconfig(&udev, BLK_RXD_EP);
+        CHECK(usbd_ep_config(&udev, BLK_RXD_EP, USB_EPTYPE_BULK, BLK_SZ));
+        check_buffers(i);
+    }
+
+    /* layout that doesn't fit is rejected and reports the first endpoint out of the memory */
+    usbd_epcfg big[] = {
+        {BLK_RXD_EP,    USB_EPTYPE_ISOCHRONUS,  1023},
+        {DBL_TXD_EP,    USB_EPTYPE_BULK,        BLK_SZ},
+    };
+    CHECK(!usbd_ep_layout(&udev, big, 2, &rep));
+    CHECK_EQ(rep.ep, BLK_RXD_EP);
+    CHECK(rep.used > rep.size);
+    /* endpoint planned twice */
+    big[0] = plan[1];
+    big[1] = plan[1];
+    CHECK(!usbd_ep_layout(&udev, big, 2, &rep));
+    CHECK_EQ(rep.ep, DBL_TXD_EP);
+
+    /* previous layout is kept */
+    usbd_ep_deconfig(&udev, BLK_RXD_EP);
+    CHECK(usbd_ep_config(&udev, BLK_RXD_EP, USB_EPTYPE_BULK, BLK_SZ));
+    check_buffers(0x55);
+    return TEST_DONE();
+}
@@ -0,0 +1,92 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Vectored endpoint reads and writes. Packets of every length are gathered from and
+ * scattered to three fragments with odd and zero lengths, so the partial PMA halfwords
+ * and FIFO words are carried across the fragment boundaries.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define IOV_RXD_EP      0x01
+#define IOV_TXD_EP      0x81
+#define IOV_SZ          0x40
+#define IOV_FILL        0xA5
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+/* splits len to three fragments. The middle one starts at a and ends at b */
+static void split(usbd_iovec *iov, uint8_t *buf, uint16_t len, uint16_t a, uint16_t b) {
+    iov[0].buf = buf;
+    iov[0].len = a;
+    iov[1].buf = buf + a;
+    iov[1].len = b - a;
+    iov[2].buf = buf + b;
+    iov[2].len = len - b;
+}
+
+static void check_packet(uint16_t len, uint16_t a, uint16_t b) {
+    uint8_t data[IOV_SZ], pkt[IOV_SZ + 4];
+    usbd_iovec iov[3];
+    for (int i = 0; i < len; i++) data[i] = (uint8_t)(len * 5 + a * 3 + b + i);
+
+    /* gathered IN packet */
+    split(iov, data, len, a, b);
+    CHECK_EQ(usbd_ep_writev(&udev, IOV_TXD_EP, iov, 3), len);
+    CHECK_EQ(usb_sim_in(IOV_TXD_EP & 0x07, pkt, sizeof(pkt)), len);
+    CHECK(memcmp(pkt, data, len) == 0);
+    pump();
+
+    /* scattered OUT packet. The last fragment takes the rest of the buffer */
+    memset(pkt, IOV_FILL, sizeof(pkt));
+    split(iov, pkt, IOV_SZ, a, b);
+    CHECK_EQ(usb_sim_out(IOV_RXD_EP, data, len), len);
+    pump();
+    CHECK_EQ(usbd_ep_readv(&udev, IOV_RXD_EP, iov, 3), len);
+    CHECK(memcmp(pkt, data, len) == 0);
+    for (unsigned i = len; i < sizeof(pkt); i++) CHECK_EQ(pkt[i], IOV_FILL);
+    pump();
+}
+
+int main(void) {
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+    CHECK(usbd_ep_config(&udev, IOV_RXD_EP, USB_EPTYPE_BULK, IOV_SZ));
+    CHECK(usbd_ep_config(&udev, IOV_TXD_EP, USB_EPTYPE_BULK, IOV_SZ));
+    pump();
+
+    for (uint16_t len = 0; len <= IOV_SZ; len++) {
+        for (uint16_t a = 0; a <= len; a += 3) {
+            for (uint16_t b = a; b <= len; b += 5) {
+                check_packet(len, a, b);
+            }
+        }
+    }
+    return TEST_DONE();
+}
@@ -0,0 +1,126 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Leased IN packet buffers. Packets of every length are assembled in place with
+ * usbd_epbuf_put and committed, the host should receive them as written. Lease is limited
+ * to the configured endpoint size, including EP0 and the endpoint reconfigured to the smaller
+ * size, unconfigured endpoints and oversized packets are refused. OTG driver has one staging
+ * buffer, so the other endpoint can't lease it until the packet is committed.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define LEASE_TXD_EP    0x81
+#define LEASE_SZ        0x40
+#define SMALL_TXD_EP    0x82
+#define SMALL_SZ        0x10
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+static void check_packet(uint16_t len) {
+    uint8_t data[LEASE_SZ + 1], pkt[LEASE_SZ];
+    usbd_epbuf epbuf;
+    for (int i = 0; i <= len; i++) data[i] = (uint8_t)(len * 7 + i);
+
+    CHECK_EQ(usbd_ep_write_begin(&udev, LEASE_TXD_EP, &epbuf), LEASE_SZ);
+    CHECK_EQ(epbuf.size, LEASE_SZ);
+    for (int i = 0; i < len; i += 2) {
+        usbd_epbuf_put(&epbuf, i, data[i] | (data[i + 1] << 8));
+    }
+    CHECK_EQ(usbd_ep_write_commit(&udev, LEASE_TXD_EP, len), len);
+    /* packet is not taken by the host yet, so there is no free buffer */
+    CHECK_EQ(usbd_ep_write_begin(&udev, LEASE_TXD_EP, &epbuf), -1);
+    CHECK_EQ(usb_sim_in(LEASE_TXD_EP & 0x07, pkt, sizeof(pkt)), len);
+    CHECK(memcmp(pkt, data, len) == 0);
+    pump();
+}
+
+int main(void) {
+    usbd_epbuf epbuf;
+    uint8_t pkt[LEASE_SZ];
+
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+    CHECK(usbd_ep_config(&udev, LEASE_TXD_EP, USB_EPTYPE_BULK, LEASE_SZ));
+    pump();
+
+    for (uint16_t len = 0; len <= LEASE_SZ; len++) {
+        check_packet(len);
+    }
+
+    /* packet larger than the lease is refused, the lease is kept */
+    CHECK_EQ(usbd_ep_write_begin(&udev, LEASE_TXD_EP, &epbuf), LEASE_SZ);
+    CHECK_EQ(usbd_ep_write_commit(&udev, LEASE_TXD_EP, LEASE_SZ + 1), -1);
+    CHECK_EQ(usbd_ep_write_commit(&udev, LEASE_TXD_EP, 4), 4);
+    CHECK_EQ(usb_sim_in(LEASE_TXD_EP & 0x07, pkt, sizeof(pkt)), 4);
+    pump();
+
+    /* unconfigured endpoint */
+    CHECK_EQ(usbd_ep_write_begin(&udev, SMALL_TXD_EP, &epbuf), -1);
+    /* endpoint keeps its larger buffer after reconfiguration, lease follows the new size */
+    CHECK(usbd_ep_config(&udev, SMALL_TXD_EP, USB_EPTYPE_BULK, LEASE_SZ));
+    usbd_ep_deconfig(&udev, SMALL_TXD_EP);
+    CHECK_EQ(usbd_ep_write_begin(&udev, SMALL_TXD_EP, &epbuf), -1);
+    CHECK(usbd_ep_config(&udev, SMALL_TXD_EP, USB_EPTYPE_INTERRUPT, SMALL_SZ));
+    pump();
+    CHECK_EQ(usbd_ep_write_begin(&udev, SMALL_TXD_EP, &epbuf), SMALL_SZ);
+    CHECK_EQ(epbuf.size, SMALL_SZ);
+    CHECK_EQ(usbd_ep_write_commit(&udev, SMALL_TXD_EP, SMALL_SZ + 2), -1);
+
+    /* the endpoint holding the lease can take it again */
+    CHECK_EQ(usbd_ep_write_begin(&udev, SMALL_TXD_EP, &epbuf), SMALL_SZ);
+#if defined(USE_STMV2_DRIVER)
+    CHECK_EQ(usbd_ep_write_begin(&udev, LEASE_TXD_EP, &epbuf), -1);
+    CHECK_EQ(usbd_ep_write_begin(&udev, 0x00, &epbuf), -1);
+#else
+    CHECK_EQ(usbd_ep_write_begin(&udev, LEASE_TXD_EP, &epbuf), LEASE_SZ);
+    CHECK_EQ(usbd_ep_write_commit(&udev, LEASE_TXD_EP, 0), 0);
+    CHECK_EQ(usb_sim_in(LEASE_TXD_EP & 0x07, pkt, sizeof(pkt)), 0);
+#endif
+    CHECK_EQ(usbd_ep_write_commit(&udev, SMALL_TXD_EP, SMALL_SZ), SMALL_SZ);
+    CHECK_EQ(usb_sim_in(SMALL_TXD_EP & 0x07, pkt, sizeof(pkt)), SMALL_SZ);
+    pump();
+    CHECK_EQ(usbd_ep_write_begin(&udev, LEASE_TXD_EP, &epbuf), LEASE_SZ);
+    CHECK_EQ(usbd_ep_write_commit(&udev, LEASE_TXD_EP, 0), 0);
+    CHECK_EQ(usb_sim_in(LEASE_TXD_EP & 0x07, pkt, sizeof(pkt)), 0);
+    pump();
+
+    /* EP0 lease is limited by its size and refused while the packet is pending */
+    CHECK_EQ(usbd_ep_write_begin(&udev, 0x80, &epbuf), 64);
+    CHECK_EQ(usbd_ep_write_commit(&udev, 0x80, 65), -1);
+    CHECK_EQ(usbd_ep_write_commit(&udev, 0x80, 8), 8);
+    CHECK_EQ(usbd_ep_write_begin(&udev, 0x80, &epbuf), -1);
+    CHECK_EQ(usb_sim_in(0, pkt, sizeof(pkt)), 8);
+    pump();
+    CHECK_EQ(usbd_ep_write_begin(&udev, 0x80, &epbuf), 64);
+    CHECK_EQ(usbd_ep_write_commit(&udev, 0x80, 0), 0);
+    CHECK_EQ(usb_sim_in(0, pkt, sizeof(pkt)), 0);
+    pump();
+    return TEST_DONE();
+}
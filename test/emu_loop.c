@@ -0,0 +1,146 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Bulk loopback through the C driver on the emulated FS peripheral. The device echoes
+ * every OUT packet to the IN endpoint the way the CDC demo does. Endpoints are
+ * double-buffered when LOOP_DBLBUF is defined.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define LOOP_RXD_EP     0x01
+#define LOOP_TXD_EP     0x82
+#define LOOP_SZ         0x40
+#define LOOP_BYTES      0x2000
+#define LOOP_RETRY      0x40
+
+#if defined(LOOP_DBLBUF)
+    #define LOOP_EPTYPE (USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF)
+#else
+    #define LOOP_EPTYPE USB_EPTYPE_BULK
+#endif
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static uint8_t fifo[0x200];
+static uint32_t fpos;
+
+static const struct usb_device_descriptor device_desc = {
+    .bLength            = sizeof(struct usb_device_descriptor),
+    .bDescriptorType    = USB_DTYPE_DEVICE,
+    .bcdUSB             = VERSION_BCD(2,0,0),
+    .bMaxPacketSize0    = 8,
+    .idVendor           = 0x0483,
+    .idProduct          = 0x5740,
+    .bNumConfigurations = 1,
+};
+
+static usbd_respond loop_getdesc(usbd_ctlreq *req, void **address, uint16_t *length) {
+    if ((req->wValue >> 8) != USB_DTYPE_DEVICE) return usbd_fail;
+    *address = (void*)&device_desc;
+    *length = sizeof(device_desc);
+    return usbd_ack;
+}
+
+static void loop_event(usbd_device *dev, uint8_t event, uint8_t ep) {
+    int32_t _t;
+    (void)ep;
+    if (event == usbd_evt_eptx) {
+        _t = usbd_ep_write(dev, LOOP_TXD_EP, fifo, (fpos < LOOP_SZ) ? fpos : LOOP_SZ);
+        if (_t > 0) {
+            memmove(&fifo[0], &fifo[_t], fpos - _t);
+            fpos -= _t;
+        }
+    }
+    if (fpos < (sizeof(fifo) - LOOP_SZ)) {
+        _t = usbd_ep_read(dev, LOOP_RXD_EP, &fifo[fpos], LOOP_SZ);
+        if (_t > 0) fpos += _t;
+    }
+}
+
+static usbd_respond loop_config(usbd_device *dev, uint8_t cfg) {
+    if (cfg != 1) return usbd_fail;
+    CHECK(usbd_ep_config(dev, LOOP_RXD_EP, LOOP_EPTYPE, LOOP_SZ));
+    CHECK(usbd_ep_config(dev, LOOP_TXD_EP, LOOP_EPTYPE, LOOP_SZ));
+    usbd_reg_endpoint(dev, LOOP_RXD_EP, loop_event);
+    usbd_reg_endpoint(dev, LOOP_TXD_EP, loop_event);
+    usbd_ep_write(dev, LOOP_TXD_EP, 0, 0);
+    return usbd_ack;
+}
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x100); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+int main(void) {
+    static uint8_t sent[LOOP_BYTES + LOOP_SZ], recv[LOOP_BYTES + LOOP_SZ];
+    uint32_t nsent = 0, nrecv = 0;
+    uint8_t pkt[LOOP_SZ];
+    int32_t res;
+
+    usbd_init(&udev, &usbd_hw, 8, ubuf, sizeof(ubuf));
+    usbd_reg_descr(&udev, loop_getdesc);
+    usbd_reg_config(&udev, loop_config);
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    usbd_ctlreq setcfg = {
+        .bmRequestType  = USB_REQ_STANDARD | USB_REQ_DEVICE,
+        .bRequest       = USB_STD_SET_CONFIG,
+        .wValue         = 1,
+    };
+    CHECK_EQ(usb_sim_control(&udev, &setcfg, 0), 0);
+    /* priming ZLP */
+    pump();
+    CHECK_EQ(usb_sim_in(LOOP_TXD_EP & 0x07, pkt, sizeof(pkt)), 0);
+
+    /* OUT packets of all lengths. IN packets are drained in bursts, so the device
+     * has to keep both directions busy and the IN endpoint is written while VALID.
+     */
+    for (uint32_t n = 0; nsent < LOOP_BYTES; n++) {
+        uint16_t len = 1 + (n * 7) % LOOP_SZ;
+        for (int i = 0; i < len; i++) sent[nsent + i] = (uint8_t)(nsent + i + n);
+        res = usb_sim_nak;
+        for (int i = 0; (res == usb_sim_nak) && (i < LOOP_RETRY); i++) {
+            res = usb_sim_out(LOOP_RXD_EP, &sent[nsent], len);
+            pump();
+            if ((res == usb_sim_nak) || (n % 3 == 0)) {
+                int32_t r = usb_sim_in(LOOP_TXD_EP & 0x07, &recv[nrecv], LOOP_SZ);
+                if (r > 0) nrecv += r;
+                CHECK(r != usb_sim_stall);
+                pump();
+            }
+        }
+        CHECK_EQ(res, len);
+        if (res != len) break;
+        nsent += len;
+    }
+    /* draining the loopback */
+    for (int i = 0; (nrecv < nsent) && (i < LOOP_RETRY * 0x10); i++) {
+        res = usb_sim_in(LOOP_TXD_EP & 0x07, &recv[nrecv], LOOP_SZ);
+        CHECK(res != usb_sim_stall);
+        if (res > 0) nrecv += res;
+        pump();
+    }
+    CHECK_EQ(nrecv, nsent);
+    CHECK(memcmp(sent, recv, nsent) == 0);
+    return TEST_DONE();
+}
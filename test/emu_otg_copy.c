@@ -0,0 +1,103 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* FIFO copy kernels of the usb_stmv2 driver on the emulated OTG FS core. Packets of every
+ * length are written from and read to buffers of every alignment, truncated reads don't
+ * touch the bytes beyond the buffer. Isochronous packets are larger than the RX staging
+ * buffer, so they are read from the RX FIFO directly.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define COPY_RXD_EP     0x01
+#define COPY_TXD_EP     0x81
+#define COPY_SZ         0x40
+#define ISO_RXD_EP      0x02
+#define ISO_SZ          0x80    /* larger than the RX staging buffer */
+#define COPY_FILL       0xA5
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+/* reads OUT packet to the unaligned buffer. blen is the buffer size */
+static void check_read(uint8_t ep, const uint8_t *data, uint16_t len, uint8_t ofs, uint16_t blen) {
+    uint32_t wbuf[(ISO_SZ + 8) / 4];
+    uint8_t *buf = (uint8_t*)wbuf + ofs;
+    memset(wbuf, COPY_FILL, sizeof(wbuf));
+    CHECK_EQ(usb_sim_out(ep, data, len), len);
+    pump();
+    /* reported length is the packet length even if the packet is truncated */
+    CHECK_EQ(usbd_ep_read(&udev, ep, buf, blen), len);
+    if (blen > len) blen = len;
+    CHECK(memcmp(buf, data, blen) == 0);
+    for (unsigned i = blen; i < sizeof(wbuf) - ofs; i++) CHECK_EQ(buf[i], COPY_FILL);
+    for (unsigned i = 0; i < ofs; i++) CHECK_EQ(((uint8_t*)wbuf)[i], COPY_FILL);
+    pump();
+}
+
+static void check_packet(uint16_t len, uint8_t ofs) {
+    uint32_t wbuf[(COPY_SZ + 8) / 4];
+    uint8_t *buf = (uint8_t*)wbuf + ofs;
+    uint8_t data[COPY_SZ], pkt[COPY_SZ + 8];
+    for (int i = 0; i < len; i++) data[i] = (uint8_t)(len * 3 + ofs + i);
+
+    /* IN packet from the unaligned buffer */
+    memcpy(buf, data, len);
+    CHECK_EQ(usbd_ep_write(&udev, COPY_TXD_EP, buf, len), len);
+    CHECK_EQ(usb_sim_in(COPY_TXD_EP & 0x07, pkt, sizeof(pkt)), len);
+    CHECK(memcmp(pkt, data, len) == 0);
+    pump();
+
+    /* OUT packet to the unaligned buffer, whole and truncated */
+    check_read(COPY_RXD_EP, data, len, ofs, COPY_SZ);
+    check_read(COPY_RXD_EP, data, len, ofs, len / 2 + ofs);
+}
+
+int main(void) {
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+    CHECK(usbd_ep_config(&udev, COPY_RXD_EP, USB_EPTYPE_BULK, COPY_SZ));
+    CHECK(usbd_ep_config(&udev, COPY_TXD_EP, USB_EPTYPE_BULK, COPY_SZ));
+    CHECK(usbd_ep_config(&udev, ISO_RXD_EP, USB_EPTYPE_ISOCHRONUS, ISO_SZ));
+    pump();
+
+    for (uint16_t len = 0; len <= COPY_SZ; len++) {
+        for (uint8_t ofs = 0; ofs < 4; ofs++) {
+            check_packet(len, ofs);
+        }
+    }
+    for (uint16_t len = COPY_SZ + 1; len <= ISO_SZ; len++) {
+        uint8_t data[ISO_SZ];
+        for (int i = 0; i < len; i++) data[i] = (uint8_t)(len * 5 + i);
+        for (uint8_t ofs = 0; ofs < 4; ofs++) {
+            check_read(ISO_RXD_EP, data, len, ofs, ISO_SZ);
+            check_read(ISO_RXD_EP, data, len, ofs, len / 2 + ofs);
+        }
+    }
+    return TEST_DONE();
+}
@@ -0,0 +1,108 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Endpoint interrupt dispatch of the usb_stmv2 driver on the emulated OTG FS core. TX
+ * completions of all IN endpoints are passed to the core by a single poll call, so the low
+ * endpoints can't starve the high ones.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define DISP_EPS        (USBD_HW_MAX_EP - 1)
+#define DISP_SZ         0x08
+#define DISP_RXD_EP     0x01
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static uint32_t ntx[USBD_HW_MAX_EP];
+static uint32_t nrx;
+
+static void ep_event(usbd_device *dev, uint8_t event, uint8_t ep) {
+    (void)dev;
+    if (event == usbd_evt_eptx) {
+        CHECK(ep & 0x80);
+        ntx[ep & 0x07]++;
+    } else if (event == usbd_evt_eprx) {
+        CHECK_EQ(ep, DISP_RXD_EP);
+        nrx++;
+    }
+}
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x100); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+int main(void) {
+    uint8_t data[DISP_SZ], buf[DISP_SZ];
+
+    for (int i = 0; i < DISP_SZ; i++) data[i] = 0x30 + i;
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+    for (int ep = 1; ep <= DISP_EPS; ep++) {
+        CHECK(usbd_ep_config(&udev, 0x80 | ep, USB_EPTYPE_INTERRUPT, DISP_SZ));
+        usbd_reg_endpoint(&udev, ep, ep_event);
+    }
+    CHECK(usbd_ep_config(&udev, DISP_RXD_EP, USB_EPTYPE_BULK, DISP_SZ));
+    pump();
+
+    /* all IN endpoints complete at once, a single poll passes every completion */
+    for (int ep = 1; ep <= DISP_EPS; ep++) {
+        data[0] = ep;
+        CHECK_EQ(usbd_ep_write(&udev, 0x80 | ep, data, DISP_SZ), DISP_SZ);
+    }
+    for (int ep = DISP_EPS; ep > 0; ep--) {
+        CHECK_EQ(usb_sim_in(ep, buf, sizeof(buf)), DISP_SZ);
+        CHECK_EQ(buf[0], ep);
+    }
+    CHECK(usb_sim_pending());
+    usbd_poll(&udev);
+    for (int ep = 1; ep <= DISP_EPS; ep++) CHECK_EQ(ntx[ep], 1);
+    pump();
+    for (int ep = 1; ep <= DISP_EPS; ep++) CHECK_EQ(ntx[ep], 1);
+
+    /* highest endpoint is served while EP1 completes on every poll */
+    memset(ntx, 0, sizeof(ntx));
+    CHECK_EQ(usbd_ep_write(&udev, 0x80 | DISP_EPS, data, DISP_SZ), DISP_SZ);
+    CHECK_EQ(usb_sim_in(DISP_EPS, buf, sizeof(buf)), DISP_SZ);
+    for (int i = 0; i < 4; i++) {
+        CHECK_EQ(usbd_ep_write(&udev, 0x81, data, DISP_SZ), DISP_SZ);
+        CHECK_EQ(usb_sim_in(1, buf, sizeof(buf)), DISP_SZ);
+        usbd_poll(&udev);
+        CHECK_EQ(ntx[1], i + 1);
+        CHECK_EQ(ntx[DISP_EPS], 1);
+    }
+
+    /* OUT transfers are rearmed after each packet */
+    for (int i = 0; i < 3; i++) {
+        data[0] = i;
+        CHECK_EQ(usb_sim_out(DISP_RXD_EP, data, DISP_SZ), DISP_SZ);
+        pump();
+        CHECK_EQ(nrx, i + 1);
+        CHECK_EQ(usbd_ep_read(&udev, DISP_RXD_EP, buf, sizeof(buf)), DISP_SZ);
+        CHECK_EQ(buf[0], i);
+        pump();
+    }
+    CHECK(!usb_sim_pending());
+    return TEST_DONE();
+}
@@ -0,0 +1,186 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* FIFO sizing and RX FIFO ordering of the usb_stmv2 driver on the emulated OTG FS core.
+ * Packets larger than the RX staging buffer stay in the shared RX FIFO until ep_read,
+ * so the packets of the other endpoints queue up behind them.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "stm32.h"
+#include "usb.h"
+#include "test.h"
+
+#define FIFO_RAM_SZ     320     /* shared FIFO RAM size in 32-bit words */
+#define ISO_RXD_EP      0x01
+#define ISO_SZ          0x80
+#define BLK_RXD_EP      0x02
+#define BLK_TXD_EP      0x82
+#define BLK_SZ          0x40
+#define INT_TXD_EP      0x83
+#define INT_SZ          0x08
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+static const struct usb_device_descriptor device_desc = {
+    .bLength            = sizeof(struct usb_device_descriptor),
+    .bDescriptorType    = USB_DTYPE_DEVICE,
+    .bcdUSB             = VERSION_BCD(2,0,0),
+    .bMaxPacketSize0    = 64,
+    .idVendor           = 0x0483,
+    .idProduct          = 0x5740,
+    .bNumConfigurations = 1,
+};
+
+static usbd_respond fifo_getdesc(usbd_ctlreq *req, void **address, uint16_t *length) {
+    if ((req->wValue >> 8) != USB_DTYPE_DEVICE) return usbd_fail;
+    *address = (void*)&device_desc;
+    *length = sizeof(device_desc);
+    return usbd_ack;
+}
+
+static usbd_respond fifo_config(usbd_device *dev, uint8_t cfg) {
+    if (cfg != 1) return usbd_fail;
+    CHECK(usbd_ep_config(dev, ISO_RXD_EP, USB_EPTYPE_ISOCHRONUS, ISO_SZ));
+    CHECK(usbd_ep_config(dev, BLK_RXD_EP, USB_EPTYPE_BULK, BLK_SZ));
+    CHECK(usbd_ep_config(dev, BLK_TXD_EP, USB_EPTYPE_BULK, BLK_SZ));
+    CHECK(usbd_ep_config(dev, INT_TXD_EP, USB_EPTYPE_INTERRUPT, INT_SZ));
+    return usbd_ack;
+}
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x100); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+/* FIFO start and depth in words */
+struct fifo {
+    uint16_t start;
+    uint16_t depth;
+};
+
+static struct fifo fifo_reg(uint32_t reg) {
+    struct fifo f = {reg & 0xFFFF, reg >> 16};
+    return f;
+}
+
+static void check_layout(void) {
+    USB_OTG_GlobalTypeDef *otg = (void*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_GLOBAL_BASE);
+    struct fifo f[4] = {
+        {0, otg->GRXFSIZ & 0xFFFF},
+        fifo_reg(otg->GNPTXFSIZ),
+        fifo_reg(otg->DIEPTXF[(BLK_TXD_EP & 0x07) - 1]),
+        fifo_reg(otg->DIEPTXF[(INT_TXD_EP & 0x07) - 1]),
+    };
+    /* RX FIFO takes the largest OUT packet with its status and the SETUP packets */
+    CHECK(f[0].depth >= (ISO_SZ / 4) + 1 + 10);
+    /* TX FIFOs take one packet at least */
+    CHECK(f[1].depth >= 64 / 4);
+    CHECK(f[2].depth >= BLK_SZ / 4);
+    CHECK(f[3].depth >= INT_SZ / 4);
+    for (int i = 0; i < 4; i++) {
+        CHECK(f[i].start + f[i].depth <= FIFO_RAM_SZ);
+        for (int j = i + 1; j < 4; j++) {
+            CHECK((f[i].start + f[i].depth <= f[j].start) ||
+                  (f[j].start + f[j].depth <= f[i].start));
+        }
+    }
+}
+
+static int32_t out(uint8_t ep, const void *buf, uint16_t len) {
+    int32_t res = usb_sim_out(ep, buf, len);
+    pump();
+    return res;
+}
+
+int main(void) {
+    struct usb_sim_stats st;
+    uint8_t iso[2][ISO_SZ], blk[2][BLK_SZ], buf[ISO_SZ];
+
+    for (int i = 0; i < ISO_SZ; i++) {
+        iso[0][i] = i;
+        iso[1][i] = ~i;
+    }
+    for (int i = 0; i < BLK_SZ; i++) {
+        blk[0][i] = 0x40 + i;
+        blk[1][i] = 0xC0 - i;
+    }
+
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_reg_descr(&udev, fifo_getdesc);
+    usbd_reg_config(&udev, fifo_config);
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    usbd_ctlreq setcfg = {
+        .bmRequestType  = USB_REQ_STANDARD | USB_REQ_DEVICE,
+        .bRequest       = USB_STD_SET_CONFIG,
+        .wValue         = 1,
+    };
+    CHECK_EQ(usb_sim_control(&udev, &setcfg, 0), 0);
+    check_layout();
+
+    /* the large packet stays at the RX FIFO head. RXFLVL is masked until it is read,
+     * so nothing is pending for the poll routine
+     */
+    CHECK_EQ(out(ISO_RXD_EP, iso[0], ISO_SZ), ISO_SZ);
+    CHECK(!usb_sim_pending());
+    CHECK_EQ(out(BLK_RXD_EP, blk[0], BLK_SZ), BLK_SZ);
+    CHECK(!usb_sim_pending());
+    /* bulk packet is queued behind the isochronous one */
+    CHECK_EQ(usbd_ep_read(&udev, BLK_RXD_EP, buf, sizeof(buf)), -1);
+    CHECK_EQ(usbd_ep_read(&udev, ISO_RXD_EP, buf, sizeof(buf)), ISO_SZ);
+    CHECK(memcmp(buf, iso[0], ISO_SZ) == 0);
+    pump();
+    CHECK_EQ(usbd_ep_read(&udev, BLK_RXD_EP, buf, sizeof(buf)), BLK_SZ);
+    CHECK(memcmp(buf, blk[0], BLK_SZ) == 0);
+
+    /* staged bulk packet doesn't block the isochronous one behind it */
+    CHECK_EQ(out(BLK_RXD_EP, blk[1], BLK_SZ), BLK_SZ);
+    CHECK_EQ(out(ISO_RXD_EP, iso[1], ISO_SZ), ISO_SZ);
+    CHECK(!usb_sim_pending());
+    CHECK_EQ(usbd_ep_read(&udev, ISO_RXD_EP, buf, sizeof(buf)), ISO_SZ);
+    CHECK(memcmp(buf, iso[1], ISO_SZ) == 0);
+    CHECK_EQ(usbd_ep_read(&udev, BLK_RXD_EP, buf, sizeof(buf)), BLK_SZ);
+    CHECK(memcmp(buf, blk[1], BLK_SZ) == 0);
+    pump();
+    CHECK_EQ(usbd_ep_read(&udev, BLK_RXD_EP, buf, sizeof(buf)), -1);
+    CHECK_EQ(usbd_ep_read(&udev, ISO_RXD_EP, buf, sizeof(buf)), -1);
+
+    /* truncated reads report the packet length whether the packet is staged or not */
+    memset(buf, 0, sizeof(buf));
+    CHECK_EQ(out(BLK_RXD_EP, blk[0], BLK_SZ), BLK_SZ);
+    CHECK_EQ(out(ISO_RXD_EP, iso[0], ISO_SZ), ISO_SZ);
+    CHECK_EQ(usbd_ep_read(&udev, ISO_RXD_EP, buf, 12), ISO_SZ);
+    CHECK(memcmp(buf, iso[0], 12) == 0);
+    CHECK_EQ(buf[12], 0);
+    CHECK_EQ(usbd_ep_read(&udev, BLK_RXD_EP, buf, 12), BLK_SZ);
+    CHECK(memcmp(buf, blk[0], 12) == 0);
+    CHECK_EQ(buf[12], 0);
+    pump();
+
+    /* a reset reapplies the same layout */
+    usb_sim_reset();
+    CHECK_EQ(usb_sim_control(&udev, &setcfg, 0), 0);
+    check_layout();
+
+    usb_sim_get_stats(&st, false);
+    CHECK_EQ(st.fifo_errors, 0);
+    return TEST_DONE();
+}
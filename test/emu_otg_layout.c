@@ -0,0 +1,123 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* FIFO layout planner of the usb_stmv2 driver on the emulated OTG FS core. The planned FIFOs
+ * are packed back to back after the bus reset, a layout that doesn't fit keeps the previous
+ * one.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "stm32.h"
+#include "usb.h"
+#include "test.h"
+
+#define FIFO_RAM_SZ     320     /* shared FIFO RAM size in 32-bit words */
+#define DBL_TXD_EP      0x81
+#define BLK_RXD_EP      0x01
+#define INT_TXD_EP      0x82
+#define BLK_SZ          0x40
+#define INT_SZ          0x08
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static USB_OTG_GlobalTypeDef * const otg = (void*)(USB_OTG_FS_PERIPH_BASE + USB_OTG_GLOBAL_BASE);
+
+static const usbd_epcfg plan[] = {
+    {0x00,          USB_EPTYPE_CONTROL,                     64},
+    {DBL_TXD_EP,    USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF,    BLK_SZ},
+    {BLK_RXD_EP,    USB_EPTYPE_BULK,                        BLK_SZ},
+    {INT_TXD_EP,    USB_EPTYPE_INTERRUPT,                   INT_SZ},
+};
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x100); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+static void configure(void) {
+    usb_sim_reset();
+    pump();
+    CHECK(usbd_ep_config(&udev, DBL_TXD_EP, USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF, BLK_SZ));
+    CHECK(usbd_ep_config(&udev, BLK_RXD_EP, USB_EPTYPE_BULK, BLK_SZ));
+    CHECK(usbd_ep_config(&udev, INT_TXD_EP, USB_EPTYPE_INTERRUPT, INT_SZ));
+    /* model applies the plain FIFO size writes on the next access with side effects */
+    CHECK(!usb_sim_pending());
+}
+
+/* RX FIFO: SETUP packets, one 64-byte packet with its status word, completion words of
+ * EP0 and EP1 OUT and the global OUT NAK word
+ */
+#define PLAN_RX     ((4 + 6) + (BLK_SZ / 4 + 1) + (2 * 2) + 1)
+
+static void check_plan(void) {
+    CHECK_EQ(otg->GRXFSIZ, PLAN_RX);
+    CHECK_EQ(otg->GNPTXFSIZ, PLAN_RX | (0x10 << 16));
+    /* doublebuffered endpoint takes two packets */
+    CHECK_EQ(otg->DIEPTXF[0], (PLAN_RX + 0x10) | ((2 * BLK_SZ / 4) << 16));
+    /* interrupt endpoint FIFO is 16 words minimum */
+    CHECK_EQ(otg->DIEPTXF[1], (PLAN_RX + 0x10 + 2 * BLK_SZ / 4) | (0x10 << 16));
+}
+
+int main(void) {
+    usbd_layout_report rep;
+    uint8_t data[2][BLK_SZ], buf[BLK_SZ];
+
+    for (int i = 0; i < BLK_SZ; i++) {
+        data[0][i] = i;
+        data[1][i] = ~i;
+    }
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    CHECK(udev.driver->caps & USBD_HW_LAYOUT);
+
+    /* layout fits and is applied by the bus reset */
+    CHECK(usbd_ep_layout(&udev, plan, 4, &rep));
+    CHECK_EQ(rep.ep, 0xFF);
+    CHECK_EQ(rep.size, FIFO_RAM_SZ * 4);
+    CHECK_EQ(rep.used, (PLAN_RX + 0x10 + 2 * BLK_SZ / 4 + 0x10) * 4);
+    configure();
+    check_plan();
+
+    /* both packets of the doublebuffered endpoint fit its FIFO */
+    CHECK_EQ(usbd_ep_write(&udev, DBL_TXD_EP, data, 2 * BLK_SZ), 2 * BLK_SZ);
+    for (int i = 0; i < 2; i++) {
+        CHECK_EQ(usb_sim_in(DBL_TXD_EP & 0x07, buf, sizeof(buf)), BLK_SZ);
+        CHECK(memcmp(buf, data[i], BLK_SZ) == 0);
+    }
+    pump();
+
+    /* layout that doesn't fit is rejected and reports the first FIFO out of the memory */
+    usbd_epcfg big[] = {
+        {DBL_TXD_EP,    USB_EPTYPE_ISOCHRONUS,  1023},
+        {INT_TXD_EP,    USB_EPTYPE_INTERRUPT,   INT_SZ},
+    };
+    CHECK(!usbd_ep_layout(&udev, big, 2, &rep));
+    CHECK_EQ(rep.ep, DBL_TXD_EP);
+    CHECK(rep.used > rep.size);
+    /* endpoint beyond the hardware */
+    big[0].ep = 0x80 | USBD_HW_MAX_EP;
+    big[0].epsize = INT_SZ;
+    CHECK(!usbd_ep_layout(&udev, big, 2, 0));
+    CHECK(!usbd_ep_layout(&udev, big, 2, &rep));
+    CHECK_EQ(rep.ep, 0x80 | USBD_HW_MAX_EP);
+    /* previous layout is kept */
+    configure();
+    check_plan();
+    return TEST_DONE();
+}
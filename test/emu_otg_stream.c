@@ -0,0 +1,124 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* IN streams of the usb_stmv2 driver on the emulated OTG FS core. The driver tops up the TX
+ * FIFO from the application buffer on TX FIFO half empty interrupts, so the next packet is
+ * queued while the previous one is sent, and the endpoint gets a single TX event when the whole
+ * stream is sent.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define STRM_TXD_EP     0x81
+#define STRM_SZ         0x40
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static uint8_t data[1000];
+static uint32_t ntx, ndone;
+
+static void tx_event(usbd_device *dev, uint8_t event, uint8_t ep) {
+    (void)dev;
+    CHECK_EQ(ep, STRM_TXD_EP);
+    if (event == usbd_evt_eptx) ntx++;
+}
+
+static void xfer_done(usbd_device *dev, uint8_t ep, usbd_xfer *xfer) {
+    (void)dev;
+    CHECK_EQ(ep, STRM_TXD_EP);
+    CHECK_EQ(xfer->count, sizeof(data));
+    ndone++;
+}
+
+/* reads IN packets until the short one or the whole length */
+static int32_t host_read(uint8_t *buf, uint16_t blen) {
+    int32_t res, cnt = 0;
+    for (int i = 0; (i < 0x100) && (cnt < blen); i++) {
+        res = usb_sim_in(STRM_TXD_EP & 0x07, &buf[cnt], blen - cnt);
+        for (int j = 0; usb_sim_pending() && (j < 0x10); j++) usbd_poll(&udev);
+        if (res == usb_sim_nak) continue;
+        if (res < 0) return res;
+        cnt += res;
+        if (res < STRM_SZ) break;
+    }
+    return cnt;
+}
+
+int main(void) {
+    static uint8_t buf[sizeof(data)];
+    usbd_xfer xfer = {
+        .buf        = data,
+        .len        = sizeof(data),
+        .mps        = STRM_SZ,
+        .complete   = xfer_done,
+    };
+
+    for (unsigned i = 0; i < sizeof(data); i++) data[i] = (uint8_t)(i * 7 + (i >> 8));
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) usbd_poll(&udev);
+    CHECK(usbd_ep_config(&udev, STRM_TXD_EP, USB_EPTYPE_BULK, STRM_SZ));
+    usbd_reg_endpoint(&udev, STRM_TXD_EP, tx_event);
+    CHECK(!usb_sim_pending());
+    CHECK(udev.driver->caps & USBD_HW_STREAM);
+
+    /* whole buffer is sent with a single TX event */
+    CHECK_EQ(usbd_ep_stream(&udev, STRM_TXD_EP, data, sizeof(data)), sizeof(data));
+    /* endpoint is busy until the stream is sent */
+    CHECK_EQ(usbd_ep_stream(&udev, STRM_TXD_EP, data, sizeof(data)), -1);
+    CHECK_EQ(host_read(buf, sizeof(buf)), sizeof(data));
+    CHECK(memcmp(buf, data, sizeof(data)) == 0);
+    CHECK_EQ(ntx, 1);
+
+    /* stream of whole packets has no short packet at the end */
+    ntx = 0;
+    CHECK_EQ(usbd_ep_stream(&udev, STRM_TXD_EP, data, 4 * STRM_SZ), 4 * STRM_SZ);
+    CHECK_EQ(host_read(buf, 4 * STRM_SZ), 4 * STRM_SZ);
+    CHECK(memcmp(buf, data, 4 * STRM_SZ) == 0);
+    CHECK_EQ(ntx, 1);
+    CHECK_EQ(usb_sim_in(STRM_TXD_EP & 0x07, buf, STRM_SZ), usb_sim_nak);
+
+    /* FIFO is refilled when one of two packets is taken, so two packets are ready after poll */
+    ntx = 0;
+    CHECK_EQ(usbd_ep_stream(&udev, STRM_TXD_EP, data, 12 * STRM_SZ), 12 * STRM_SZ);
+    for (int i = 0; i < 12; i += 3) {
+        CHECK_EQ(usb_sim_in(STRM_TXD_EP & 0x07, &buf[i * STRM_SZ], STRM_SZ), STRM_SZ);
+        usbd_poll(&udev);
+        CHECK_EQ(usb_sim_in(STRM_TXD_EP & 0x07, &buf[(i + 1) * STRM_SZ], STRM_SZ), STRM_SZ);
+        CHECK_EQ(usb_sim_in(STRM_TXD_EP & 0x07, &buf[(i + 2) * STRM_SZ], STRM_SZ), STRM_SZ);
+        for (int j = 0; usb_sim_pending() && (j < 0x10); j++) usbd_poll(&udev);
+    }
+    CHECK(memcmp(buf, data, 12 * STRM_SZ) == 0);
+    CHECK_EQ(ntx, 1);
+
+    /* transfers are streamed by the core */
+    ntx = 0;
+    CHECK(usbd_ep_submit(&udev, STRM_TXD_EP, &xfer));
+    CHECK_EQ(host_read(buf, sizeof(buf)), sizeof(data));
+    CHECK(memcmp(buf, data, sizeof(data)) == 0);
+    CHECK_EQ(ndone, 1);
+    CHECK_EQ(ntx, 0);
+
+    /* empty stream and control endpoint are refused */
+    CHECK_EQ(usbd_ep_stream(&udev, STRM_TXD_EP, data, 0), -1);
+    CHECK_EQ(usbd_ep_stream(&udev, 0x80, data, 8), -1);
+    return TEST_DONE();
+}
@@ -0,0 +1,90 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* IN writes of the usb_stmv2 driver on the emulated OTG FS core. Multi-packet writes that
+ * don't fit the TX FIFO are cut to whole packets, writes to an unconfigured endpoint fail.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define WR_TXD_EP       0x81
+#define WR_SZ           0x40
+#define WR_NONE_EP      0x84
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+/* reads IN packets until the short one or the whole length */
+static int32_t host_read(uint8_t *buf, uint16_t blen) {
+    int32_t res, cnt = 0;
+    for (int i = 0; (i < 0x40) && (cnt < blen); i++) {
+        res = usb_sim_in(WR_TXD_EP & 0x07, &buf[cnt], blen - cnt);
+        if (usb_sim_pending()) usbd_poll(&udev);
+        if (res == usb_sim_nak) continue;
+        if (res < 0) return res;
+        cnt += res;
+        if (res < WR_SZ) break;
+    }
+    return cnt;
+}
+
+int main(void) {
+    uint8_t data[200], buf[sizeof(data)];
+    int32_t len;
+
+    for (unsigned i = 0; i < sizeof(data); i++) data[i] = i * 3;
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) usbd_poll(&udev);
+    CHECK(usbd_ep_config(&udev, WR_TXD_EP, USB_EPTYPE_BULK, WR_SZ));
+    /* model applies the plain FIFO size writes on the next access with side effects */
+    CHECK(!usb_sim_pending());
+
+    /* odd fragments are cut to the packets that fit the TX FIFO and sent in order */
+    usbd_iovec iov[3] = {
+        {&data[0], 13},
+        {&data[13], 100},
+        {&data[113], sizeof(data) - 113},
+    };
+    len = usbd_ep_writev(&udev, WR_TXD_EP, iov, 3);
+    CHECK(len > 0);
+    CHECK_EQ(len % WR_SZ, 0);
+    CHECK_EQ(host_read(buf, len), len);
+    CHECK(memcmp(buf, data, len) == 0);
+    /* plain write of the same length is cut the same way */
+    CHECK_EQ(usbd_ep_write(&udev, WR_TXD_EP, data, sizeof(data)), len);
+    CHECK_EQ(host_read(buf, len), len);
+    CHECK(memcmp(buf, data, len) == 0);
+    /* the rest fits the FIFO of two packets */
+    usbd_iovec tail = {&data[len], sizeof(data) - len};
+    int32_t rest = sizeof(data) - len;
+    CHECK(rest <= 2 * WR_SZ);
+    CHECK_EQ(usbd_ep_writev(&udev, WR_TXD_EP, &tail, 1), rest);
+    CHECK_EQ(host_read(buf, rest), rest);
+    CHECK(memcmp(buf, &data[len], rest) == 0);
+
+    /* unconfigured endpoint has no max packet size */
+    iov[0].len = 13;
+    CHECK_EQ(usbd_ep_write(&udev, WR_NONE_EP, data, 13), -1);
+    CHECK_EQ(usbd_ep_writev(&udev, WR_NONE_EP, iov, 1), -1);
+    CHECK_EQ(usbd_ep_stream(&udev, WR_NONE_EP, data, 13), -1);
+    return TEST_DONE();
+}
@@ -0,0 +1,117 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* PMA copy paths of the usb_stmv0 and usb_stmv1 drivers on the emulated FS peripheral.
+ * Every packet length up to the endpoint size is written and read with the RAM buffer
+ * at every alignment and split into two fragments at every offset. RX buffers above 62 bytes
+ * take whole 32-byte blocks.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define PMA_RXD_EP      0x01
+#define PMA_TXD_EP      0x81
+#define PMA_SZ          0x40
+#define PMA_FILL        0xA5
+#define PMA_ISO_EP      0x02
+#define PMA_ISO_SZ      72      /* not a multiple of the 32-byte block */
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+static uint8_t pattern(uint32_t seed, uint32_t i) {
+    return (uint8_t)(seed * 13 + i * 7 + 1);
+}
+
+/* ep_writev with the source fragments at RAM offset align split at split */
+static void check_write(uint16_t len, uint8_t align, uint16_t split) {
+    uint32_t src[(PMA_SZ + 8) / 4];
+    uint8_t *data = (uint8_t*)src + align;
+    uint8_t pkt[PMA_SZ];
+    uint32_t seed = (len << 8) | (align << 6) | split;
+    for (int i = 0; i < len; i++) data[i] = pattern(seed, i);
+    usbd_iovec iov[2] = {
+        {data, split},
+        {data + split, len - split},
+    };
+    CHECK_EQ(usbd_ep_writev(&udev, PMA_TXD_EP, iov, 2), len);
+    CHECK_EQ(usb_sim_in(PMA_TXD_EP & 0x07, pkt, sizeof(pkt)), len);
+    CHECK(memcmp(pkt, data, len) == 0);
+    pump();
+}
+
+/* ep_readv into RAM offset align split at split. Bytes out of the packet are untouched */
+static void check_read(uint16_t len, uint8_t align, uint16_t split) {
+    uint32_t dst[(PMA_SZ + 8) / 4];
+    uint8_t *buf = (uint8_t*)dst;
+    uint8_t pkt[PMA_SZ];
+    uint32_t seed = (len << 8) | (align << 6) | split | 0x80000;
+    for (int i = 0; i < len; i++) pkt[i] = pattern(seed, i);
+    memset(buf, PMA_FILL, sizeof(dst));
+    usbd_iovec iov[2] = {
+        {buf + align, split},
+        {buf + align + split, PMA_SZ - split},
+    };
+    CHECK_EQ(usb_sim_out(PMA_RXD_EP, pkt, len), len);
+    CHECK_EQ(usbd_ep_readv(&udev, PMA_RXD_EP, iov, 2), len);
+    CHECK(memcmp(buf + align, pkt, len) == 0);
+    for (unsigned i = 0; i < sizeof(dst); i++) {
+        if ((i >= align) && (i < align + len)) continue;
+        CHECK_EQ(buf[i], PMA_FILL);
+    }
+    pump();
+}
+
+int main(void) {
+    usbd_init(&udev, &usbd_hw, 8, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+    CHECK(usbd_ep_config(&udev, PMA_RXD_EP, USB_EPTYPE_BULK, PMA_SZ));
+    CHECK(usbd_ep_config(&udev, PMA_TXD_EP, USB_EPTYPE_BULK, PMA_SZ));
+
+    for (uint16_t len = 0; len <= PMA_SZ; len++) {
+        for (uint8_t align = 0; align < 4; align++) {
+            for (uint16_t split = 0; split <= len; split++) {
+                check_write(len, align, split);
+                check_read(len, align, split);
+            }
+        }
+    }
+
+    /* RX count takes the number of blocks that holds the endpoint size, so both buffers of
+     * the isochronous endpoint take the whole packet */
+    uint8_t pkt[2][PMA_ISO_SZ], buf[PMA_ISO_SZ + 4];
+    CHECK(usbd_ep_config(&udev, PMA_ISO_EP, USB_EPTYPE_ISOCHRONUS, PMA_ISO_SZ));
+    for (int n = 0; n < 2; n++) {
+        for (int i = 0; i < PMA_ISO_SZ; i++) pkt[n][i] = pattern(n, i);
+        CHECK_EQ(usb_sim_out(PMA_ISO_EP, pkt[n], PMA_ISO_SZ), PMA_ISO_SZ);
+    }
+    CHECK_EQ(usbd_ep_read(&udev, PMA_ISO_EP, buf, sizeof(buf)), PMA_ISO_SZ);
+    CHECK((memcmp(buf, pkt[0], PMA_ISO_SZ) == 0) || (memcmp(buf, pkt[1], PMA_ISO_SZ) == 0));
+    pump();
+    return TEST_DONE();
+}
@@ -0,0 +1,135 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* OUT endpoint receive rings. Packets are drained to the ring by the poll routine, so the
+ * host can send several packets before the application reads any. A packet that doesn't
+ * fit is held by the endpoint until the application reads the ring and sets it again.
+ * Endpoint is double-buffered when RING_DBLBUF is defined.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define RING_RXD_EP     0x01
+#define RING_SZ         0x40
+#define RING_BUFSZ      0x100
+#define RING_RETRY      0x10
+
+#if defined(RING_DBLBUF)
+    #define RING_EPTYPE (USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF)
+#else
+    #define RING_EPTYPE USB_EPTYPE_BULK
+#endif
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static usbd_rxring ring;
+static uint8_t ring_buf[RING_BUFSZ];
+static uint32_t sent, recv;
+
+static void pump(void) {
+    for (int i = 0; usb_sim_pending() && (i < 0x10); i++) {
+        usbd_poll(&udev);
+    }
+}
+
+static uint8_t stream_byte(uint32_t pos) {
+    return (uint8_t)(pos ^ (pos >> 8) ^ 0x5A);
+}
+
+/* sends the next part of the stream. returns host transaction result */
+static int32_t send(uint16_t len) {
+    uint8_t pkt[RING_SZ];
+    int32_t res;
+    for (int i = 0; i < len; i++) pkt[i] = stream_byte(sent + i);
+    res = usb_sim_out(RING_RXD_EP, pkt, len);
+    if (res >= 0) {
+        CHECK_EQ(res, len);
+        sent += len;
+    }
+    pump();
+    return res;
+}
+
+/* reads the ring and checks the stream. returns number of bytes read */
+static uint16_t receive(uint16_t blen) {
+    uint8_t buf[RING_BUFSZ];
+    uint16_t cnt = usbd_rxring_read(&ring, buf, blen);
+    for (int i = 0; i < cnt; i++) {
+        if (buf[i] != stream_byte(recv + i)) {
+            CHECK_EQ(buf[i], stream_byte(recv + i));
+            break;
+        }
+    }
+    recv += cnt;
+    return cnt;
+}
+
+int main(void) {
+    usbd_init(&udev, &usbd_hw, 64, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    pump();
+    CHECK(usbd_ep_config(&udev, RING_RXD_EP, RING_EPTYPE, RING_SZ));
+    pump();
+    usbd_rxring_init(&ring, ring_buf, sizeof(ring_buf));
+    CHECK(usbd_ep_setring(&udev, RING_RXD_EP, &ring));
+
+    /* packets are taken without waiting for the application */
+    for (int i = 0; i < 3; i++) CHECK_EQ(send(RING_SZ), RING_SZ);
+    CHECK_EQ(ring.head, 3 * RING_SZ);
+    CHECK_EQ(ring.full, 0);
+    CHECK_EQ(receive(RING_BUFSZ), 3 * RING_SZ);
+    CHECK_EQ(receive(RING_BUFSZ), 0);
+
+    /* data wraps around the ring end */
+    CHECK_EQ(send(50), 50);
+    CHECK_EQ(send(RING_SZ), RING_SZ);
+    CHECK_EQ(send(7), 7);
+    CHECK_EQ(receive(RING_BUFSZ), 50 + RING_SZ + 7);
+
+    /* backpressure. host sees NAK when the ring and the endpoint buffers are full */
+    for (int i = 0; (i < RING_RETRY) && (send(RING_SZ) >= 0); i++);
+    CHECK_EQ(ring.full, 1);
+    CHECK(sent - recv > RING_BUFSZ);
+    CHECK(sent - recv <= RING_BUFSZ + 3 * RING_SZ);
+    /* held packets are drained after the application frees the ring */
+    for (int i = 0; (i < RING_RETRY) && (recv < sent); i++) {
+        receive(RING_SZ);
+        CHECK(usbd_ep_setring(&udev, RING_RXD_EP, &ring));
+        pump();
+    }
+    CHECK_EQ(recv, sent);
+    CHECK_EQ(ring.full, 0);
+
+    /* endpoint accepts packets again */
+    CHECK_EQ(send(RING_SZ), RING_SZ);
+    CHECK_EQ(receive(RING_BUFSZ), RING_SZ);
+
+    /* removed ring leaves packets to the endpoint */
+    CHECK(usbd_ep_setring(&udev, RING_RXD_EP, 0));
+    CHECK_EQ(send(9), 9);
+    CHECK_EQ(ring.head - ring.tail, 0);
+    {
+        uint8_t buf[RING_SZ];
+        CHECK_EQ(usbd_ep_read(&udev, RING_RXD_EP, buf, sizeof(buf)), 9);
+        for (int i = 0; i < 9; i++) CHECK_EQ(buf[i], stream_byte(recv + i));
+    }
+    return TEST_DONE();
+}
@@ -0,0 +1,192 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Platform descriptors on the simulated driver. BOS descriptor is returned on GET_DESCRIPTOR
+ * and clamped to wLength, MS OS 2.0 descriptor set and WebUSB URLs are returned on the vendor
+ * requests with the codes of the platform capabilities. URL index 0 and indexes above the
+ * URL count, wrong codes and host to device requests are stalled.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "inc/usb_msos.h"
+#include "inc/usb_webusb.h"
+#include "test.h"
+
+#define MSOS_CODE       0x21
+#define WEBUSB_CODE     0x22
+#define APP_CODE        0x23    /* vendor request processed by the control callback */
+
+struct bos_desc {
+    struct usb_bos_descriptor       bos;
+    struct usb_msos20_descriptor    msos;
+    struct usb_webusb_descriptor    webusb;
+} __attribute__((packed));
+
+struct msos_desc {
+    struct usb_msos20_set_descriptor    set;
+    struct usb_msos20_compat_descriptor compat;
+    struct usb_msos20_guids_descriptor  guids;
+} __attribute__((packed));
+
+static const struct msos_desc msos_desc = {
+    .set = {
+        .wLength            = sizeof(struct usb_msos20_set_descriptor),
+        .wDescriptorType    = USB_MSOS20_SET_HEADER,
+        .dwWindowsVersion   = USB_MSOS20_WINVER_8_1,
+        .wTotalLength       = sizeof(struct msos_desc),
+    },
+    .compat = USB_MSOS20_WINUSB_DESC,
+    .guids  = USB_MSOS20_GUIDS_DESC("{8FE6D4D7-49DD-41E7-9486-49AFC6BFE475}"),
+};
+
+static const struct bos_desc bos_desc = {
+    .bos = {
+        .bLength            = sizeof(struct usb_bos_descriptor),
+        .bDescriptorType    = USB_DTYPE_BOS,
+        .wTotalLength       = sizeof(struct bos_desc),
+        .bNumDeviceCaps     = 2,
+    },
+    .msos = {
+        .bLength            = sizeof(struct usb_msos20_descriptor),
+        .bDescriptorType    = USB_DTYPE_DEVICE_CAP,
+        .bDevCapabilityType = USB_DCAP_PLATFORM,
+        .PlatformCapabilityUUID = USB_MSOS20_UUID,
+        .dwWindowsVersion   = USB_MSOS20_WINVER_8_1,
+        .wMSOSDescriptorSetTotalLength = sizeof(struct msos_desc),
+        .bMS_VendorCode     = MSOS_CODE,
+    },
+    .webusb = {
+        .bLength            = sizeof(struct usb_webusb_descriptor),
+        .bDescriptorType    = USB_DTYPE_DEVICE_CAP,
+        .bDevCapabilityType = USB_DCAP_PLATFORM,
+        .PlatformCapabilityUUID = USB_WEBUSB_UUID,
+        .bcdVersion         = VERSION_BCD(1,0,0),
+        .bVendorCode        = WEBUSB_CODE,
+        .iLandingPage       = 1,
+    },
+};
+
+static const struct usb_webusb_url_descriptor url_1 =
+    USB_WEBUSB_URL_DESC(USB_WEBUSB_SCHEME_HTTPS, "github.com/dmitrystu/libusb_stm32");
+static const struct usb_webusb_url_descriptor url_2 =
+    USB_WEBUSB_URL_DESC(USB_WEBUSB_SCHEME_HTTP, "localhost");
+static const struct usb_webusb_url_descriptor *const urls[] = {&url_1, &url_2};
+
+static const usbd_bos platform = {
+    .bos            = &bos_desc.bos,
+    .msos20         = &msos_desc.set,
+    .url            = urls,
+    .url_count      = 2,
+    .msos20_code    = MSOS_CODE,
+    .webusb_code    = WEBUSB_CODE,
+};
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static const uint8_t app_data[4] = {'A', 'P', 'P', '!'};
+
+static usbd_respond app_control(usbd_device *dev, usbd_ctlreq *req, usbd_rqc_callback *callback) {
+    (void)callback;
+    if ((req->bmRequestType & USB_REQ_TYPE) != USB_REQ_VENDOR) return usbd_fail;
+    /* own request and the URL 2 override */
+    if ((req->bRequest != APP_CODE) &&
+        !((req->bRequest == WEBUSB_CODE) && (req->wValue == 2))) return usbd_fail;
+    dev->status.data_ptr = (void*)app_data;
+    dev->status.data_count = sizeof(app_data);
+    return usbd_ack;
+}
+
+static int32_t control(uint8_t type, uint8_t req, uint16_t value, uint16_t index,
+                       uint16_t length, void *data) {
+    usbd_ctlreq rq = {
+        .bmRequestType  = type,
+        .bRequest       = req,
+        .wValue         = value,
+        .wIndex         = index,
+        .wLength        = length,
+    };
+    return usb_sim_control(&udev, &rq, data);
+}
+
+#define STD_IN      (USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_DEVICE)
+#define VND_IN      (USB_REQ_DEVTOHOST | USB_REQ_VENDOR | USB_REQ_DEVICE)
+#define VND_OUT     (USB_REQ_HOSTTODEV | USB_REQ_VENDOR | USB_REQ_DEVICE)
+
+int main(void) {
+    uint8_t buf[0x100];
+
+    usbd_init(&udev, &usbd_hw, 8, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    usbd_poll(&udev);
+
+    /* nothing is served until registered */
+    CHECK(control(STD_IN, USB_STD_GET_DESCRIPTOR, USB_DTYPE_BOS << 8, 0, 5, buf) < 0);
+    CHECK(control(VND_IN, MSOS_CODE, 0, USB_MSOS20_DESCRIPTOR_INDEX, 0xFF, buf) < 0);
+    usbd_reg_bos(&udev, &platform);
+
+    /* BOS header first, then the whole descriptor */
+    memset(buf, 0, sizeof(buf));
+    CHECK_EQ(control(STD_IN, USB_STD_GET_DESCRIPTOR, USB_DTYPE_BOS << 8, 0, 5, buf), 5);
+    CHECK(memcmp(buf, &bos_desc, 5) == 0);
+    CHECK_EQ(buf[5], 0);
+    CHECK_EQ(control(STD_IN, USB_STD_GET_DESCRIPTOR, USB_DTYPE_BOS << 8, 0, sizeof(buf), buf),
+             sizeof(bos_desc));
+    CHECK(memcmp(buf, &bos_desc, sizeof(bos_desc)) == 0);
+    /* wLength between the packets */
+    CHECK_EQ(control(STD_IN, USB_STD_GET_DESCRIPTOR, USB_DTYPE_BOS << 8, 0, 19, buf), 19);
+
+    /* MS OS 2.0 descriptor set, full and clamped */
+    CHECK_EQ(control(VND_IN, MSOS_CODE, 0, USB_MSOS20_DESCRIPTOR_INDEX, sizeof(buf), buf),
+             sizeof(msos_desc));
+    CHECK(memcmp(buf, &msos_desc, sizeof(msos_desc)) == 0);
+    CHECK_EQ(control(VND_IN, MSOS_CODE, 0, USB_MSOS20_DESCRIPTOR_INDEX, 10, buf), 10);
+    /* wrong wIndex, code of the other platform and host to device are stalled */
+    CHECK(control(VND_IN, MSOS_CODE, 0, USB_MSOS20_SET_ALT_ENUM, sizeof(buf), buf) < 0);
+    CHECK(control(VND_IN, WEBUSB_CODE, 0, USB_MSOS20_DESCRIPTOR_INDEX, sizeof(buf), buf) < 0);
+    CHECK(control(VND_OUT, MSOS_CODE, 0, USB_MSOS20_DESCRIPTOR_INDEX, 0, 0) < 0);
+
+    /* WebUSB GET_URL, index starts from 1 */
+    CHECK_EQ(control(VND_IN, WEBUSB_CODE, 1, USB_WEBUSB_GET_URL, sizeof(buf), buf),
+             url_1.bLength);
+    CHECK_EQ(buf[0], 3 + strlen("github.com/dmitrystu/libusb_stm32"));
+    CHECK_EQ(buf[1], USB_DTYPE_WEBUSB_URL);
+    CHECK_EQ(buf[2], USB_WEBUSB_SCHEME_HTTPS);
+    CHECK(memcmp(&buf[3], "github.com/dmitrystu/libusb_stm32", buf[0] - 3) == 0);
+    CHECK_EQ(control(VND_IN, WEBUSB_CODE, 2, USB_WEBUSB_GET_URL, 3, buf), 3);
+    CHECK_EQ(buf[2], USB_WEBUSB_SCHEME_HTTP);
+    CHECK(control(VND_IN, WEBUSB_CODE, 0, USB_WEBUSB_GET_URL, sizeof(buf), buf) < 0);
+    CHECK(control(VND_IN, WEBUSB_CODE, 3, USB_WEBUSB_GET_URL, sizeof(buf), buf) < 0);
+    CHECK(control(VND_IN, WEBUSB_CODE, 0xFFFF, USB_WEBUSB_GET_URL, sizeof(buf), buf) < 0);
+    CHECK(control(VND_IN, MSOS_CODE, 1, USB_WEBUSB_GET_URL, sizeof(buf), buf) < 0);
+
+    /* control callback goes first */
+    usbd_reg_control(&udev, app_control);
+    CHECK_EQ(control(VND_IN, WEBUSB_CODE, 2, USB_WEBUSB_GET_URL, sizeof(buf), buf), 4);
+    CHECK(memcmp(buf, app_data, 4) == 0);
+    CHECK_EQ(control(VND_IN, APP_CODE, 0, 0, sizeof(buf), buf), 4);
+    CHECK_EQ(control(VND_IN, WEBUSB_CODE, 1, USB_WEBUSB_GET_URL, sizeof(buf), buf),
+             url_1.bLength);
+
+    /* removed */
+    usbd_reg_bos(&udev, 0);
+    CHECK(control(STD_IN, USB_STD_GET_DESCRIPTOR, USB_DTYPE_BOS << 8, 0, 5, buf) < 0);
+    CHECK(control(VND_IN, WEBUSB_CODE, 1, USB_WEBUSB_GET_URL, sizeof(buf), buf) < 0);
+    return TEST_DONE();
+}
@@ -0,0 +1,132 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Enumerates the CDC loopback demo on the simulated driver and checks the descriptors
+ * and the driver call and copy counters.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "test.h"
+
+#define main cdc_demo_main
+#include "../demo/cdc_loop.c"
+#undef main
+
+static int32_t control(uint8_t type, uint8_t req, uint16_t value, uint16_t index,
+                       uint16_t length, void *data) {
+    usbd_ctlreq rq = {
+        .bmRequestType  = type,
+        .bRequest       = req,
+        .wValue         = value,
+        .wIndex         = index,
+        .wLength        = length,
+    };
+    return usb_sim_control(&udev, &rq, data);
+}
+
+static int32_t get_desc(uint16_t value, uint16_t length, void *data) {
+    return control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_DEVICE,
+                   USB_STD_GET_DESCRIPTOR, value, 0, length, data);
+}
+
+int main(void) {
+    struct usb_sim_stats st;
+    uint8_t buf[0x100];
+    uint32_t tx = 0;
+    int32_t len;
+
+    cdc_init_usbd();
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    usb_sim_get_stats(&st, true);
+    CHECK(st.enabled && st.connected);
+
+    /* device descriptor, first 8 bytes and then whole */
+    len = get_desc(USB_DTYPE_DEVICE << 8, 8, buf);
+    CHECK_EQ(len, 8);
+    CHECK(memcmp(buf, &device_desc, 8) == 0);
+    tx += len;
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_ADDRESS, 5, 0, 0, 0), 0);
+    usb_sim_get_stats(&st, false);
+    CHECK_EQ(st.address, 5);
+    len = get_desc(USB_DTYPE_DEVICE << 8, sizeof(buf), buf);
+    CHECK_EQ(len, sizeof(device_desc));
+    CHECK(memcmp(buf, &device_desc, sizeof(device_desc)) == 0);
+    tx += len;
+
+    /* configuration descriptor header and then whole set */
+    len = get_desc(USB_DTYPE_CONFIGURATION << 8, sizeof(struct usb_config_descriptor), buf);
+    CHECK_EQ(len, sizeof(struct usb_config_descriptor));
+    CHECK_EQ(buf[2] | (buf[3] << 8), sizeof(config_desc));
+    tx += len;
+    len = get_desc(USB_DTYPE_CONFIGURATION << 8, sizeof(buf), buf);
+    CHECK_EQ(len, sizeof(config_desc));
+    CHECK(memcmp(buf, &config_desc, sizeof(config_desc)) == 0);
+    tx += len;
+
+    /* string descriptors */
+    for (int i = 0; i < 3; i++) {
+        len = get_desc((USB_DTYPE_STRING << 8) | i, sizeof(buf), buf);
+        CHECK_EQ(len, dtable[i]->bLength);
+        CHECK(memcmp(buf, dtable[i], dtable[i]->bLength) == 0);
+        tx += len;
+    }
+    len = get_desc((USB_DTYPE_STRING << 8) | INTSERIALNO_DESCRIPTOR, sizeof(buf), buf);
+    CHECK_EQ(len, 18);
+    CHECK_EQ(buf[1], USB_DTYPE_STRING);
+    for (int i = 2; i < 18; i += 2) {
+        CHECK((buf[i] >= '0' && buf[i] <= '9') || (buf[i] >= 'A' && buf[i] <= 'F'));
+        CHECK_EQ(buf[i + 1], 0);
+    }
+    tx += len;
+    CHECK(get_desc((USB_DTYPE_STRING << 8) | 3, sizeof(buf), buf) < 0);
+
+    /* every descriptor byte is copied to EP0 exactly once and every SETUP is read once.
+     * 10 requests: 8 GET_DESCRIPTOR, the stalled one and SET_ADDRESS. EP0 is configured
+     * once by the bus reset.
+     */
+    usb_sim_get_stats(&st, true);
+    CHECK_EQ(st.tx_bytes, tx);
+    CHECK_EQ(st.rx_bytes, 10 * 8);
+    CHECK_EQ(st.calls[usb_sim_call_serialno], 1);
+    CHECK_EQ(st.calls[usb_sim_call_ep_config], 1);
+    CHECK_EQ(st.stalls, 1);
+
+    /* configuration configures three endpoints and primes the TX endpoint with a ZLP */
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_CONFIG, 1, 0, 0, 0), 0);
+    len = control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_DEVICE,
+                  USB_STD_GET_CONFIG, 0, 0, 1, buf);
+    CHECK_EQ(len, 1);
+    CHECK_EQ(buf[0], 1);
+    usb_sim_get_stats(&st, true);
+    CHECK_EQ(st.calls[usb_sim_call_ep_config], 3);
+    CHECK_EQ(st.rx_bytes, 2 * 8);
+    CHECK_EQ(st.tx_bytes, 1);
+
+    /* CDC class requests go to the registered class handler */
+    struct usb_cdc_line_coding lc;
+    len = control(USB_REQ_DEVTOHOST | USB_REQ_CLASS | USB_REQ_INTERFACE,
+                  USB_CDC_GET_LINE_CODING, 0, 0, sizeof(lc), &lc);
+    CHECK_EQ(len, sizeof(lc));
+    CHECK_EQ(lc.dwDTERate, 38400);
+    CHECK_EQ(control(USB_REQ_CLASS | USB_REQ_INTERFACE, USB_CDC_SET_CONTROL_LINE_STATE,
+                     3, 0, 0, 0), 0);
+    CHECK(control(USB_REQ_CLASS | USB_REQ_INTERFACE, 0x7F, 0, 0, 0, 0) < 0);
+
+    return TEST_DONE();
+}
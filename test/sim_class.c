@@ -0,0 +1,211 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Class handler registry on the simulated driver. Class requests are routed by the interface
+ * and endpoint tables to the handler with its context, requests without a handler and the
+ * standard requests processed by the core don't reach it. SET_CONFIGURATION and
+ * SET_INTERFACE are forwarded to the handlers.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define CLS_REQ_GET     0x01    /* returns 4-byte handler tag */
+#define CLS_REQ_SET     0x02    /* stores 4-byte handler tag */
+#define CLS_B_EP        0x83    /* endpoint bound to the handler B */
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+
+struct cls_ctx {
+    uint8_t     tag[4];
+    uint32_t    control;
+    uint32_t    stdreq;
+    uint32_t    config;
+    uint32_t    altset;
+    uint8_t     last_iface;
+};
+
+static struct cls_ctx ctx_a = {{'A', 'A', 'A', 'A'}}, ctx_b = {{'B', 'B', 'B', 'B'}};
+static uint32_t dev_control, dev_config;
+static uint32_t order;      /* SET_CONFIGURATION callback order */
+
+static usbd_respond cls_control(usbd_device *dev, void *ctx, usbd_ctlreq *req,
+                                usbd_rqc_callback *callback) {
+    struct cls_ctx *c = ctx;
+    (void)callback;
+    if ((req->bmRequestType & USB_REQ_TYPE) == USB_REQ_STANDARD) {
+        /* class descriptor of the interface */
+        c->stdreq++;
+        if (req->bRequest != USB_STD_GET_DESCRIPTOR) return usbd_fail;
+        dev->status.data_ptr = c->tag;
+        dev->status.data_count = sizeof(c->tag);
+        return usbd_ack;
+    }
+    c->control++;
+    switch (req->bRequest) {
+    case CLS_REQ_GET:
+        dev->status.data_ptr = c->tag;
+        dev->status.data_count = sizeof(c->tag);
+        return usbd_ack;
+    case CLS_REQ_SET:
+        memcpy(c->tag, req->data, sizeof(c->tag));
+        return usbd_ack;
+    default:
+        return usbd_fail;
+    }
+}
+
+static usbd_respond cls_config(usbd_device *dev, void *ctx, uint8_t cfg) {
+    struct cls_ctx *c = ctx;
+    (void)dev;
+    (void)cfg;
+    c->config = ++order;
+    return usbd_ack;
+}
+
+static usbd_respond cls_altset(usbd_device *dev, void *ctx, uint8_t iface, uint8_t alt) {
+    struct cls_ctx *c = ctx;
+    (void)dev;
+    c->altset++;
+    c->last_iface = iface;
+    return (alt < 2) ? usbd_ack : usbd_fail;
+}
+
+/* A has two interfaces with the alternate settings, B has one without */
+static const struct usbd_class cls_a = {
+    .control    = cls_control,
+    .config     = cls_config,
+    .altset     = cls_altset,
+};
+
+static const struct usbd_class cls_b = {
+    .control    = cls_control,
+    .config     = cls_config,
+};
+
+static usbd_respond app_control(usbd_device *dev, usbd_ctlreq *req, usbd_rqc_callback *callback) {
+    (void)dev;
+    (void)callback;
+    if ((req->bmRequestType & USB_REQ_TYPE) == USB_REQ_STANDARD) return usbd_fail;
+    dev_control++;
+    return (req->bRequest == CLS_REQ_SET) ? usbd_ack : usbd_fail;
+}
+
+static usbd_respond app_config(usbd_device *dev, uint8_t cfg) {
+    (void)dev;
+    (void)cfg;
+    dev_config = ++order;
+    return usbd_ack;
+}
+
+static int32_t control(uint8_t type, uint8_t req, uint16_t value, uint16_t index,
+                       uint16_t length, void *data) {
+    usbd_ctlreq rq = {
+        .bmRequestType  = type,
+        .bRequest       = req,
+        .wValue         = value,
+        .wIndex         = index,
+        .wLength        = length,
+    };
+    return usb_sim_control(&udev, &rq, data);
+}
+
+#define CLS_IN      (USB_REQ_DEVTOHOST | USB_REQ_CLASS)
+#define CLS_OUT     (USB_REQ_HOSTTODEV | USB_REQ_CLASS)
+
+int main(void) {
+    static const struct usbd_class spare[USBD_MAX_HANDLERS] = {{0}};
+    uint8_t buf[8];
+
+    usbd_init(&udev, &usbd_hw, 8, ubuf, sizeof(ubuf));
+    usbd_reg_control(&udev, app_control);
+    usbd_reg_config(&udev, app_config);
+    CHECK(usbd_reg_class(&udev, &cls_a, &ctx_a, 0, 2));
+    CHECK(usbd_reg_class(&udev, &cls_b, &ctx_b, 2, 1));
+    /* interfaces out of USBD_MAX_IFACES */
+    CHECK(!usbd_reg_class(&udev, &cls_b, &ctx_b, USBD_MAX_IFACES - 1, 2));
+    /* same callbacks and context take the same handler */
+    CHECK(usbd_reg_class(&udev, &cls_b, &ctx_b, 2, 1));
+    for (int i = 2; i < USBD_MAX_HANDLERS; i++) {
+        CHECK(usbd_reg_class(&udev, &spare[i], 0, USBD_MAX_IFACES - 1, 0));
+    }
+    CHECK(!usbd_reg_class(&udev, &spare[0], 0, USBD_MAX_IFACES - 1, 0));
+    CHECK(usbd_reg_class_ep(&udev, 2, CLS_B_EP));
+    CHECK(!usbd_reg_class_ep(&udev, 3, 0x84));
+
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    usbd_poll(&udev);
+
+    /* configuration goes to the config callback and then to every handler */
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_DEVICE, USB_STD_SET_CONFIG, 1, 0, 0, 0), 0);
+    CHECK_EQ(dev_config, 1);
+    CHECK_EQ(ctx_a.config, 2);
+    CHECK_EQ(ctx_b.config, 3);
+
+    /* class requests are routed by the interface with the entity in the high byte of wIndex */
+    CHECK_EQ(control(CLS_IN | USB_REQ_INTERFACE, CLS_REQ_GET, 0, 1, 8, buf), 4);
+    CHECK(memcmp(buf, "AAAA", 4) == 0);
+    CHECK_EQ(control(CLS_IN | USB_REQ_INTERFACE, CLS_REQ_GET, 0, 0x0502, 8, buf), 4);
+    CHECK(memcmp(buf, "BBBB", 4) == 0);
+    CHECK_EQ(control(CLS_OUT | USB_REQ_INTERFACE, CLS_REQ_SET, 0, 0, 4, "aaaa"), 4);
+    CHECK(memcmp(ctx_a.tag, "aaaa", 4) == 0);
+    CHECK(memcmp(ctx_b.tag, "BBBB", 4) == 0);
+    /* and by the bound endpoint */
+    CHECK_EQ(control(CLS_IN | USB_REQ_ENDPOINT, CLS_REQ_GET, 0, CLS_B_EP, 8, buf), 4);
+    CHECK(memcmp(buf, "BBBB", 4) == 0);
+    /* request not known by the handler isn't passed to the control callback */
+    CHECK(control(CLS_OUT | USB_REQ_INTERFACE, 0x7F, 0, 2, 0, 0) < 0);
+    CHECK_EQ(ctx_a.control, 2);
+    CHECK_EQ(ctx_b.control, 3);
+    CHECK_EQ(dev_control, 0);
+
+    /* interfaces and endpoints without handler go to the control callback */
+    CHECK_EQ(control(CLS_OUT | USB_REQ_INTERFACE, CLS_REQ_SET, 0, 3, 4, "cccc"), 4);
+    CHECK_EQ(control(CLS_OUT | USB_REQ_ENDPOINT, CLS_REQ_SET, 0, CLS_B_EP & 0x7F, 4, "cccc"), 4);
+    CHECK(control(CLS_IN | USB_REQ_INTERFACE, CLS_REQ_GET, 0, 3, 8, buf) < 0);
+    CHECK_EQ(dev_control, 3);
+    CHECK_EQ(ctx_a.control + ctx_b.control, 5);
+
+    /* standard requests not processed by the core reach the handler */
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_INTERFACE,
+                     USB_STD_GET_DESCRIPTOR, 0x2200, 2, 8, buf), 4);
+    CHECK(memcmp(buf, "BBBB", 4) == 0);
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_INTERFACE,
+                     USB_STD_GET_STATUS, 0, 2, 2, buf), 2);
+    CHECK_EQ(ctx_b.stdreq, 1);
+
+    /* SET_INTERFACE goes to the handler of the interface */
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_INTERFACE, USB_STD_SET_INTERFACE, 1, 1, 0, 0), 0);
+    CHECK_EQ(ctx_a.last_iface, 1);
+    CHECK(control(USB_REQ_STANDARD | USB_REQ_INTERFACE, USB_STD_SET_INTERFACE, 2, 1, 0, 0) < 0);
+    CHECK_EQ(ctx_a.altset, 2);
+    /* handler without the altset callback has the setting 0 only */
+    CHECK_EQ(control(USB_REQ_STANDARD | USB_REQ_INTERFACE, USB_STD_SET_INTERFACE, 0, 2, 0, 0), 0);
+    CHECK(control(USB_REQ_STANDARD | USB_REQ_INTERFACE, USB_STD_SET_INTERFACE, 1, 2, 0, 0) < 0);
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_INTERFACE,
+                     USB_STD_GET_INTERFACE, 0, 1, 1, buf), 1);
+    CHECK_EQ(buf[0], 1);
+    CHECK_EQ(control(USB_REQ_DEVTOHOST | USB_REQ_STANDARD | USB_REQ_INTERFACE,
+                     USB_STD_GET_INTERFACE, 0, 2, 1, buf), 1);
+    CHECK_EQ(buf[0], 0);
+    CHECK_EQ(ctx_b.altset, 0);
+    return TEST_DONE();
+}
@@ -0,0 +1,66 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Drain-all polling on the simulated driver. usbd_poll_budget() processes the pending
+ * events up to the budget and stops when the hardware is idle.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb.h"
+#include "test.h"
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static uint32_t nevt[8];
+
+static void bus_event(usbd_device *dev, uint8_t evt, uint8_t ep) {
+    (void)dev;
+    (void)ep;
+    nevt[evt & 0x07]++;
+}
+
+int main(void) {
+    usbd_init(&udev, &usbd_hw, 8, ubuf, sizeof(ubuf));
+    usbd_reg_event(&udev, usbd_evt_reset, bus_event);
+    usbd_reg_event(&udev, usbd_evt_sof, bus_event);
+    usbd_reg_event(&udev, usbd_evt_susp, bus_event);
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    CHECK_EQ(usbd_poll_budget(&udev, 0x10), 0);
+
+    /* three bus events are pending, the budget limits one call */
+    usb_sim_reset();
+    usb_sim_sof();
+    usb_sim_suspend(true);
+    CHECK_EQ(usbd_poll_budget(&udev, 2), 2);
+    CHECK(usb_sim_pending());
+    CHECK_EQ(nevt[usbd_evt_reset], 1);
+    CHECK_EQ(nevt[usbd_evt_sof], 1);
+    CHECK_EQ(nevt[usbd_evt_susp], 0);
+    /* the rest is drained and the call returns on the idle hardware */
+    CHECK_EQ(usbd_poll_budget(&udev, 0x10), 1);
+    CHECK(!usb_sim_pending());
+    CHECK_EQ(nevt[usbd_evt_susp], 1);
+    CHECK_EQ(usbd_poll_budget(&udev, 0x10), 0);
+
+    /* zero budget polls nothing */
+    usb_sim_sof();
+    CHECK_EQ(usbd_poll_budget(&udev, 0), 0);
+    CHECK(usb_sim_pending());
+    CHECK_EQ(usbd_poll_budget(&udev, 1), 1);
+    CHECK_EQ(nevt[usbd_evt_sof], 2);
+    return TEST_DONE();
+}
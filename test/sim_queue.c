@@ -0,0 +1,100 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Split mode event capture on the simulated driver. Capture stops while the event queue
+ * can't take one driver poll, and events stay pending in the hardware. OUT packets wait in the
+ * endpoint for the consumer, so ep_read in the event callback returns the packet lengths. One
+ * event stands for both packets of the doublebuffered endpoint received before the poll.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb.h"
+#include "test.h"
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static usbd_evt_queue queue;
+static usbd_evt_rec qbuf[16];
+static uint32_t nsof;
+static int32_t rxlen[2];
+static uint32_t nrx;
+
+#define Q_RXD_EP        0x01
+
+static void sof_event(usbd_device *dev, uint8_t evt, uint8_t ep) {
+    (void)dev;
+    (void)evt;
+    (void)ep;
+    nsof++;
+}
+
+static void rx_event(usbd_device *dev, uint8_t evt, uint8_t ep) {
+    uint8_t buf[0x40];
+    int32_t len;
+    (void)evt;
+    while ((len = usbd_ep_read(dev, ep, buf, sizeof(buf))) >= 0) {
+        rxlen[nrx++ & 0x01] = len;
+    }
+}
+
+int main(void) {
+    static const uint8_t data[0x40] = {0};
+    usbd_init(&udev, &usbd_hw, 8, ubuf, sizeof(ubuf));
+    usbd_queue_init(&udev, &queue, qbuf, 16);
+    usbd_reg_event(&udev, usbd_evt_sof, sof_event);
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    CHECK_EQ(usbd_poll_capture(&udev, 0x10), 1);
+    CHECK_EQ(usbd_process_queue(&udev, 0x10), 1);
+
+    /* queue takes events while it has room for one poll */
+    for (int i = 0; i <= 16 - USBD_HW_MAX_EP; i++) {
+        CHECK(usbd_queue_ready(&udev));
+        usb_sim_sof();
+        CHECK_EQ(usbd_poll_capture(&udev, 0x10), 1);
+    }
+    CHECK(!usbd_queue_ready(&udev));
+    usb_sim_sof();
+    CHECK_EQ(usbd_poll_capture(&udev, 0x10), 0);
+    CHECK(usb_sim_pending());
+    CHECK_EQ(queue.overflows, 0);
+
+    /* pending event is captured when the consumer frees the queue */
+    CHECK_EQ(usbd_process_queue(&udev, 1), 1);
+    CHECK_EQ(usbd_poll_capture(&udev, 0x10), 1);
+    CHECK(!usb_sim_pending());
+    CHECK_EQ(usbd_process_queue(&udev, 0x20), 16 - USBD_HW_MAX_EP + 1);
+    CHECK_EQ(nsof, 16 - USBD_HW_MAX_EP + 2);
+
+    /* budget is counted per call */
+    usb_sim_sof();
+    CHECK_EQ(usbd_poll_budget(&udev, 0x10), 1);
+    CHECK_EQ(usbd_poll_budget(&udev, 0x10), 0);
+    CHECK_EQ(nsof, 16 - USBD_HW_MAX_EP + 3);
+
+    /* records have no length, packets wait in the endpoint for the consumer */
+    CHECK(usbd_ep_config(&udev, Q_RXD_EP, USB_EPTYPE_BULK | USB_EPTYPE_DBLBUF, sizeof(data)));
+    usbd_reg_endpoint(&udev, Q_RXD_EP, rx_event);
+    CHECK_EQ(usb_sim_out(Q_RXD_EP, data, 17), 17);
+    CHECK_EQ(usb_sim_out(Q_RXD_EP, data, 40), 40);
+    CHECK_EQ(usbd_poll_capture(&udev, 0x10), 1);
+    CHECK_EQ(usbd_process_queue(&udev, 0x10), 1);
+    CHECK_EQ(nrx, 2);
+    CHECK_EQ(rxlen[0], 17);
+    CHECK_EQ(rxlen[1], 40);
+    return TEST_DONE();
+}
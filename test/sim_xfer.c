@@ -0,0 +1,116 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Endpoint transfers on the simulated driver. A static transfer descriptor is submitted
+ * again after completion and keeps its ZLP termination. OUT transfers that could truncate
+ * a packet are rejected.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usb.h"
+#include "test.h"
+
+#define XFER_TXD_EP     0x81
+#define XFER_RXD_EP     0x01
+#define XFER_SZ         0x08
+
+static usbd_device udev;
+static uint32_t ubuf[0x20];
+static uint8_t data[2 * XFER_SZ];
+static uint32_t ndone, nzlp, nrx;
+
+static void xfer_done(usbd_device *dev, uint8_t ep, usbd_xfer *xfer) {
+    (void)dev;
+    CHECK_EQ(ep, XFER_TXD_EP);
+    CHECK_EQ(xfer->count, sizeof(data));
+    ndone++;
+}
+
+static usbd_xfer xfer = {
+    .buf        = data,
+    .len        = sizeof(data),
+    .mps        = XFER_SZ,
+    .flags      = USBD_XFER_ZLP,
+    .complete   = xfer_done,
+};
+
+static void rx_done(usbd_device *dev, uint8_t ep, usbd_xfer *xfer) {
+    (void)dev;
+    CHECK_EQ(ep, XFER_RXD_EP);
+    CHECK_EQ(xfer->count, XFER_SZ + 5);
+    nrx++;
+}
+
+/* reads IN packets until the short one */
+static int32_t host_read(uint8_t *buf, uint16_t blen) {
+    int32_t res, cnt = 0;
+    for (int i = 0; i < 0x20; i++) {
+        res = usb_sim_in(XFER_TXD_EP & 0x07, &buf[cnt], blen - cnt);
+        usbd_poll(&udev);
+        if (res == usb_sim_nak) continue;
+        if (res < 0) return res;
+        cnt += res;
+        if (res == 0) nzlp++;
+        if (res < XFER_SZ) break;
+    }
+    return cnt;
+}
+
+int main(void) {
+    uint8_t buf[0x40];
+
+    for (unsigned i = 0; i < sizeof(data); i++) data[i] = i;
+    usbd_init(&udev, &usbd_hw, 8, ubuf, sizeof(ubuf));
+    usbd_enable(&udev, true);
+    usbd_connect(&udev, true);
+    usb_sim_reset();
+    usbd_poll(&udev);
+    CHECK(usbd_ep_config(&udev, XFER_TXD_EP, USB_EPTYPE_BULK, XFER_SZ));
+    CHECK(usbd_ep_config(&udev, XFER_RXD_EP, USB_EPTYPE_BULK, XFER_SZ));
+
+    for (int n = 1; n <= 3; n++) {
+        CHECK(usbd_ep_submit(&udev, XFER_TXD_EP, &xfer));
+        CHECK_EQ(host_read(buf, sizeof(buf)), sizeof(data));
+        CHECK(memcmp(buf, data, sizeof(data)) == 0);
+        /* ZLP is sent for every submission */
+        CHECK_EQ(ndone, n);
+        CHECK_EQ(nzlp, n);
+        CHECK_EQ(xfer.flags, USBD_XFER_ZLP);
+    }
+
+    /* transfer without the max packet size is rejected */
+    usbd_xfer bad = {.buf = data, .len = sizeof(data), .flags = USBD_XFER_ZLP};
+    CHECK(!usbd_ep_submit(&udev, XFER_TXD_EP, &bad));
+    CHECK(!usbd_ep_submit(&udev, XFER_RXD_EP, &bad));
+
+    /* OUT buffer is a multiple of the max packet size, so a packet never gets truncated */
+    uint8_t rx[2 * XFER_SZ];
+    usbd_xfer orx = {.buf = rx, .len = XFER_SZ + 4, .mps = XFER_SZ, .complete = rx_done};
+    CHECK(!usbd_ep_submit(&udev, XFER_RXD_EP, &orx));
+    orx.len = 0;
+    CHECK(!usbd_ep_submit(&udev, XFER_RXD_EP, &orx));
+    orx.len = sizeof(rx);
+    CHECK(usbd_ep_submit(&udev, XFER_RXD_EP, &orx));
+    CHECK_EQ(usb_sim_out(XFER_RXD_EP, data, XFER_SZ), XFER_SZ);
+    usbd_poll(&udev);
+    CHECK_EQ(nrx, 0);
+    CHECK_EQ(usb_sim_out(XFER_RXD_EP, data + XFER_SZ, 5), 5);
+    usbd_poll(&udev);
+    CHECK_EQ(nrx, 1);
+    CHECK(memcmp(rx, data, XFER_SZ + 5) == 0);
+    return TEST_DONE();
+}
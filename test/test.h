@@ -0,0 +1,42 @@
+/* This file is the part of the Lightweight USB device Stack for STM32 microcontrollers
+ *
+ * Copyright ©2016 Dmitry Filimonchuk <dmitrystu[at]gmail[dot]com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TEST_H_
+#define _TEST_H_
+
+#include <stdio.h>
+
+/* Host test helpers. Failed checks are reported and counted, main() returns the count. */
+static int test_fails;
+
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_fails++;                                                   \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_EQ(a, b) do {                                                 \
+        long _a = (long)(a), _b = (long)(b);                                \
+        if (_a != _b) {                                                     \
+            printf("%s:%d: %s == %ld, expected %ld\n",                      \
+                   __FILE__, __LINE__, #a, _a, _b);                         \
+            test_fails++;                                                   \
+        }                                                                   \
+    } while (0)
+
+#define TEST_DONE() ((test_fails) ? (printf("%d check(s) failed\n", test_fails), 1) : 0)
+
+#endif //_TEST_H_
@@ -19,7 +19,15 @@
     extern "C" {
 #endif
 
-#if defined(STM32L052xx) || defined(STM32L053xx) || \
+#if defined(USBD_EMU) && !defined(FORCE_C_DRIVER)
+    /* emulated hardware runs only C drivers */
+    #define FORCE_C_DRIVER
+#endif
+
+#if defined(USBD_SIM)
+    #define USE_SIM_DRIVER
+
+#elif defined(STM32L052xx) || defined(STM32L053xx) || \
     defined(STM32L062xx) || defined(STM32L063xx) || \
     defined(STM32L072xx) || defined(STM32L073xx) || \
     defined(STM32L082xx) || defined(STM32L083xx) || \
@@ -47,11 +55,24 @@
     #error Unsupported STM32 family
 #endif
 
+/* number of the hardware endpoints including EP0 */
+#if defined(USE_STMV2_DRIVER)
+    #define USBD_HW_MAX_EP  6
+#else
+    #define USBD_HW_MAX_EP  8
+#endif
 
 #include "inc/usbd_core.h"
 #if !defined(__ASSEMBLER__)
     #include "inc/usb_std.h"
-    #if defined(USE_STMV0A_DRIVER)
+    #include "inc/usbd_composite.h"
+    #if defined(USBD_SIM) || defined(USBD_EMU)
+        #include "inc/usb_sim.h"
+    #endif
+    #if defined(USE_SIM_DRIVER)
+        extern const struct usbd_driver usb_sim;
+        #define usbd_hw usb_sim
+    #elif defined(USE_STMV0A_DRIVER)
         extern const struct usbd_driver usb_stmv0a;
         #define usbd_hw usb_stmv0a
     #elif defined(USE_STMV0_DRIVER)